@@ -1,5 +1,6 @@
 #include "integrator.h"
 
+#include <algorithm>
 #include <ranges>
 
 namespace flow {
@@ -13,7 +14,7 @@ vec3f NormalIntegrator::li(const Ray &ray, const Scene &scene, RNG &rng) const {
 }
 
 vec3f PathIntegrator::trace_path(const Ray &ray, const Scene &scene, RNG &rng,
-                                 int16_t bounces) const {
+                                 int16_t bounces, double bsdf_pdf) const {
   if (bounces <= 0) {
     return vec3f(0.0);
   }
@@ -21,15 +22,22 @@ vec3f PathIntegrator::trace_path(const Ray &ray, const Scene &scene, RNG &rng,
   if (!res.has_value()) {
     return vec3f(0.0);
   }
-  // printf("hit\n");
   auto rec = res.value();
-
-  return rec.normal;
-  // return rec.normal;
   auto mesh = rec.mesh;
   auto material = mesh->material;
 
+  auto is_light = [](const Mesh &m) { return m.material.is_light(); };
+  auto lights = scene.meshes | std::views::filter(is_light);
+  auto light_count = std::ranges::distance(lights);
+
+  // a light reached by a bounce could also have been picked by next-event
+  // estimation at the previous hit, so its emission is weighted against
+  // that (balance heuristic)
   auto emitted = material.emit();
+  if (bsdf_pdf > 0.0 && material.is_light()) {
+    double light_pdf = mesh->pdf(ray.origin, ray.dir) / light_count;
+    emitted *= bsdf_pdf / (bsdf_pdf + light_pdf);
+  }
 
   if (res->is_inside) {
     return emitted;
@@ -41,32 +49,40 @@ vec3f PathIntegrator::trace_path(const Ray &ray, const Scene &scene, RNG &rng,
   }
 
   auto scatter_record = scatter.value();
-  double prob = 0.5;
-  vec3f next_dir = scatter_record.dir;
-  // printf("%f\n", rng.next_1f());
-  if (rng.next_1f() < prob) {
-    auto is_light = [](const Mesh &m) { return m.material.is_light(); };
-    auto filtered = scene.meshes | std::views::filter(is_light);
-    auto mesh = filtered.base().data();
-    vec3f p = mesh->sample_point(rec.position, rng);
-    next_dir = glm::normalize(p - rec.position);
-  }
-
-  auto pdf = 0.5 * material.pdf(-ray.dir, rec.normal, next_dir) +
-             0.5 * mesh->pdf(rec.position, next_dir);
+  auto origin = rec.position + rec.normal * 0.0001;
 
-  if (pdf < 0.0001) {
-    return emitted;
+  // next-event estimation: a point on one light picked uniformly, counted
+  // only when nothing blocks the way to it
+  vec3f direct(0.0);
+  if (light_count > 0) {
+    auto pick = std::min<std::ptrdiff_t>(rng.next_1f() * light_count,
+                                         light_count - 1);
+    auto light = std::ranges::next(lights.begin(), pick);
+    vec3f p = light->sample_point(rec.position, rng);
+    double distance = glm::length(p - origin);
+    vec3f light_dir = (p - origin) / distance;
+    auto shadow_ray = Ray{.origin = origin, .dir = light_dir};
+    double light_pdf = light->pdf(origin, light_dir) / light_count;
+    if (light_pdf > 0.0 &&
+        !scene.occluded(shadow_ray, 0.001, distance * (1.0 - 0.0001))) {
+      double scatter_pdf = material.pdf(-ray.dir, rec.normal, light_dir);
+      direct = scatter_record.attenuation * scatter_pdf *
+               light->material.emit() / (light_pdf + scatter_pdf);
+    }
   }
 
-  auto next_ray =
-      Ray{.origin = rec.position + rec.normal * 0.0001, .dir = next_dir};
-  auto scatter_pdf = material.pdf(-ray.dir, rec.normal, next_dir);
-  // printf("scatter pdf %f\n", scatter_pdf);
-  auto scattered_color = scatter_record.attenuation * scatter_pdf *
-                         trace_path(next_ray, scene, rng, bounces - 1) / pdf;
+  // the bounce follows the material's own sampling and hands its pdf on,
+  // so the lights it reaches get the other half of the weighting
+  auto next_ray = Ray{.origin = origin, .dir = scatter_record.dir};
+  double scatter_pdf = material.pdf(-ray.dir, rec.normal, scatter_record.dir);
+  if (scatter_pdf <= 0.0) {
+    return emitted + direct;
+  }
+  auto scattered_color =
+      scatter_record.attenuation *
+      trace_path(next_ray, scene, rng, bounces - 1, scatter_pdf);
 
-  return emitted + scattered_color;
+  return emitted + direct + scattered_color;
 }
 
 vec3f PathIntegrator::li(const Ray &ray, const Scene &scene, RNG &rng) const {
@@ -10,8 +10,11 @@ struct NormalIntegrator {
 };
 
 struct PathIntegrator {
+  // `bsdf_pdf` is the density the previous bounce sampled `ray` with, used
+  // to weight emission against next-event estimation; 0 for camera rays,
+  // whose emission counts in full.
   vec3f trace_path(const Ray &ray, const Scene &scene, RNG &rng,
-                   int16_t bounces) const;
+                   int16_t bounces, double bsdf_pdf = 0.0) const;
   vec3f li(const Ray &ray, const Scene &scene, RNG &rng) const;
 };
 
@@ -1,7 +1,36 @@
 
+#include "rng.h"
 #include "scene_parser.h"
+#include "scenes.h"
+#include <cstdio>
+
+// Next-event estimation picks one light per bounce, so a floor point under
+// two lights has to come out as bright as the sum of each light on its own.
+bool check_two_lights() {
+  flow::RNG rng;
+  auto radiance = [&](bool left_on, bool right_on) {
+    auto scene = build_two_light_scene(left_on, right_on);
+    auto ray = flow::Ray{.origin = glm::dvec3(0.0, 1.0, 0.0),
+                         .dir = glm::dvec3(0.0, -1.0, 0.0)};
+    glm::dvec3 sum(0.0);
+    int samples = 100000;
+    for (int i = 0; i < samples; i++) {
+      sum += scene.integrator.li(ray, scene, rng);
+    }
+    return sum / double(samples);
+  };
+  auto both = radiance(true, true);
+  auto sum = radiance(true, false) + radiance(false, true);
+  double error = glm::abs(both.x - sum.x) / sum.x;
+  printf("two lights: %f, each on its own: %f\n", both.x, sum.x);
+  return error < 0.02;
+}
 
 int main() {
+  if (!check_two_lights()) {
+    return 1;
+  }
+
   // auto scene = build_triangle_scene();
   // // auto [scene, camera, film] = build_cornell_scene();
 
@@ -2,6 +2,7 @@
 #include "sampling.h"
 #include "util.h"
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <glm/common.hpp>
 #include <glm/ext/matrix_transform.hpp>
@@ -87,13 +88,29 @@ double Material::pdf(const glm::dvec3 &wo, const glm::dvec3 &n,
       m);
 }
 
+namespace {
+
+// Model matrices are affine, so the inverse is the inverse of the linear
+// part, from its cofactors, followed by the translation taken back.
+glm::mat4 affine_inverse(const glm::mat4 &m) {
+  glm::vec3 x(m[0]), y(m[1]), z(m[2]), t(m[3]);
+  float inv_det = 1.0f / glm::dot(x, glm::cross(y, z));
+  glm::mat3 cofactors(glm::cross(y, z), glm::cross(z, x), glm::cross(x, y));
+  glm::mat3 linear = glm::transpose(cofactors) * inv_det;
+  glm::mat4 result(linear);
+  result[3] = glm::vec4(-(linear * t), 1.0f);
+  return result;
+}
+
+} // namespace
+
 Transform Transform::from_imodel(const glm::mat4 &imodel) {
-  auto model = glm::inverse(imodel);
+  auto model = affine_inverse(imodel);
   return Transform{.model = model, .imodel = imodel};
 }
 
 Transform Transform::from_model(const glm::mat4 &model) {
-  auto imodel = glm::inverse(model);
+  auto imodel = affine_inverse(model);
   return Transform{.model = model, .imodel = imodel};
 }
 
@@ -109,6 +126,40 @@ Ray Camera::get_ray(double s, double t) const {
   return Ray{.origin = origin, .dir = glm::normalize(dir)};
 }
 
+namespace {
+
+HitRecord make_hit_record(const Mesh &mesh, const Ray &ray, double t,
+                          const glm::dvec3 &v0, const glm::dvec3 &v1,
+                          const glm::dvec3 &v2) {
+  auto rec = HitRecord{
+      .position = ray.at(t),
+      .normal = glm::normalize(glm::cross(v1 - v0, v2 - v0)),
+      .t = t,
+      .mesh = &mesh,
+      .is_inside = false,
+  };
+  if (glm::dot(ray.dir, rec.normal) > 0.0) {
+    rec.normal = -rec.normal;
+    rec.is_inside = true;
+  }
+  return rec;
+}
+
+Flow::Ray to_flow_ray(const Ray &ray) {
+  return Flow::Ray{
+      .origin = Flow::Vec3f(ray.origin.x, ray.origin.y, ray.origin.z),
+      .direction = Flow::Vec3f(ray.dir.x, ray.dir.y, ray.dir.z)};
+}
+
+// Smallest float bound that does not cut off a hit at `t`.
+float float_bound(double t) {
+  return t < std::numeric_limits<float>::max()
+             ? std::nextafter(float(t), std::numeric_limits<float>::infinity())
+             : std::numeric_limits<float>::infinity();
+}
+
+} // namespace
+
 std::optional<HitRecord> Mesh::hit(const Ray &ray, double tmin,
                                    double tmax) const {
   std::optional<HitRecord> res{std::nullopt};
@@ -120,29 +171,7 @@ std::optional<HitRecord> Mesh::hit(const Ray &ray, double tmin,
     double t;
     if (ray_triangle_intersect(ray, v0, v1, v2, t) && t > tmin &&
         t < closest_so_far) {
-      // printf("hit\n");
-      if (res.has_value()) {
-        res->position = ray.at(t);
-        res->t = t;
-        res->normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
-        res->is_inside = false;
-        if (glm::dot(ray.dir, res->normal) > 0.0) {
-          res->normal = -res->normal;
-          res->is_inside = true;
-        }
-      } else {
-        res = std::make_optional(HitRecord{
-            .position = ray.at(t),
-            .normal = glm::normalize(glm::cross(v1 - v0, v2 - v0)),
-            .t = t,
-            .mesh = this,
-            .is_inside = false,
-        });
-        if (glm::dot(ray.dir, res->normal) > 0.0) {
-          res->normal = -res->normal;
-          res->is_inside = true;
-        }
-      }
+      res = make_hit_record(*this, ray, t, v0, v1, v2);
       closest_so_far = t;
     }
   }
@@ -151,7 +180,7 @@ std::optional<HitRecord> Mesh::hit(const Ray &ray, double tmin,
 
 std::optional<double> Mesh::hit_p(const Ray &ray, double tmin,
                                   double tmax) const {
-  bool is_hit;
+  bool is_hit = false;
   double closest_so_far = tmax;
   for (int i = 0; i < indices.size(); i += 3) {
     const auto &v0 = positions[indices[i]];
@@ -168,19 +197,17 @@ std::optional<double> Mesh::hit_p(const Ray &ray, double tmin,
   return res;
 }
 
-std::optional<double> Scene::hit_p(const Ray &ray, double tmin,
-                                   double tmax) const {
-  bool is_hit = false;
-  double closest_so_far = tmax;
-  for (int i = 0; i < meshes.size(); i++) {
-    auto res = meshes[i].hit_p(ray, tmin, closest_so_far);
-    if (res.has_value()) {
-      closest_so_far = res.value();
-      is_hit = true;
+bool Mesh::occluded(const Ray &ray, double tmin, double tmax) const {
+  for (int i = 0; i < indices.size(); i += 3) {
+    double t;
+    if (ray_triangle_intersect(ray, positions[indices[i]],
+                               positions[indices[i + 1]],
+                               positions[indices[i + 2]], t) &&
+        t > tmin && t < tmax) {
+      return true;
     }
   }
-  auto res = is_hit ? std::make_optional(closest_so_far) : std::nullopt;
-  return res;
+  return false;
 }
 
 glm::dvec3 Mesh::sample_point(const glm::dvec3 &target, RNG &rng) const {
@@ -197,6 +224,8 @@ glm::dvec3 Mesh::sample_point(const glm::dvec3 &target, RNG &rng) const {
   return v0 + (v1 - v0) * u + (v2 - v0) * v;
 }
 
+// The density of sampling `dir` from this mesh's area, so only the mesh
+// itself is intersected, not what may block it.
 double Mesh::pdf(const glm::dvec3 &origin, const glm::dvec3 &dir) const {
   Ray ray{.origin = origin, .dir = dir};
   auto h = hit(ray, 0.0001, std::numeric_limits<double>::max());
@@ -212,18 +241,98 @@ double Mesh::pdf(const glm::dvec3 &origin, const glm::dvec3 &dir) const {
   return 0.0;
 }
 
+void Scene::build_bvh() {
+  triangles.clear();
+  std::vector<Flow::Bounds3f> bounds;
+  for (uint32_t m = 0; m < meshes.size(); m++) {
+    auto &mesh = meshes[m];
+    for (uint32_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+      triangles.push_back(TriangleRef{.mesh = m, .first_index = i});
+      Flow::Bounds3f b;
+      for (int k = 0; k < 3; k++) {
+        auto &p = mesh.positions[mesh.indices[i + k]];
+        // rounded outwards, so the float bounds hold the double triangle
+        b.extend(Flow::Vec3f(std::nextafter(float(p.x), -INFINITY),
+                             std::nextafter(float(p.y), -INFINITY),
+                             std::nextafter(float(p.z), -INFINITY)));
+        b.extend(Flow::Vec3f(std::nextafter(float(p.x), INFINITY),
+                             std::nextafter(float(p.y), INFINITY),
+                             std::nextafter(float(p.z), INFINITY)));
+      }
+      bounds.push_back(b);
+    }
+  }
+  bvh = Flow::Bvh::build(bounds);
+}
+
+namespace {
+
+bool hit_triangle(const Scene &scene, uint32_t index, const Ray &ray,
+                  double &t) {
+  auto &triangle = scene.triangles[index];
+  auto &mesh = scene.meshes[triangle.mesh];
+  auto *first = mesh.indices.data() + triangle.first_index;
+  return ray_triangle_intersect(ray, mesh.positions[first[0]],
+                                mesh.positions[first[1]],
+                                mesh.positions[first[2]], t);
+}
+
+// The BVH prunes in float; triangles are still tested in double.
+template <typename F>
+bool hit_triangles(const Scene &scene, const Ray &ray, double tmin,
+                   double &closest_so_far, F &&on_hit) {
+  float t_bound = float_bound(closest_so_far);
+  return scene.bvh.traverse(
+      to_flow_ray(ray), t_bound, [&](uint32_t index, float &t_bound) {
+        auto &triangle = scene.triangles[index];
+        auto &mesh = scene.meshes[triangle.mesh];
+        const auto &v0 = mesh.positions[mesh.indices[triangle.first_index]];
+        const auto &v1 =
+            mesh.positions[mesh.indices[triangle.first_index + 1]];
+        const auto &v2 =
+            mesh.positions[mesh.indices[triangle.first_index + 2]];
+        double t;
+        if (!ray_triangle_intersect(ray, v0, v1, v2, t) || t <= tmin ||
+            t >= closest_so_far) {
+          return false;
+        }
+        closest_so_far = t;
+        t_bound = float_bound(t);
+        on_hit(mesh, t, v0, v1, v2);
+        return true;
+      });
+}
+
+} // namespace
+
+std::optional<double> Scene::hit_p(const Ray &ray, double tmin,
+                                   double tmax) const {
+  double closest_so_far = tmax;
+  if (!hit_triangles(*this, ray, tmin, closest_so_far,
+                     [](auto &&...) {})) {
+    return std::nullopt;
+  }
+  return closest_so_far;
+}
+
+bool Scene::occluded(const Ray &ray, double tmin, double tmax) const {
+  return bvh.traverse_any(to_flow_ray(ray), float_bound(tmax),
+                          [&](uint32_t index, float) {
+                            double t;
+                            return hit_triangle(*this, index, ray, t) &&
+                                   t > tmin && t < tmax;
+                          });
+}
+
 std::optional<HitRecord> Scene::hit(const Ray &ray, double tmin,
                                     double tmax) const {
   std::optional<HitRecord> rec{std::nullopt};
   double closest_so_far = tmax;
-  for (int i = 0; i < meshes.size(); i++) {
-    auto res = meshes[i].hit(ray, tmin, closest_so_far);
-    if (res.has_value()) {
-      auto current_rec = res.value();
-      closest_so_far = current_rec.t;
-      rec = current_rec;
-    }
-  }
+  hit_triangles(*this, ray, tmin, closest_so_far,
+                [&](const Mesh &mesh, double t, const glm::dvec3 &v0,
+                    const glm::dvec3 &v1, const glm::dvec3 &v2) {
+                  rec = make_hit_record(mesh, ray, t, v0, v1, v2);
+                });
   return rec;
 }
 
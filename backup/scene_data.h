@@ -1,4 +1,5 @@
 #pragma once
+#include "bvh.h"
 #include "integrator.h"
 #include <cstdint>
 #include <optional>
@@ -60,7 +61,7 @@ struct HitRecord {
 
 struct Mesh {
   std::vector<vec3f> positions;
-  std::vector<uint16_t> indices;
+  std::vector<uint32_t> indices;
   Material material;
 
   double area() const {
@@ -79,6 +80,9 @@ struct Mesh {
 
   std::optional<double> hit_p(const Ray &ray, double tmin, double tmax) const;
 
+  // Whether any triangle is hit in (tmin, tmax); stops at the first one.
+  bool occluded(const Ray &ray, double tmin, double tmax) const;
+
   std::optional<HitRecord> hit(const Ray &ray, double tmin, double tmax) const;
 };
 
@@ -111,6 +115,12 @@ struct Camera {
   Ray get_ray(double s, double t) const;
 };
 
+// A triangle of a Scene: its mesh and the position of its first index.
+struct TriangleRef {
+  uint32_t mesh;
+  uint32_t first_index;
+};
+
 struct Scene {
   std::vector<Mesh> meshes;
   Camera camera;
@@ -119,11 +129,21 @@ struct Scene {
   uint16_t height;
   int16_t bounces;
   int16_t samples;
+  // over every triangle of every mesh, filled by build_bvh()
+  Flow::Bvh bvh;
+  std::vector<TriangleRef> triangles;
 
   void add(const Mesh &mesh) { meshes.push_back(mesh); }
 
+  // Has to be called once the meshes are in place, before any hit query.
+  void build_bvh();
+
   std::optional<double> hit_p(const Ray &ray, double tmin, double tmax) const;
 
+  // Any-hit query for shadow and light visibility rays: stops at the first
+  // triangle hit in (tmin, tmax) and builds no HitRecord.
+  bool occluded(const Ray &ray, double tmin, double tmax) const;
+
   std::optional<HitRecord> hit(const Ray &ray, double tmin, double tmax) const;
 };
 
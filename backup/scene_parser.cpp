@@ -1,45 +1,60 @@
 #include "scene_parser.h"
 #include <array>
 #include <cassert>
+#include <charconv>
 #include <cstring>
 #include <optional>
 #include <pugixml.hpp>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
 namespace Mitsuba {
-static std::unordered_map<std::string, Sampler> samplers;
-static std::unordered_map<std::string, int> integers;
-static std::unordered_map<std::string, Integrator> integrators;
-static std::unordered_map<std::string, BSDF> bsdfs;
-std::vector<std::string> tokenize(const std::string &string,
-                                  const std::string &delim = ", ",
-                                  bool includeEmpty = false) {
-  std::string::size_type lastPos = 0,
-                         pos = string.find_first_of(delim, lastPos);
-  std::vector<std::string> tokens;
+namespace {
 
-  while (lastPos != std::string::npos) {
-    if (pos != lastPos || includeEmpty)
-      tokens.push_back(string.substr(lastPos, pos - lastPos));
-    lastPos = pos;
-    if (lastPos != std::string::npos) {
-      lastPos += 1;
-      pos = string.find_first_of(delim, lastPos);
+// State of one load_scene call. Keys point into the xml document, which
+// outlives the context, so concurrent loads share nothing.
+struct LoadContext {
+  std::unordered_map<std::string_view, int> integers;
+  std::unordered_map<std::string_view, Integrator> integrators;
+  std::unordered_map<std::string_view, BSDF> bsdfs;
+  // first malformed value, load_scene fails if it is set
+  std::optional<std::string> error;
+
+  void fail(std::string message) {
+    if (!error) {
+      error = std::move(message);
     }
   }
+};
 
-  return tokens;
-}
-
-float to_float(const std::string &str) {
-  char *end_ptr = nullptr;
-  float result = (float)strtof(str.c_str(), &end_ptr);
-  if (*end_ptr != '\0')
-    printf("something is wrong\n");
-  // throw std::runtime_error("wrong format");
-  return result;
+// Reads `n` floats separated by commas or whitespace straight from the
+// attribute text.
+template <size_t n>
+std::array<float, n> parse_floats(LoadContext &context, const char *value) {
+  std::array<float, n> values{};
+  const char *p = value;
+  const char *end = value + strlen(value);
+  size_t count = 0;
+  while (count < n) {
+    p += strspn(p, ", \t\r\n");
+    if (p == end) {
+      break;
+    }
+    auto [next, error] = std::from_chars(p, end, values[count]);
+    if (error != std::errc()) {
+      context.fail("invalid number in \"" + std::string(value) + "\"");
+      return values;
+    }
+    p = next;
+    count++;
+  }
+  if (count != n) {
+    context.fail("expected " + std::to_string(n) + " numbers in \"" +
+                 std::string(value) + "\"");
+  }
+  return values;
 }
 
 float parse_float(pugi::xml_node &node) {
@@ -47,48 +62,39 @@ float parse_float(pugi::xml_node &node) {
   return node.attribute("value").as_float();
 }
 
-std::optional<std::string>
+std::optional<std::string_view>
 parse_reference_key(pugi::xml_node &node,
                     const char *attribute_name = "value") {
-  auto value = std::string(node.attribute(attribute_name).as_string());
+  auto value = std::string_view(node.attribute(attribute_name).as_string());
   if (value.length() > 0 && value.at(0) == '$') {
-    auto key = value.substr(1);
-    return key;
+    return value.substr(1);
   }
   return std::nullopt;
 }
 
-int parse_integer(pugi::xml_node &node) {
+int parse_integer(LoadContext &context, pugi::xml_node &node) {
   assert(strcmp(node.name(), "integer") == 0);
-  auto value = std::string(node.attribute("value").as_string());
   auto res = parse_reference_key(node);
   if (res.has_value()) {
     auto key = res.value();
-    if (integers.contains(key)) {
-      return integers.at(key);
+    if (auto integer = context.integers.find(key);
+        integer != context.integers.end()) {
+      return integer->second;
     }
-    throw std::runtime_error("reference " + key + " is not present");
+    throw std::runtime_error("reference " + std::string(key) +
+                             " is not present");
   }
   return node.attribute("value").as_int();
 }
 
-std::array<float, 16> parse_transform(pugi::xml_node &node) {
+std::array<float, 16> parse_transform(LoadContext &context,
+                                      pugi::xml_node &node) {
   assert(strcmp(node.name(), "transform") == 0);
   auto matrix_node = node.child("matrix");
-  auto value = matrix_node.attribute("value").value();
-  std::array<float, 16> values;
-  auto tokens = tokenize(value);
-
-  if (tokens.size() != 16) {
-    printf("wrong size of tokens\n");
-  }
-  for (int i = 0; i < 16; i++) {
-    values[i] = to_float(tokens[i]);
-  }
-  return values;
+  return parse_floats<16>(context, matrix_node.attribute("value").value());
 }
 
-Sampler parse_sampler(pugi::xml_node &node) {
+Sampler parse_sampler(LoadContext &context, pugi::xml_node &node) {
   assert(strcmp(node.name(), "sampler") == 0);
   auto type = node.attribute("type").value();
   Sampler sampler;
@@ -96,7 +102,7 @@ Sampler parse_sampler(pugi::xml_node &node) {
     sampler.type = INDEPENDENT;
   }
   auto sample_count_node = node.find_child_by_attribute("name", "sample_count");
-  sampler.spp = parse_integer(sample_count_node);
+  sampler.spp = parse_integer(context, sample_count_node);
   return sampler;
 }
 
@@ -127,14 +133,14 @@ FilterType parse_filter_type(pugi::xml_node &node) {
   throw std::runtime_error("unsupported filter type");
 }
 
-Film parse_film(pugi::xml_node &node) {
+Film parse_film(LoadContext &context, pugi::xml_node &node) {
   assert(strcmp(node.name(), "film") == 0);
   Film film;
   for (auto child = node.first_child(); child; child = child.next_sibling()) {
     if (strcmp(child.attribute("name").value(), "width") == 0) {
-      film.width = parse_integer(child);
+      film.width = parse_integer(context, child);
     } else if (strcmp(child.attribute("name").value(), "height") == 0) {
-      film.height = parse_integer(child);
+      film.height = parse_integer(context, child);
     } else if (strcmp(child.attribute("name").value(), "file_format") == 0) {
       film.file_format = parse_file_format(child);
     } else if (strcmp(child.attribute("name").value(), "pixel_format") == 0) {
@@ -146,24 +152,26 @@ Film parse_film(pugi::xml_node &node) {
   return film;
 }
 
-Integrator parse_integrator(pugi::xml_node &node) {
+Integrator parse_integrator(LoadContext &context, pugi::xml_node &node) {
   assert(strcmp(node.name(), "integrator") == 0);
   auto res = parse_reference_key(node, "type");
   if (res.has_value()) {
     auto key = res.value();
-    if (integrators.contains(key)) {
-      auto &integrator = integrators.at(key);
+    if (auto found = context.integrators.find(key);
+        found != context.integrators.end()) {
+      auto integrator = found->second;
       auto depth_node = node.find_child_by_attribute("name", "max_depth");
-      integrator.max_depth = parse_integer(depth_node);
-      return integrators.at(key);
+      integrator.max_depth = parse_integer(context, depth_node);
+      return integrator;
     }
-    throw std::runtime_error("Integrator " + key + " is not presented");
+    throw std::runtime_error("Integrator " + std::string(key) +
+                             " is not presented");
   } else {
     throw std::runtime_error("unsupported format for integrator");
   }
 }
 
-Camera parse_camera(pugi::xml_node &node) {
+Camera parse_camera(LoadContext &context, pugi::xml_node &node) {
   assert(strcmp(node.name(), "sensor") == 0);
   auto type = node.attribute("type").value();
   Camera camera;
@@ -175,7 +183,7 @@ Camera parse_camera(pugi::xml_node &node) {
       } else if (strcmp(child.name(), "transform") == 0) {
         auto t = child.attribute("name").value();
         if (t && strcmp(t, "to_world") == 0) {
-          camera.transform = parse_transform(child);
+          camera.transform = parse_transform(context, child);
         }
       } else if (strcmp(child.name(), "sampler") == 0) {
         // auto type = child.attribute("type").value();
@@ -184,27 +192,21 @@ Camera parse_camera(pugi::xml_node &node) {
         //     auto spp_node = child.find_child_by_attribute("name",
         //     "sample_count"); camera.sampler.spp = parse_integer(spp_node);
         // }
-        camera.sampler = parse_sampler(child);
+        camera.sampler = parse_sampler(context, child);
       } else if (strcmp(child.name(), "film") == 0) {
-        camera.film = parse_film(child);
+        camera.film = parse_film(context, child);
       }
     }
   }
   return camera;
 }
 
-std::array<float, 3> parse_rgb(pugi::xml_node &node) {
+std::array<float, 3> parse_rgb(LoadContext &context, pugi::xml_node &node) {
   assert(strcmp(node.name(), "rgb") == 0);
-  auto value = node.attribute("value").value();
-  auto tokens = tokenize(value);
-  std::array<float, 3> values;
-  for (int i = 0; i < 3; i++) {
-    values[i] = to_float(tokens[i]);
-  }
-  return values;
+  return parse_floats<3>(context, node.attribute("value").value());
 }
 
-void parse_bsdf(pugi::xml_node &node) {
+void parse_bsdf(LoadContext &context, pugi::xml_node &node) {
   assert(strcmp(node.name(), "bsdf") == 0);
   BSDF bsdf;
   auto id = node.attribute("id").value();
@@ -219,13 +221,13 @@ void parse_bsdf(pugi::xml_node &node) {
   }
   auto rgb_node = real_bsdf_node.first_child();
   if (strcmp(rgb_node.attribute("name").value(), "reflectance") == 0) {
-    auto rgb = parse_rgb(rgb_node);
+    auto rgb = parse_rgb(context, rgb_node);
     bsdf.reflect = rgb;
   }
-  bsdfs.insert(std::make_pair(id, bsdf));
+  context.bsdfs.insert(std::make_pair(id, bsdf));
 }
 
-Shape parse_shape(pugi::xml_node &node) {
+Shape parse_shape(LoadContext &context, pugi::xml_node &node) {
   assert(strcmp(node.name(), "shape") == 0);
   auto type = node.attribute("type").value();
   Shape shape;
@@ -236,14 +238,124 @@ Shape parse_shape(pugi::xml_node &node) {
   }
   for (auto child = node.first_child(); child; child = child.next_sibling()) {
     if (strcmp(child.name(), "transform") == 0) {
-      shape.transform = parse_transform(child);
+      shape.transform = parse_transform(context, child);
     } else if (strcmp(child.name(), "ref") == 0) {
-      shape.bsdf = bsdfs.at(child.attribute("id").value());
+      shape.bsdf = context.bsdfs.at(child.attribute("id").value());
     }
   }
   return shape;
 }
 
+// Mitsuba writes matrices row by row, the IR stores columns.
+std::array<float, 16> to_column_major(const std::array<float, 16> &m) {
+  std::array<float, 16> result;
+  for (int row = 0; row < 4; row++) {
+    for (int column = 0; column < 4; column++) {
+      result[column * 4 + row] = m[row * 4 + column];
+    }
+  }
+  return result;
+}
+
+// The unit rectangle in the xy plane facing +z.
+const float rectangle_positions[] = {-1, -1, 0, 1, -1, 0, 1, 1, 0, -1, 1, 0};
+const float rectangle_normals[] = {0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1};
+const float rectangle_uvs[] = {0, 0, 1, 0, 1, 1, 0, 1};
+const int rectangle_indices[] = {0, 1, 2, 0, 2, 3};
+
+// The [-1, 1] cube with four vertices per face, so every face keeps a flat
+// normal.
+struct CubeMesh {
+  float positions[72];
+  float normals[72];
+  float uvs[48];
+  int indices[36];
+
+  CubeMesh() {
+    int v = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      for (int sign = -1; sign <= 1; sign += 2) {
+        int u_axis = (axis + 1) % 3;
+        int v_axis = (axis + 2) % 3;
+        const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+        for (int c = 0; c < 4; c++) {
+          // flip the winding on the negative side so faces point outwards
+          int corner = sign > 0 ? c : 3 - c;
+          float *p = positions + 3 * (v + c);
+          float *n = normals + 3 * (v + c);
+          p[axis] = float(sign);
+          p[u_axis] = corners[corner][0];
+          p[v_axis] = corners[corner][1];
+          n[axis] = float(sign);
+          n[u_axis] = 0;
+          n[v_axis] = 0;
+          uvs[2 * (v + c)] = (corners[corner][0] + 1) / 2;
+          uvs[2 * (v + c) + 1] = (corners[corner][1] + 1) / 2;
+        }
+        int *i = indices + v / 4 * 6;
+        i[0] = v;
+        i[1] = v + 1;
+        i[2] = v + 2;
+        i[3] = v;
+        i[4] = v + 2;
+        i[5] = v + 3;
+        v += 4;
+      }
+    }
+  }
+};
+
+const CubeMesh cube_mesh;
+
+} // namespace
+
+Flow::SceneIR lower_scene(const Scene &scene, size_t threads) {
+  Flow::SceneIR ir;
+  ir.camera = Flow::SceneIR::Camera{
+      .camera_to_world = to_column_major(scene.camera.transform),
+      .fov = scene.camera.fov};
+  ir.width = scene.camera.film.width;
+  ir.height = scene.camera.film.height;
+  ir.samples = scene.camera.sampler.spp;
+  ir.max_depth = scene.integrator.max_depth;
+
+  // shapes carry copies of their bsdf, so equal bsdfs share one material
+  auto material_id = [&](const BSDF &bsdf) {
+    for (uint32_t id = 0; id < ir.materials.size(); id++) {
+      if (ir.materials[id].reflectance == bsdf.reflect) {
+        return id;
+      }
+    }
+    ir.materials.push_back(
+        Flow::SceneIR::Material{.reflectance = bsdf.reflect});
+    return uint32_t(ir.materials.size() - 1);
+  };
+
+  std::vector<Flow::MeshSource> sources;
+  for (auto &shape : scene.shapes) {
+    Flow::MeshSource source{.transform = to_column_major(shape.transform),
+                            .material = material_id(shape.bsdf)};
+    if (shape.type == RECTANGLE) {
+      source.positions = rectangle_positions;
+      source.normals = rectangle_normals;
+      source.uvs = rectangle_uvs;
+      source.vertex_count = 4;
+      source.indices = rectangle_indices;
+      source.index_count = 6;
+    } else {
+      source.positions = cube_mesh.positions;
+      source.normals = cube_mesh.normals;
+      source.uvs = cube_mesh.uvs;
+      source.vertex_count = 24;
+      source.indices = cube_mesh.indices;
+      source.index_count = 36;
+    }
+    sources.push_back(source);
+  }
+  Flow::lower_meshes(ir, sources, threads);
+  return ir;
+}
+
 std::optional<Scene> load_scene(const char *path) {
 
   pugi::xml_document doc;
@@ -252,6 +364,7 @@ std::optional<Scene> load_scene(const char *path) {
     printf("failed to load scene %s\n", path);
     return std::nullopt;
   }
+  LoadContext context;
   Scene scene;
   pugi::xml_node scene_node = doc.child("scene");
   for (auto child = scene_node.first_child(); child;
@@ -259,24 +372,29 @@ std::optional<Scene> load_scene(const char *path) {
     if (strcmp(child.name(), "default") == 0) {
       if (strcmp(child.attribute("name").value(), "integrator") == 0) {
         if (strcmp(child.attribute("value").value(), "path") == 0) {
-          integrators.insert(
+          context.integrators.insert(
               std::make_pair("integrator", Integrator{.type = PATH}));
         }
       } else {
-        integers.insert(std::make_pair(child.attribute("name").value(),
-                                       child.attribute("value").as_int()));
+        context.integers.insert(
+            std::make_pair(child.attribute("name").value(),
+                           child.attribute("value").as_int()));
       }
     } else if (strcmp(child.name(), "integrator") == 0) {
-      auto integrator = parse_integrator(child);
+      auto integrator = parse_integrator(context, child);
       scene.integrator = integrator;
     } else if (strcmp(child.name(), "sensor") == 0) {
-      scene.camera = parse_camera(child);
+      scene.camera = parse_camera(context, child);
     } else if (strcmp(child.name(), "bsdf") == 0) {
-      parse_bsdf(child);
+      parse_bsdf(context, child);
     } else if (strcmp(child.name(), "shape") == 0) {
-      scene.shapes.push_back(parse_shape(child));
+      scene.shapes.push_back(parse_shape(context, child));
     }
   }
+  if (context.error) {
+    printf("failed to load scene %s: %s\n", path, context.error->c_str());
+    return std::nullopt;
+  }
   return scene;
 }
 
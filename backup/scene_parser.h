@@ -1,4 +1,5 @@
 #pragma once
+#include "scene_ir.h"
 #include <array>
 #include <optional>
 #include <vector>
@@ -82,5 +83,12 @@ struct Scene {
   std::vector<Shape> shapes;
 };
 
+// Reentrant: all state lives in the call, so scenes may be loaded from
+// several threads at once.
 std::optional<Scene> load_scene(const char *path);
+
+// Lowers a loaded scene into the renderer's scene IR. Rectangles and cubes
+// become the triangle meshes of Mitsuba's canonical [-1, 1] shapes.
+Flow::SceneIR lower_scene(const Scene &scene,
+                          size_t threads = default_thread_count());
 } // namespace Mitsuba
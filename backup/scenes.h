@@ -1,7 +1,9 @@
 #pragma once
 #include "integrator.h"
 #include "scene_data.h"
+#include "scene_ir.h"
 #include <cstdint>
+#include <glm/gtc/type_ptr.hpp>
 
 Scene build_triangle_scene() {
   auto white = Material::make_lambertian(glm::vec3(1.0));
@@ -24,7 +26,7 @@ Scene build_triangle_scene() {
       .bounces = 5,
       .samples = 10,
   };
-
+  scene.build_bvh();
   return scene;
 }
 
@@ -152,6 +154,102 @@ Scene build_cornell_scene() {
       .bounces = 5,
       .samples = 10,
   };
+  scene.build_bvh();
+  return scene;
+}
+
+// A floor under two small ceiling lights; a light switched off turns black
+// so that it neither emits nor reflects, leaving the other light's share of
+// the floor unchanged.
+Scene build_two_light_scene(bool left_on, bool right_on) {
+  auto white = Material::make_lambertian(glm::vec3(1.0));
+  auto black = Material::make_lambertian(glm::vec3(0.0));
+  auto light_material = Material::make_diffuse_light(glm::vec3(1.0), 10.0);
 
+  auto floor = Mesh{.positions =
+                        {
+                            glm::vec3(4.0, 0.0, -4.0),
+                            glm::vec3(-4.0, 0.0, -4.0),
+                            glm::vec3(-4.0, 0.0, 4.0),
+                            glm::vec3(4.0, 0.0, 4.0),
+                        },
+                    .indices = {0, 1, 2, 2, 3, 0},
+                    .material = white};
+  auto make_light = [&](double x, bool on) {
+    return Mesh{.positions =
+                    {
+                        glm::vec3(x + 0.5, 2.0, -0.5),
+                        glm::vec3(x + 0.5, 2.0, 0.5),
+                        glm::vec3(x - 0.5, 2.0, 0.5),
+                        glm::vec3(x - 0.5, 2.0, -0.5),
+                    },
+                .indices = {0, 1, 2, 2, 3, 0},
+                .material = on ? light_material : black};
+  };
+
+  int16_t width = 64;
+  int16_t height = 64;
+  double aspect = (double)width / (double)height;
+  auto camera =
+      Camera(glm::vec3(0.0, 1.0, 3.0), glm::vec3(0.0, 0.0, 0.0),
+             glm::vec3(0.0, 1.0, 0.0), 45.0, aspect);
+  Scene scene{
+      .meshes = {floor, make_light(-1.5, left_on), make_light(1.5, right_on)},
+      .camera = camera,
+      .integrator = Integrator::make_path(),
+      .width = 64,
+      .height = 64,
+      .bounces = 3,
+      .samples = 10,
+  };
+  scene.build_bvh();
+  return scene;
+}
+
+// Builds the renderer's scene from the IR either front end lowers into.
+Scene build_scene(const Flow::SceneIR &ir) {
+  std::vector<Material> materials;
+  for (auto &material : ir.materials) {
+    auto &r = material.reflectance;
+    materials.push_back(Material::make_lambertian(glm::vec3(r[0], r[1], r[2])));
+  }
+
+  std::vector<Mesh> meshes;
+  for (auto &range : ir.meshes) {
+    Mesh mesh{.material = materials[range.material]};
+    for (uint32_t v = 0; v < range.vertex_count; v++) {
+      auto &p = ir.positions[range.first_vertex + v];
+      mesh.positions.push_back(glm::vec3(p.x, p.y, p.z));
+    }
+    for (uint32_t i = 0; i < range.index_count; i++) {
+      mesh.indices.push_back(ir.indices[range.first_index + i] -
+                             range.first_vertex);
+    }
+    if (range.emitter >= 0) {
+      auto &l = ir.emitters[range.emitter].radiance;
+      mesh.material =
+          Material::make_diffuse_light(glm::vec3(l[0], l[1], l[2]), 1.0);
+    }
+    meshes.push_back(std::move(mesh));
+  }
+
+  double aspect = (double)ir.width / (double)ir.height;
+  auto camera = Camera(glm::vec3(0.0), glm::vec3(0.0, 0.0, -1.0),
+                       glm::vec3(0.0, 1.0, 0.0), ir.camera.fov, aspect);
+  // the IR camera looks down +z and this one down -z, so turn it around y
+  auto model = mat4f(glm::make_mat4(ir.camera.camera_to_world.data()));
+  model = glm::scale(model, vec3f(-1.0, 1.0, -1.0));
+  camera.transform = Transform::from_model(model);
+
+  Scene scene{
+      .meshes = std::move(meshes),
+      .camera = camera,
+      .integrator = Integrator::make_path(),
+      .width = uint16_t(ir.width),
+      .height = uint16_t(ir.height),
+      .bounces = int16_t(ir.max_depth),
+      .samples = int16_t(ir.samples),
+  };
+  scene.build_bvh();
   return scene;
-}
\ No newline at end of file
+}
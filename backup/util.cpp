@@ -1,27 +1,46 @@
 #include "util.h"
 
+#include <utility>
+
+// Watertight test of Woop, Benthin and Wald: the triangle is moved into a
+// space where the ray runs along +z from the origin, and the sign of three
+// edge functions decides the hit. Rays through a shared edge hit at least
+// one of its triangles, which an epsilon on the determinant cannot promise.
+// Callers bound t themselves.
 bool ray_triangle_intersect(const Ray &ray, const glm::dvec3 &v0,
                             const glm::dvec3 &v1, const glm::dvec3 &v2,
                             double &t) {
-
-  auto e1 = v1 - v0;
-  auto e2 = v2 - v0;
-  auto h = glm::cross(ray.dir, e2);
-  auto a = glm::dot(e1, h);
-  if (glm::abs(a) < 0.0001) {
-    return false;
+  auto d = glm::abs(glm::dvec3(ray.dir));
+  int kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+  int kx = kz == 2 ? 0 : kz + 1;
+  int ky = kx == 2 ? 0 : kx + 1;
+  // keeps the winding of triangles
+  if (ray.dir[kz] < 0.0) {
+    std::swap(kx, ky);
   }
-  auto f = 1.0 / a;
-  auto s = ray.origin - v0;
-  auto u = f * glm::dot(s, h);
-  if (u < 0.0 || u > 1.0) {
+  double sx = -ray.dir[kx] / ray.dir[kz];
+  double sy = -ray.dir[ky] / ray.dir[kz];
+  double sz = 1.0 / ray.dir[kz];
+
+  auto to_ray_space = [&](const glm::dvec3 &v) {
+    auto p = v - glm::dvec3(ray.origin);
+    return glm::dvec3(p[kx] + sx * p[kz], p[ky] + sy * p[kz], p[kz] * sz);
+  };
+  auto p0 = to_ray_space(v0);
+  auto p1 = to_ray_space(v1);
+  auto p2 = to_ray_space(v2);
+
+  double e0 = p1.x * p2.y - p1.y * p2.x;
+  double e1 = p2.x * p0.y - p2.y * p0.x;
+  double e2 = p0.x * p1.y - p0.y * p1.x;
+  if ((e0 < 0.0 || e1 < 0.0 || e2 < 0.0) &&
+      (e0 > 0.0 || e1 > 0.0 || e2 > 0.0)) {
     return false;
   }
-  auto q = glm::cross(s, e1);
-  auto v = f * glm::dot(ray.dir, q);
-  if (v < 0.0 || u + v > 1.0) {
+  double det = e0 + e1 + e2;
+  if (det == 0.0) {
     return false;
   }
-  t = f * glm::dot(e2, q);
-  return t;
+  t = (e0 * p0.z + e1 * p1.z + e2 * p2.z) / det;
+  return true;
 }
@@ -0,0 +1,497 @@
+#pragma once
+#include "math.h"
+#include "pbrt.h"
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <variant>
+#include <vector>
+
+namespace Flow {
+
+struct Ray {
+  Vec3f origin;
+  Vec3f direction;
+};
+
+// A ray set up for intersect_triangle: its largest direction axis becomes z
+// and the shear maps the direction onto +z. Built once per ray and reused
+// for every triangle it is tested against.
+struct TriangleRay {
+  Vec3f origin;
+  int kx;
+  int ky;
+  int kz;
+  float sx;
+  float sy;
+  float sz;
+
+  explicit TriangleRay(const Ray &ray);
+};
+
+// Watertight ray/triangle test (Woop, Benthin and Wald 2013). A ray through
+// an edge or vertex shared by several triangles hits at least one of them,
+// and degenerate triangles are never hit. Reports hits with t in (0, t_max);
+// t must also exceed a conservative bound on its own rounding error, so a
+// ray leaving a surface does not hit it again. u and v are the barycentrics
+// of p1 and p2.
+bool intersect_triangle(const TriangleRay &ray, const Vec3f &p0,
+                        const Vec3f &p1, const Vec3f &p2, float t_max,
+                        float &t, float &u, float &v);
+
+// Bound on the relative error of n rounded float operations.
+constexpr float gamma(int n) {
+  constexpr float epsilon = std::numeric_limits<float>::epsilon() * 0.5f;
+  return n * epsilon / (1 - n * epsilon);
+}
+
+// Slab tests widen the far distance by this much so that rounding never
+// culls a box the ray only grazes, or a box flat along one axis.
+constexpr float SLAB_FAR_SCALE = 1 + 2 * gamma(3);
+
+struct Bounds3f {
+  Vec3f min = Vec3f(INFINITY, INFINITY, INFINITY);
+  Vec3f max = Vec3f(-INFINITY, -INFINITY, -INFINITY);
+
+  void extend(const Vec3f &p) {
+    min = min.min(p);
+    max = max.max(p);
+  }
+
+  void extend(const Bounds3f &b) {
+    min = min.min(b.min);
+    max = max.max(b.max);
+  }
+
+  Vec3f centroid() const { return (min + max) * 0.5f; }
+
+  // Zero for empty bounds.
+  float surface_area() const {
+    auto d = (max - min).max(Vec3f());
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  int largest_axis() const {
+    auto d = max - min;
+    return d.x > d.y && d.x > d.z ? 0 : (d.y > d.z ? 1 : 2);
+  }
+
+  // Slab test against [0, t_max]. `t_entry` is where the ray enters.
+  bool intersect(const Vec3f &origin, const Vec3f &inv_direction, float t_max,
+                 float &t_entry) const {
+    float t0 = 0.0f;
+    float t1 = t_max;
+    for (int axis = 0; axis < 3; axis++) {
+      float near = (min[axis] - origin[axis]) * inv_direction[axis];
+      float far = (max[axis] - origin[axis]) * inv_direction[axis];
+      if (near > far) {
+        std::swap(near, far);
+      }
+      far *= SLAB_FAR_SCALE;
+      t0 = near > t0 ? near : t0;
+      t1 = far < t1 ? far : t1;
+      if (t0 > t1) {
+        return false;
+      }
+    }
+    t_entry = t0;
+    return true;
+  }
+};
+
+// A leaf holds `count` primitives starting at `offset` in the primitive
+// order. An interior node has count 0, its first child right after it and
+// its second child at `offset`.
+struct BvhNode {
+  Bounds3f bounds;
+  uint32_t offset;
+  uint32_t count;
+};
+static_assert(sizeof(BvhNode) == 32);
+
+// Hierarchy over primitives known only by their bounds, so the same code
+// builds both levels of a SceneBvh.
+struct Bvh {
+  std::vector<BvhNode> nodes;
+  std::vector<uint32_t> primitives;
+
+  // Top down with the surface area heuristic evaluated over a fixed number
+  // of bins per axis. With several threads the bounds, binning and
+  // partitioning of large nodes are split across them and the two subtrees
+  // of a node are built concurrently; the splits chosen do not depend on
+  // the thread count.
+  static Bvh build(std::span<const Bounds3f> bounds, size_t threads = 1);
+
+  // Linear BVH for previews: primitives are sorted along a Morton curve and
+  // split where their codes first differ, with no cost evaluation. Several
+  // times faster to build than build(), slower to trace.
+  static Bvh build_lbvh(std::span<const Bounds3f> bounds,
+                        size_t threads = 1);
+
+  // Expected cost of tracing a ray that hits the root, from the surface
+  // area heuristic: node visits and primitive tests weighted by the chance
+  // of reaching them. Lower is better.
+  float sah_cost() const;
+
+  // Calls `intersect(primitive, t_max)` for every primitive in a leaf the
+  // ray reaches. It returns true on a hit and shrinks t_max to it. Nearer
+  // children are visited first, so t_max shrinks early and prunes the rest.
+  template <typename F>
+  bool traverse(const Ray &ray, float &t_max, F &&intersect) const {
+    auto inv_direction = Vec3f(1.0f / ray.direction.x, 1.0f / ray.direction.y,
+                               1.0f / ray.direction.z);
+    // nodes whose bounds the ray enters at t
+    struct Entry {
+      uint32_t node;
+      float t;
+    };
+    Entry stack[STACK_SIZE];
+    int size = 0;
+    float t_root;
+    if (nodes.empty() ||
+        !nodes[0].bounds.intersect(ray.origin, inv_direction, t_max, t_root)) {
+      return false;
+    }
+    stack[size++] = Entry{.node = 0, .t = t_root};
+    bool hit = false;
+    while (size > 0) {
+      auto entry = stack[--size];
+      if (entry.t > t_max) {
+        continue;
+      }
+      auto &node = nodes[entry.node];
+      if (node.count > 0) {
+        for (uint32_t i = 0; i < node.count; i++) {
+          hit |= intersect(primitives[node.offset + i], t_max);
+        }
+        continue;
+      }
+      Entry near{.node = entry.node + 1};
+      Entry far{.node = node.offset};
+      bool hit_near = nodes[near.node].bounds.intersect(
+          ray.origin, inv_direction, t_max, near.t);
+      bool hit_far = nodes[far.node].bounds.intersect(
+          ray.origin, inv_direction, t_max, far.t);
+      if (hit_near && hit_far && far.t < near.t) {
+        std::swap(near, far);
+      }
+      if (hit_far) {
+        stack[size++] = far;
+      }
+      if (hit_near) {
+        stack[size++] = near;
+      }
+    }
+    return hit;
+  }
+
+  // Calls `intersect(primitive, t_max)` for primitives in leaves the ray
+  // reaches until one returns true, for shadow rays that only ask whether
+  // anything is in the way. Children are not ordered by distance; a leaf
+  // child is tested before its interior sibling is descended into, as it
+  // may end the query without visiting any more nodes.
+  template <typename F>
+  bool traverse_any(const Ray &ray, float t_max, F &&intersect) const {
+    auto inv_direction = Vec3f(1.0f / ray.direction.x, 1.0f / ray.direction.y,
+                               1.0f / ray.direction.z);
+    auto hits = [&](uint32_t node) {
+      float t;
+      return nodes[node].bounds.intersect(ray.origin, inv_direction, t_max,
+                                          t);
+    };
+    uint32_t stack[STACK_SIZE];
+    int size = 0;
+    if (nodes.empty() || !hits(0)) {
+      return false;
+    }
+    stack[size++] = 0;
+    while (size > 0) {
+      uint32_t index = stack[--size];
+      auto &node = nodes[index];
+      if (node.count > 0) {
+        for (uint32_t i = 0; i < node.count; i++) {
+          if (intersect(primitives[node.offset + i], t_max)) {
+            return true;
+          }
+        }
+        continue;
+      }
+      uint32_t first = index + 1;
+      uint32_t second = node.offset;
+      if (nodes[first].count == 0 && nodes[second].count > 0) {
+        std::swap(first, second);
+      }
+      if (hits(second)) {
+        stack[size++] = second;
+      }
+      if (hits(first)) {
+        stack[size++] = first;
+      }
+    }
+    return false;
+  }
+
+  // Deeper subtrees are split at the median, so no path is longer than
+  // MAX_DEPTH plus the 32 levels of a median split of 2^32 primitives.
+  static constexpr int MAX_DEPTH = 32;
+  static constexpr int STACK_SIZE = MAX_DEPTH + 32 + 1;
+};
+
+// Node of a BVH with up to N children per node. Child bounds are stored in 8
+// bits per plane relative to the node: plane q of axis a lies at
+// origin[a] + q * 2^exponent[a], rounded outwards so a child box always
+// contains the child. The first `children` lanes are used. A child with a
+// nonzero count is a leaf of `count` primitives starting at `child` (or at
+// the block `child`, once a BlockBvh has laid them out); otherwise `child`
+// is the index of a node.
+template <int N> struct alignas(64) WideNode {
+  Vec3f origin;
+  int8_t exponent[3];
+  uint8_t children;
+  uint8_t lo[3][N];
+  uint8_t hi[3][N];
+  uint8_t count[N];
+  uint32_t child[N];
+};
+static_assert(sizeof(WideNode<4>) == 64);
+static_assert(sizeof(WideNode<8>) == 128);
+
+// Ray terms shared by every node test.
+struct WideRay {
+  Vec3f origin;
+  Vec3f inv_direction;
+  bool negative[3];
+
+  explicit WideRay(const Ray &ray);
+};
+
+// A binary Bvh collapsed to N children per node, whose child boxes are all
+// tested at once with N-wide vectors. Keeps the primitive order of the Bvh
+// it came from.
+template <int N> struct WideBvh {
+  std::vector<WideNode<N>> nodes;
+  std::vector<uint32_t> primitives;
+
+  // Each node takes the children of its binary node and keeps opening the
+  // one with the largest surface area until it has N of them.
+  static WideBvh collapse(const Bvh &bvh);
+
+  // Bit i is set when the ray enters child i before t_max; its entry
+  // distance is written to t_entry[i].
+  static uint32_t intersect_children(const WideNode<N> &node,
+                                     const WideRay &ray, float t_max,
+                                     float *t_entry);
+
+  // Like Bvh::traverse, but `intersect(child, count, t_max)` is called once
+  // per leaf with its `child` and `count`, so the leaf can be tested as a
+  // whole. The nearest child hit is visited next and the others are pushed
+  // in child order, which keeps traversal close to front to back without
+  // sorting them.
+  template <typename F>
+  bool traverse(const Ray &ray, float &t_max, F &&intersect) const {
+    // children the ray enters at t: a node when count is 0, else a leaf
+    struct Entry {
+      uint32_t child;
+      uint32_t count;
+      float t;
+    };
+    if (nodes.empty()) {
+      return false;
+    }
+    WideRay wide_ray(ray);
+    Entry stack[STACK_SIZE];
+    int size = 0;
+    stack[size++] = Entry{.child = 0, .count = 0, .t = 0.0f};
+    bool hit = false;
+    while (size > 0) {
+      auto entry = stack[--size];
+      if (entry.t > t_max) {
+        continue;
+      }
+      if (entry.count > 0) {
+        hit |= intersect(entry.child, entry.count, t_max);
+        continue;
+      }
+      auto &node = nodes[entry.child];
+      float t_entry[N];
+      uint32_t mask = intersect_children(node, wide_ray, t_max, t_entry);
+      if (mask == 0) {
+        continue;
+      }
+      int nearest = std::countr_zero(mask);
+      for (uint32_t rest = mask & (mask - 1); rest != 0; rest &= rest - 1) {
+        int i = std::countr_zero(rest);
+        nearest = t_entry[i] < t_entry[nearest] ? i : nearest;
+      }
+      for (uint32_t rest = mask & ~(1u << nearest); rest != 0;
+           rest &= rest - 1) {
+        int i = std::countr_zero(rest);
+        stack[size++] = Entry{node.child[i], node.count[i], t_entry[i]};
+      }
+      stack[size++] = Entry{node.child[nearest], node.count[nearest],
+                            t_entry[nearest]};
+    }
+    return hit;
+  }
+
+  // Like Bvh::traverse_any, with the leaf callback of traverse(). Leaf
+  // children are tested as soon as their node is, before any interior child
+  // is descended into, and entry distances are not compared.
+  template <typename F>
+  bool traverse_any(const Ray &ray, float t_max, F &&intersect) const {
+    if (nodes.empty()) {
+      return false;
+    }
+    WideRay wide_ray(ray);
+    uint32_t stack[STACK_SIZE];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+      auto &node = nodes[stack[--size]];
+      float t_entry[N];
+      uint32_t mask = intersect_children(node, wide_ray, t_max, t_entry);
+      for (; mask != 0; mask &= mask - 1) {
+        int i = std::countr_zero(mask);
+        if (node.count[i] == 0) {
+          stack[size++] = node.child[i];
+          continue;
+        }
+        if (intersect(node.child[i], node.count[i], t_max)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Collapsing never adds levels, and each level leaves at most N - 1
+  // siblings behind on the stack.
+  static constexpr int STACK_SIZE = Bvh::STACK_SIZE * (N - 1) + 1;
+};
+
+template <>
+uint32_t WideBvh<8>::intersect_children(const WideNode<8> &node,
+                                        const WideRay &ray, float t_max,
+                                        float *t_entry);
+extern template struct WideBvh<4>;
+extern template struct WideBvh<8>;
+
+// N triangles stored plane by plane, so one vector load fetches a
+// coordinate of one vertex of every lane and no test goes through the index
+// array. Lanes past the end of a leaf are zero.
+template <int N> struct alignas(64) TriangleBlock {
+  // vertex, axis, lane
+  float p[3][3][N];
+  uint32_t triangle[N];
+};
+
+// intersect_triangle on the first `lanes` triangles of a block at once,
+// with the same arithmetic lane for lane. Lanes hit at t <= t_min are
+// ignored. Returns the lane of the nearest hit, the first of equally near
+// ones, and its t, u and v; -1 on a miss.
+template <int N>
+int intersect_triangles(const TriangleRay &ray, const TriangleBlock<N> &block,
+                        int lanes, float t_min, float t_max, float &t,
+                        float &u, float &v);
+
+// WideBvh over the triangles of a mesh, copied leaf by leaf into blocks of
+// LANES: a leaf child's `child` is its first block and `count` still its
+// number of triangles.
+template <int N> struct BlockBvh {
+  // eight lanes only where eight floats fit one register; split across
+  // two SSE registers the block test spills and runs slower than twice four
+#if defined(__AVX__)
+  static constexpr int LANES = N;
+#else
+  static constexpr int LANES = 4;
+#endif
+
+  WideBvh<N> bvh;
+  std::vector<TriangleBlock<LANES>> blocks;
+
+  static BlockBvh build(const Bvh &bvh, const TriangleMeshShapeData &mesh);
+};
+
+// Children per node of the BVH over each mesh's triangles.
+enum class BvhWidth {
+  Two = 2,
+  Four = 4,
+  Eight = 8,
+};
+
+// The widest BVH whose node test fits one vector on this CPU: eight with
+// AVX2, four otherwise.
+BvhWidth native_bvh_width();
+
+struct Hit {
+  float t;
+  // barycentrics of vertices 1 and 2
+  float u;
+  float v;
+  uint32_t triangle;
+  uint32_t instance;
+};
+
+// Bottom level: the triangles of one mesh. Reads the vertex and index arrays
+// in place, so the mesh has to outlive it.
+struct MeshBvh {
+  const TriangleMeshShapeData *mesh;
+  Bvh bvh;
+  // `bvh` collapsed for tracing, unless the width is two
+  std::variant<std::monostate, BlockBvh<4>, BlockBvh<8>> wide;
+
+  static MeshBvh build(const TriangleMeshShapeData &mesh, size_t threads = 1,
+                       bool preview = false,
+                       BvhWidth width = BvhWidth::Two);
+
+  Bounds3f bounds() const {
+    return bvh.nodes.empty() ? Bounds3f{} : bvh.nodes[0].bounds;
+  }
+
+  // Updates `hit` and returns true when a triangle is closer than `t_max`.
+  bool intersect(const Ray &ray, float &t_max, Hit &hit) const;
+
+  // Whether any triangle is hit in (t_min, t_max), stopping at the first
+  // one found.
+  bool occluded(const Ray &ray, float t_min, float t_max) const;
+};
+
+// One placement of a mesh. Shapes outside objects are instances with the
+// identity transform.
+struct Instance {
+  uint32_t mesh;
+  const ShapeData *shape;
+  std::array<float, 16> object_to_world;
+  Transform3 world_to_object;
+};
+
+// Two level hierarchy: one MeshBvh per unique mesh in the scene, and a top
+// level over the world bounds of every instance. An object instanced many
+// times costs one Instance per shape, not a copy of its triangles. Points
+// into `scene`, which has to outlive it.
+struct SceneBvh {
+  std::vector<MeshBvh> meshes;
+  std::vector<Instance> instances;
+  Bvh top;
+
+  // Meshes are built concurrently, or one after the other on all threads
+  // when there are fewer of them. `preview` builds LBVHs, and `width` sets
+  // the children per node of the mesh BVHs; the top level stays binary.
+  static SceneBvh build(const SceneData &scene, size_t threads = 1,
+                        bool preview = false,
+                        BvhWidth width = native_bvh_width());
+
+  std::optional<Hit>
+  intersect(const Ray &ray,
+            float t_max = std::numeric_limits<float>::infinity()) const;
+
+  // Whether anything lies along the ray in (t_min, t_max), for shadow and
+  // visibility rays. Stops at the first hit and fills in no Hit.
+  bool occluded(const Ray &ray, float t_min,
+                float t_max = std::numeric_limits<float>::infinity()) const;
+};
+
+} // namespace Flow
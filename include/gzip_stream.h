@@ -0,0 +1,47 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct gzFile_s;
+
+// Decompresses a gzip file on its own thread in blocks of at most
+// `block_size` bytes. While the caller works on one block the thread fills
+// the next, so at most three blocks exist at a time: the caller's, the one
+// waiting to be taken and the one being filled.
+class GzipStream {
+public:
+  static std::unique_ptr<GzipStream> open(const char *path,
+                                          size_t block_size = 1 << 20);
+
+  GzipStream(const GzipStream &) = delete;
+  GzipStream &operator=(const GzipStream &) = delete;
+  ~GzipStream();
+
+  // Replaces `block` with the next decompressed block. Returns false once
+  // the file is exhausted or turned out to be corrupt; failed() tells which.
+  bool next(std::string &block);
+  bool failed() const;
+
+private:
+  GzipStream(gzFile_s *file, size_t block_size);
+  void produce();
+
+  gzFile_s *file;
+  size_t block_size;
+
+  mutable std::mutex mutex;
+  std::condition_variable changed;
+  // handed over under `mutex`
+  std::string ready;
+  bool has_ready = false;
+  bool finished = false;
+  bool error = false;
+  bool stopping = false;
+
+  // started last, once everything it touches is initialized
+  std::thread producer;
+};
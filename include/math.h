@@ -1,9 +1,17 @@
 #pragma once
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <ostream>
 
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 namespace Flow {
 
 const float EPSILON = 1e-6;
@@ -12,6 +20,8 @@ struct Vec2f {
   float x = 0;
   float y = 0;
 
+  Vec2f() = default;
+
   Vec2f(float x, float y) : x(x), y(y) {}
 
   static Vec2f zero() { return Vec2f(0.0, 0.0); }
@@ -43,7 +53,7 @@ struct Vec2f {
   Vec2f operator/(float rhs) const { return Vec2f(x / rhs, y / rhs); }
 };
 
-std::ostream &operator<<(std::ostream &os, const Vec2f &v) {
+inline std::ostream &operator<<(std::ostream &os, const Vec2f &v) {
   os << "Vec2f(" << v.x << ", " << v.y << ")";
   return os;
 }
@@ -113,14 +123,26 @@ struct Vec3f {
   Vec3f cross(const Vec3f &v) const {
     return Vec3f(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
   }
+
+  Vec3f min(const Vec3f &v) const {
+    return Vec3f(std::min(x, v.x), std::min(y, v.y), std::min(z, v.z));
+  }
+
+  Vec3f max(const Vec3f &v) const {
+    return Vec3f(std::max(x, v.x), std::max(y, v.y), std::max(z, v.z));
+  }
+
+  float operator[](int i) const { return i == 0 ? x : (i == 1 ? y : z); }
 };
 
-std::ostream &operator<<(std::ostream &os, const Vec3f &v) {
+inline std::ostream &operator<<(std::ostream &os, const Vec3f &v) {
   os << "Vec3f(" << v.x << ", " << v.y << ", " << v.z << ")";
   return os;
 }
 
-class Vec4f {
+// Fills one SSE register; the arithmetic below is a single instruction per
+// operation when SSE is enabled and plain float math otherwise.
+class alignas(16) Vec4f {
 public:
   float x;
   float y;
@@ -130,19 +152,419 @@ public:
   Vec4f(float x = 0.0, float y = 0.0, float z = 0.0, float w = 0.0)
       : x(x), y(y), z(z), w(w) {}
 
+  Vec4f(const Vec3f &v, float w) : x(v.x), y(v.y), z(v.z), w(w) {}
+
   static Vec4f zero() { return Vec4f(0.0, 0.0, 0.0, 0.0); }
 
   static Vec4f one() { return Vec4f(1.0, 1.0, 1.0, 1.0); }
 
+#if defined(__SSE__)
+  explicit Vec4f(__m128 m) { _mm_store_ps(&x, m); }
+
+  __m128 m128() const { return _mm_load_ps(&x); }
+
+  Vec4f operator+(const Vec4f &rhs) const {
+    return Vec4f(_mm_add_ps(m128(), rhs.m128()));
+  }
+
+  Vec4f operator-(const Vec4f &rhs) const {
+    return Vec4f(_mm_sub_ps(m128(), rhs.m128()));
+  }
+
+  Vec4f operator*(const Vec4f &rhs) const {
+    return Vec4f(_mm_mul_ps(m128(), rhs.m128()));
+  }
+
+  Vec4f operator*(float rhs) const {
+    return Vec4f(_mm_mul_ps(m128(), _mm_set1_ps(rhs)));
+  }
+
+  Vec4f operator/(float rhs) const {
+    return Vec4f(_mm_div_ps(m128(), _mm_set1_ps(rhs)));
+  }
+
+  Vec4f min(const Vec4f &v) const {
+    return Vec4f(_mm_min_ps(m128(), v.m128()));
+  }
+
+  Vec4f max(const Vec4f &v) const {
+    return Vec4f(_mm_max_ps(m128(), v.m128()));
+  }
+
+  float dot(const Vec4f &v) const {
+    __m128 p = _mm_mul_ps(m128(), v.m128());
+    // (x+z, y+w, ..) then add the two halves
+    __m128 s = _mm_add_ps(p, _mm_movehl_ps(p, p));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+  }
+#else
+  Vec4f operator+(const Vec4f &rhs) const {
+    return Vec4f(x + rhs.x, y + rhs.y, z + rhs.z, w + rhs.w);
+  }
+
+  Vec4f operator-(const Vec4f &rhs) const {
+    return Vec4f(x - rhs.x, y - rhs.y, z - rhs.z, w - rhs.w);
+  }
+
+  Vec4f operator*(const Vec4f &rhs) const {
+    return Vec4f(x * rhs.x, y * rhs.y, z * rhs.z, w * rhs.w);
+  }
+
+  Vec4f operator*(float rhs) const {
+    return Vec4f(x * rhs, y * rhs, z * rhs, w * rhs);
+  }
+
+  Vec4f operator/(float rhs) const {
+    return Vec4f(x / rhs, y / rhs, z / rhs, w / rhs);
+  }
+
+  Vec4f min(const Vec4f &v) const {
+    return Vec4f(std::min(x, v.x), std::min(y, v.y), std::min(z, v.z),
+                 std::min(w, v.w));
+  }
+
+  Vec4f max(const Vec4f &v) const {
+    return Vec4f(std::max(x, v.x), std::max(y, v.y), std::max(z, v.z),
+                 std::max(w, v.w));
+  }
+
   float dot(const Vec4f &v) const {
     return x * v.x + y * v.y + z * v.z + w * v.w;
   }
+#endif
 
   Vec3f to_vec3() const { return Vec3f{.x = x, .y = y, .z = z}; }
 };
 
-std::ostream &operator<<(std::ostream &os, const Vec4f &v) {
+inline std::ostream &operator<<(std::ostream &os, const Vec4f &v) {
   os << "Vec4f(" << v.x << ", " << v.y << ", " << v.z << ", " << v.w << ")";
   return os;
 }
+
+// Wide types hold N lanes in structure of arrays form, so kernels can work on
+// packets of rays or hits. They are built on the GCC vector extension, which
+// compiles each operation to SSE, AVX or AVX-512 instructions depending on
+// the target; a type wider than the target's registers is split across
+// several of them. Vec3f itself stays three packed floats, because mesh and
+// scene pools are arrays of it.
+
+template <int N> struct MaskN;
+
+// GCC drops vector_size with a size that depends on a template parameter, so
+// each width is spelled out.
+template <int N> struct LaneVectors;
+
+#define FLOW_LANE_VECTORS(N)                                                   \
+  template <> struct LaneVectors<N> {                                          \
+    typedef float Float __attribute__((vector_size(N * sizeof(float))));       \
+    typedef int32_t Int __attribute__((vector_size(N * sizeof(int32_t))));     \
+    typedef uint8_t Byte __attribute__((vector_size(N)));                      \
+  };
+FLOW_LANE_VECTORS(4)
+FLOW_LANE_VECTORS(8)
+FLOW_LANE_VECTORS(16)
+#undef FLOW_LANE_VECTORS
+
+template <int N> struct FloatN {
+  using Vector = typename LaneVectors<N>::Float;
+
+  Vector v;
+
+  FloatN() : v{} {}
+  FloatN(const Vector &v) : v(v) {}
+  // every lane set to `s`
+  FloatN(float s) : v(Vector{} + s) {}
+
+  static FloatN load(const float *p) {
+    FloatN r;
+    std::memcpy(&r.v, p, sizeof(Vector));
+    return r;
+  }
+
+  void store(float *p) const { std::memcpy(p, &v, sizeof(Vector)); }
+
+  // N bytes converted to floats.
+  static FloatN from_bytes(const uint8_t *p) {
+    typename LaneVectors<N>::Byte bytes;
+    std::memcpy(&bytes, p, N);
+    return __builtin_convertvector(bytes, Vector);
+  }
+
+  float operator[](int lane) const { return v[lane]; }
+  void set(int lane, float value) { v[lane] = value; }
+
+  FloatN operator-() const { return -v; }
+  FloatN operator+(const FloatN &rhs) const { return v + rhs.v; }
+  FloatN operator-(const FloatN &rhs) const { return v - rhs.v; }
+  FloatN operator*(const FloatN &rhs) const { return v * rhs.v; }
+  FloatN operator/(const FloatN &rhs) const { return v / rhs.v; }
+
+  MaskN<N> operator<(const FloatN &rhs) const { return v < rhs.v; }
+  MaskN<N> operator<=(const FloatN &rhs) const { return v <= rhs.v; }
+  MaskN<N> operator>(const FloatN &rhs) const { return v > rhs.v; }
+  MaskN<N> operator>=(const FloatN &rhs) const { return v >= rhs.v; }
+  MaskN<N> operator==(const FloatN &rhs) const { return v == rhs.v; }
+};
+
+// One all-ones or all-zeros lane per FloatN lane, as vector comparisons
+// produce them.
+template <int N> struct MaskN {
+  using Vector = typename LaneVectors<N>::Int;
+
+  Vector v;
+
+  MaskN() : v{} {}
+  MaskN(const Vector &v) : v(v) {}
+  explicit MaskN(bool set) : v(Vector{} - int32_t(set)) {}
+
+  bool operator[](int lane) const { return v[lane] != 0; }
+
+  MaskN operator&(const MaskN &rhs) const { return v & rhs.v; }
+  MaskN operator|(const MaskN &rhs) const { return v | rhs.v; }
+  MaskN operator~() const { return ~v; }
+
+  // bit i set for lane i
+  uint32_t bits() const {
+    uint32_t result = 0;
+    for (int i = 0; i < N; i++) {
+      result |= uint32_t(v[i] != 0) << i;
+    }
+    return result;
+  }
+
+  bool any() const { return bits() != 0; }
+  bool all() const { return bits() == (uint32_t(1) << N) - 1; }
+};
+
+#if defined(__SSE__)
+template <> inline uint32_t MaskN<4>::bits() const {
+  return _mm_movemask_ps(reinterpret_cast<__m128>(v));
+}
+#endif
+
+template <int N>
+FloatN<N> select(const MaskN<N> &mask, const FloatN<N> &a,
+                 const FloatN<N> &b) {
+  return mask.v ? a.v : b.v;
+}
+
+template <int N> FloatN<N> min(const FloatN<N> &a, const FloatN<N> &b) {
+  return a.v < b.v ? a.v : b.v;
+}
+
+template <int N> FloatN<N> max(const FloatN<N> &a, const FloatN<N> &b) {
+  return a.v > b.v ? a.v : b.v;
+}
+
+template <int N> FloatN<N> abs(const FloatN<N> &a) {
+  return a.v < 0.0f ? -a.v : a.v;
+}
+
+template <int N> FloatN<N> sqrt(const FloatN<N> &a) {
+  FloatN<N> r;
+  for (int i = 0; i < N; i++) {
+    r.v[i] = std::sqrt(a.v[i]);
+  }
+  return r;
+}
+
+template <int N> struct Vec3fN {
+  FloatN<N> x;
+  FloatN<N> y;
+  FloatN<N> z;
+
+  Vec3fN() = default;
+  Vec3fN(const FloatN<N> &x, const FloatN<N> &y, const FloatN<N> &z)
+      : x(x), y(y), z(z) {}
+  // every lane set to `v`
+  Vec3fN(const Vec3f &v) : x(v.x), y(v.y), z(v.z) {}
+
+  // N points stored as consecutive xyz triples.
+  static Vec3fN load_packed(const float *p) {
+    Vec3fN r;
+    for (int i = 0; i < N; i++) {
+      r.x.v[i] = p[3 * i];
+      r.y.v[i] = p[3 * i + 1];
+      r.z.v[i] = p[3 * i + 2];
+    }
+    return r;
+  }
+
+  void store_packed(float *p) const {
+    for (int i = 0; i < N; i++) {
+      p[3 * i] = x.v[i];
+      p[3 * i + 1] = y.v[i];
+      p[3 * i + 2] = z.v[i];
+    }
+  }
+
+  Vec3f operator[](int lane) const {
+    return Vec3f(x[lane], y[lane], z[lane]);
+  }
+
+  void set(int lane, const Vec3f &v) {
+    x.set(lane, v.x);
+    y.set(lane, v.y);
+    z.set(lane, v.z);
+  }
+
+  Vec3fN operator-() const { return Vec3fN(-x, -y, -z); }
+
+  Vec3fN operator+(const Vec3fN &rhs) const {
+    return Vec3fN(x + rhs.x, y + rhs.y, z + rhs.z);
+  }
+
+  Vec3fN operator-(const Vec3fN &rhs) const {
+    return Vec3fN(x - rhs.x, y - rhs.y, z - rhs.z);
+  }
+
+  Vec3fN operator*(const FloatN<N> &s) const {
+    return Vec3fN(x * s, y * s, z * s);
+  }
+
+  FloatN<N> dot(const Vec3fN &v) const { return x * v.x + y * v.y + z * v.z; }
+
+  Vec3fN cross(const Vec3fN &v) const {
+    return Vec3fN(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
+  }
+
+  Vec3fN min(const Vec3fN &v) const {
+    return Vec3fN(Flow::min(x, v.x), Flow::min(y, v.y), Flow::min(z, v.z));
+  }
+
+  Vec3fN max(const Vec3fN &v) const {
+    return Vec3fN(Flow::max(x, v.x), Flow::max(y, v.y), Flow::max(z, v.z));
+  }
+};
+
+template <int N>
+Vec3fN<N> select(const MaskN<N> &mask, const Vec3fN<N> &a,
+                 const Vec3fN<N> &b) {
+  return Vec3fN<N>(select(mask, a.x, b.x), select(mask, a.y, b.y),
+                   select(mask, a.z, b.z));
+}
+
+using Float4 = FloatN<4>;
+using Float8 = FloatN<8>;
+using Float16 = FloatN<16>;
+using Vec3f4 = Vec3fN<4>;
+using Vec3f8 = Vec3fN<8>;
+using Vec3f16 = Vec3fN<16>;
+
+// 4x4 matrices are column major std::arrays, the layout of the values of a
+// pbrt Transform directive. Points and vectors assume an affine matrix.
+
+inline Vec3f transform_point(const std::array<float, 16> &m, const Vec3f &p) {
+  return Vec3f(m[0] * p.x + m[4] * p.y + m[8] * p.z + m[12],
+               m[1] * p.x + m[5] * p.y + m[9] * p.z + m[13],
+               m[2] * p.x + m[6] * p.y + m[10] * p.z + m[14]);
+}
+
+inline Vec3f transform_vector(const std::array<float, 16> &m,
+                              const Vec3f &v) {
+  return Vec3f(m[0] * v.x + m[4] * v.y + m[8] * v.z,
+               m[1] * v.x + m[5] * v.y + m[9] * v.z,
+               m[2] * v.x + m[6] * v.y + m[10] * v.z);
+}
+
+// Affine transform: a linear part given by its three columns plus a
+// translation. The transpose of the inverse of the linear part, which
+// normals go through, is computed once on construction; the inverse
+// transform is then built from it without a general 4x4 inversion.
+struct Transform3 {
+  Vec3f x_axis = Vec3f(1, 0, 0);
+  Vec3f y_axis = Vec3f(0, 1, 0);
+  Vec3f z_axis = Vec3f(0, 0, 1);
+  Vec3f translation;
+
+  Transform3() = default;
+
+  Transform3(const Vec3f &x_axis, const Vec3f &y_axis, const Vec3f &z_axis,
+             const Vec3f &translation)
+      : x_axis(x_axis), y_axis(y_axis), z_axis(z_axis),
+        translation(translation) {
+    update_normal_matrix();
+  }
+
+  // The bottom row of `m` is assumed to be 0 0 0 1.
+  explicit Transform3(const std::array<float, 16> &m)
+      : Transform3(Vec3f(m[0], m[1], m[2]), Vec3f(m[4], m[5], m[6]),
+                   Vec3f(m[8], m[9], m[10]), Vec3f(m[12], m[13], m[14])) {}
+
+  std::array<float, 16> to_matrix() const {
+    return {x_axis.x,      x_axis.y,      x_axis.z,      0.0f,
+            y_axis.x,      y_axis.y,      y_axis.z,      0.0f,
+            z_axis.x,      z_axis.y,      z_axis.z,      0.0f,
+            translation.x, translation.y, translation.z, 1.0f};
+  }
+
+  Vec3f point(const Vec3f &p) const {
+    return x_axis * p.x + y_axis * p.y + z_axis * p.z + translation;
+  }
+
+  Vec3f vector(const Vec3f &v) const {
+    return x_axis * v.x + y_axis * v.y + z_axis * v.z;
+  }
+
+  // Not renormalized.
+  Vec3f normal(const Vec3f &n) const {
+    return normal_matrix[0] * n.x + normal_matrix[1] * n.y +
+           normal_matrix[2] * n.z;
+  }
+
+  // A singular transform comes back as all zeros.
+  Transform3 inverse() const {
+    // the rows of the inverse linear part are the columns of normal_matrix
+    auto &r = normal_matrix;
+    auto x = Vec3f(r[0].x, r[1].x, r[2].x);
+    auto y = Vec3f(r[0].y, r[1].y, r[2].y);
+    auto z = Vec3f(r[0].z, r[1].z, r[2].z);
+    return Transform3(x, y, z, -(x * translation.x + y * translation.y +
+                                 z * translation.z));
+  }
+
+  // Transforms `count` packed xyz points in place, eight at a time.
+  void transform_points(float *xyz, size_t count) const {
+    transform_packed(xyz, count, [&](const auto &p) {
+      return Vec3f8(x_axis) * p.x + Vec3f8(y_axis) * p.y +
+             Vec3f8(z_axis) * p.z + Vec3f8(translation);
+    });
+  }
+
+  void transform_normals(float *xyz, size_t count) const {
+    transform_packed(xyz, count, [&](const auto &n) {
+      return Vec3f8(normal_matrix[0]) * n.x + Vec3f8(normal_matrix[1]) * n.y +
+             Vec3f8(normal_matrix[2]) * n.z;
+    });
+  }
+
+private:
+  // Columns of the inverse transpose: cofactors over the determinant.
+  void update_normal_matrix() {
+    float det = x_axis.dot(y_axis.cross(z_axis));
+    float inv_det = det == 0.0f ? 0.0f : 1.0f / det;
+    normal_matrix[0] = y_axis.cross(z_axis) * inv_det;
+    normal_matrix[1] = z_axis.cross(x_axis) * inv_det;
+    normal_matrix[2] = x_axis.cross(y_axis) * inv_det;
+  }
+
+  template <typename F>
+  void transform_packed(float *xyz, size_t count, F &&f) const {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+      f(Vec3f8::load_packed(xyz + 3 * i)).store_packed(xyz + 3 * i);
+    }
+    if (i < count) {
+      // the tail goes through a zero padded block
+      float tail[24] = {};
+      std::memcpy(tail, xyz + 3 * i, 3 * (count - i) * sizeof(float));
+      f(Vec3f8::load_packed(tail)).store_packed(tail);
+      std::memcpy(xyz + 3 * i, tail, 3 * (count - i) * sizeof(float));
+    }
+  }
+
+  Vec3f normal_matrix[3] = {Vec3f(1, 0, 0), Vec3f(0, 1, 0), Vec3f(0, 0, 1)};
+};
+
 } // namespace Flow
\ No newline at end of file
@@ -0,0 +1,147 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline size_t default_thread_count() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs f(i) for every i in [0, count) on up to `threads` workers, the calling
+// thread included. Items are handed out one at a time, so items of uneven
+// cost still balance across the workers.
+template <typename F> void parallel_for(size_t count, size_t threads, F &&f) {
+  threads = std::min(threads, count);
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      f(i);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next{0};
+  auto work = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      f(i);
+    }
+  };
+  std::vector<std::future<void>> workers;
+  for (size_t t = 1; t < threads; t++) {
+    workers.push_back(std::async(std::launch::async, work));
+  }
+  work();
+  for (auto &worker : workers) {
+    worker.get();
+  }
+}
+
+// A fixed set of worker threads for tasks that may submit and wait for more
+// tasks. Waiting for a task no worker has started runs it on the waiting
+// thread, so nested tasks cannot leave every worker blocked on the queue.
+class ThreadPool {
+  struct State {
+    std::function<void()> body;
+    std::atomic<bool> claimed{false};
+    std::mutex mutex;
+    std::condition_variable done_changed;
+    bool done = false;
+
+    // Runs the body unless another thread already claimed it.
+    bool try_run() {
+      if (claimed.exchange(true)) {
+        return false;
+      }
+      body();
+      {
+        std::lock_guard lock(mutex);
+        done = true;
+      }
+      done_changed.notify_all();
+      return true;
+    }
+  };
+
+public:
+  class Task {
+  public:
+    // Returns once the task has run, running it here if no worker has.
+    void wait() {
+      if (!state || state->try_run()) {
+        return;
+      }
+      std::unique_lock lock(state->mutex);
+      state->done_changed.wait(lock, [&]() { return state->done; });
+    }
+
+  private:
+    friend class ThreadPool;
+    std::shared_ptr<State> state;
+  };
+
+  explicit ThreadPool(size_t threads) {
+    for (size_t t = 0; t < threads; t++) {
+      workers.emplace_back([this]() { work(); });
+    }
+  }
+
+  // Workers finish every queued task before they exit.
+  ~ThreadPool() {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    queue_changed.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // `body` must not throw; wrap it in a std::packaged_task to hand its
+  // result or exception to the waiting thread.
+  Task submit(std::function<void()> body) {
+    Task task;
+    task.state = std::make_shared<State>();
+    task.state->body = std::move(body);
+    {
+      std::lock_guard lock(mutex);
+      queue.push_back(task.state);
+    }
+    queue_changed.notify_one();
+    return task;
+  }
+
+private:
+  void work() {
+    while (true) {
+      std::shared_ptr<State> state;
+      {
+        std::unique_lock lock(mutex);
+        queue_changed.wait(lock,
+                           [&]() { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+          return;
+        }
+        state = std::move(queue.front());
+        queue.pop_front();
+      }
+      state->try_run();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable queue_changed;
+  std::deque<std::shared_ptr<State>> queue;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
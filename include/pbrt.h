@@ -1,12 +1,29 @@
+#pragma once
+#include "math.h"
+#include "parallel.h"
+#include "perfect_hash.h"
+#include "ply.h"
+#include "scene_arena.h"
+#include "scene_source.h"
+#include "simd_scan.h"
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <charconv>
+#include <deque>
+#include <filesystem>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
 #include <optional>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -35,108 +52,357 @@ inline std::ostream &operator<<(std::ostream &stream, const Token &token) {
   return stream;
 }
 
+// Scene text that cannot be read or parsed throws ParseError rather than
+// exiting, so an Import parsed on a worker thread hands its failure to the
+// parser that waits for it.
+struct ParseError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+template <typename... Args> [[noreturn]] void parse_error(const Args &...args) {
+  std::ostringstream message;
+  (message << ... << args);
+  throw ParseError(message.str());
+}
+
+template <typename T> T parse_number(std::string_view text) {
+  T value{};
+  auto [end, error] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  if (error != std::errc()) {
+    parse_error("invalid number ", text);
+  }
+  return value;
+}
+
+// A numeric list that parse_blocks() converted while its text was still
+// arriving. Only its brackets are left in the text.
+struct StreamedList {
+  // of the '[' in the tokenizer's source
+  size_t offset;
+  std::variant<std::vector<float>, std::vector<int>> values;
+};
+
 struct Tokenizer {
   std::string_view source;
   size_t position;
   size_t row;
   size_t column;
+  // Numeric lists longer than parallel_list_bytes are converted on up to
+  // `threads` threads.
+  size_t threads;
+  size_t parallel_list_bytes;
+  // in source order
+  std::deque<StreamedList> streamed_lists;
 
   explicit Tokenizer(std::string_view source)
-      : source(source), position(0), row(0), column(0) {}
-
-  // std::optional<Token> next() {
-  //   while (true) {
-  //     char ch = source[position];
-  //     if (ch == EOF) {
-  //       return std::nullopt;
-  //     } else if (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r') {
-  //       continue;
-  //     } else if (ch == '"') {
-  //       size_t count = peek_while([&](char ch) { return ch != '"'; }, 1);
-  //       position += count + 1;
-  //       return Token{.type = TokenType::StringLiteral,
-  //                    .value = source.substr(position + 1, count - 1)};
-  //     } else if (ch == '[') {
-  //       position += 1;
-  //       return Token {
-  //         .type = TokenType::ListStart, .value = source.substr(position, 1),
-  //       }
-  //     }
-  //   }
-  // }
+      : source(source), position(0), row(0), column(0), threads(1),
+        parallel_list_bytes(1 << 20) {}
 
-  std::vector<Token> tokenize() {
-    std::vector<Token> tokens;
+  // Pulls the next token out of the source, or std::nullopt once the source
+  // is exhausted. Tokens are produced on demand so the parser never needs the
+  // whole token stream in memory.
+  std::optional<Token> next() {
     while (position < source.length()) {
       char b = source[position];
-      if (b == '\n') {
-        position += 1;
-        column = 0;
-        row += 1;
-      } else if (b == ' ') {
-        size_t count = peek_while([&](char ch) { return ch == ' '; }, 0);
-        position += count;
-        column += count;
+      if (b == ' ' || b == '\n') {
+        skip_whitespace();
       } else if (isalpha(b)) {
-        size_t count = peek_while([&](char ch) { return isalnum(ch); }, 1);
-        tokens.push_back(Token{.type = TokenType::Identifier,
-                               .value = source.substr(position, count)});
+        size_t count = peek_while<scan::CharClass::Identifier>(1);
+        Token token{.type = TokenType::Identifier,
+                    .value = source.substr(position, count)};
         position += count;
         column += count;
+        return token;
       } else if (b == '[') {
-        tokens.push_back(Token{.type = TokenType::ListStart});
         position += 1;
         column += 1;
+        return Token{.type = TokenType::ListStart};
       } else if (b == ']') {
-        tokens.push_back(Token{.type = TokenType::ListEnd});
         position += 1;
         column += 1;
+        return Token{.type = TokenType::ListEnd};
       } else if (b == '"') {
-        size_t count = peek_while([&](char ch) { return ch != '"'; }, 1);
-        tokens.push_back(
-            Token{.type = TokenType::StringLiteral,
-                  .value = source.substr(position + 1, count - 1)});
+        size_t count = peek_while<scan::CharClass::StringBody>(1);
+        Token token{.type = TokenType::StringLiteral,
+                    .value = source.substr(position + 1, count - 1)};
         position += count + 1;
         column += count + 1;
+        return token;
       } else if (b == '-' || isdigit(b)) {
-        size_t count = peek_while(
-            [&](char ch) {
-              return isdigit(ch) || ch == '.' || ch == '-' || ch == 'e';
-            },
-            1);
-        tokens.push_back(Token{.type = TokenType::Number,
-                               .value = source.substr(position, count)});
+        size_t count = peek_while<scan::CharClass::Number>(1);
+        Token token{.type = TokenType::Number,
+                    .value = source.substr(position, count)};
         position += count;
         column += count;
+        return token;
       } else {
-        std::cerr << "Unexpected character: " << position << " " << b
-                  << std::endl;
-        exit(1);
+        parse_error("Unexpected character: ", position, " ", b);
       }
     }
+    return std::nullopt;
+  }
+
+  std::vector<Token> tokenize() {
+    std::vector<Token> tokens;
+    while (auto token = next()) {
+      tokens.push_back(*token);
+    }
     return tokens;
   }
 
-  size_t peek_while(const std::function<bool(char)> &p, size_t offset) const {
-    size_t consumed = offset;
-    while (position + consumed < source.length() &&
-           p(source[position + consumed])) {
-      consumed += 1;
+  // Bulk path for numeric lists. Expects the opening '[' to have been consumed
+  // already and reads every number up to and including the closing ']'
+  // straight from the source bytes, without producing tokens. `values` is
+  // sized by a counting pass first so it is allocated exactly once. Large
+  // lists are cut at whitespace into pieces that are counted and converted
+  // in parallel.
+  template <typename T, typename Allocator>
+  void read_number_list(std::vector<T, Allocator> &values) {
+    if (take_streamed_list(values)) {
+      return;
+    }
+    auto list = number_list();
+    convert_number_list(list, values);
+    skip_number_list(list);
+  }
+
+  // Text of the numeric list whose '[' was just consumed, up to but not
+  // including the closing ']'.
+  std::string_view number_list() const {
+    size_t end = source.find(']', position);
+    if (end == std::string_view::npos) {
+      parse_error("unterminated list at row ", row);
+    }
+    return source.substr(position, end - position);
+  }
+
+  // If the list whose '[' was just consumed was streamed, moves its values
+  // into `values` and moves past its ']'. Streamed lists the parser skipped
+  // are dropped on the way.
+  template <typename T, typename Allocator>
+  bool take_streamed_list(std::vector<T, Allocator> &values) {
+    size_t offset = position - 1;
+    while (!streamed_lists.empty() && streamed_lists.front().offset < offset) {
+      streamed_lists.pop_front();
+    }
+    if (streamed_lists.empty() || streamed_lists.front().offset != offset) {
+      return false;
+    }
+    std::visit([&](auto &streamed) {
+      values.assign(streamed.begin(), streamed.end());
+    }, streamed_lists.front().values);
+    streamed_lists.pop_front();
+    skip_number_list(number_list());
+    return true;
+  }
+
+  // Moves past `list`, which number_list() returned, and its ']'.
+  void skip_number_list(std::string_view list) {
+    auto last_newline = list.rfind('\n');
+    if (last_newline == std::string_view::npos) {
+      column += list.size() + 1;
+    } else {
+      row += std::count(list.begin(), list.end(), '\n');
+      column = list.size() - last_newline;
+    }
+    position += list.size() + 1;
+  }
+
+  // Replaces everything in `values` from index `first` on with the numbers
+  // of `list`.
+  template <typename T, typename Allocator>
+  void convert_number_list(std::string_view list,
+                           std::vector<T, Allocator> &values,
+                           size_t first = 0) {
+    if (threads > 1 && list.size() >= parallel_list_bytes) {
+      read_numbers_parallel(list, values, first);
+    } else {
+      values.resize(first + scan::count_words(list.data(), list.size()));
+      read_numbers(list, values.data() + first, row);
+    }
+  }
+
+  // Cuts `list` at whitespace into a few pieces per thread, counts the numbers
+  // of every piece in parallel and then converts each piece straight into its
+  // slot of `values`.
+  template <typename T, typename Allocator>
+  void read_numbers_parallel(std::string_view list,
+                             std::vector<T, Allocator> &values,
+                             size_t first) {
+    size_t pieces = threads * 4;
+    std::vector<size_t> bounds{0};
+    for (size_t i = 1; i < pieces; i++) {
+      size_t bound = std::max(list.size() * i / pieces, bounds.back());
+      while (bound < list.size() &&
+             !scan::matches<scan::CharClass::Space>(list[bound])) {
+        bound += 1;
+      }
+      bounds.push_back(bound);
+    }
+    bounds.push_back(list.size());
+
+    std::vector<size_t> offsets(pieces + 1, 0);
+    parallel_for(pieces, threads, [&](size_t i) {
+      offsets[i + 1] =
+          scan::count_words(list.data() + bounds[i], bounds[i + 1] - bounds[i]);
+    });
+    for (size_t i = 0; i < pieces; i++) {
+      offsets[i + 1] += offsets[i];
+    }
+
+    values.resize(first + offsets.back());
+    parallel_for(pieces, threads, [&](size_t i) {
+      read_numbers(list.substr(bounds[i], bounds[i + 1] - bounds[i]),
+                   values.data() + first + offsets[i], row);
+    });
+  }
+
+  // Converts the whitespace separated numbers of `text` into `out`, which has
+  // room for exactly as many values as scan::count_words() finds.
+  template <typename T>
+  static void read_numbers(std::string_view text, T *out, size_t row) {
+    const char *p = text.data();
+    const char *last = p + text.size();
+    while (true) {
+      p += scan::span<scan::CharClass::Space>(p, last - p);
+      if (p == last) {
+        break;
+      }
+      auto [next, error] = std::from_chars(p, last, *out);
+      if (error != std::errc() ||
+          (next != last && !scan::matches<scan::CharClass::Space>(*next))) {
+        parse_error("invalid number in list at row ", row);
+      }
+      out += 1;
+      p = next;
+    }
+  }
+
+  // Skips a run of spaces and newlines, keeping row and column up to date.
+  void skip_whitespace() {
+    size_t count = peek_while<scan::CharClass::Space>(0);
+    auto run = source.substr(position, count);
+    size_t last_newline = run.rfind('\n');
+    if (last_newline == std::string_view::npos) {
+      column += count;
+    } else {
+      row += std::count(run.begin(), run.end(), '\n');
+      column = count - last_newline - 1;
     }
+    position += count;
+  }
 
-    return consumed;
+  // Length of the run of class C starting `offset` bytes past the current
+  // position, plus `offset` itself.
+  template <scan::CharClass C> size_t peek_while(size_t offset) const {
+    size_t start = position + offset;
+    return offset + scan::span<C>(source.data() + start,
+                                  source.length() - start);
   }
 };
 
+enum class Directive {
+  Unknown,
+  AreaLightSource,
+  AttributeBegin,
+  AttributeEnd,
+  Camera,
+  Film,
+  Import,
+  Include,
+  Integrator,
+  MakeNamedMaterial,
+  NamedMaterial,
+  ObjectBegin,
+  ObjectEnd,
+  ObjectInstance,
+  PixelFilter,
+  Sampler,
+  Shape,
+  Transform,
+  WorldBegin,
+};
+
+inline constexpr auto DIRECTIVES = make_perfect_hash<Directive>({
+    {"AreaLightSource", Directive::AreaLightSource},
+    {"AttributeBegin", Directive::AttributeBegin},
+    {"AttributeEnd", Directive::AttributeEnd},
+    {"Camera", Directive::Camera},
+    {"Film", Directive::Film},
+    {"Import", Directive::Import},
+    {"Include", Directive::Include},
+    {"Integrator", Directive::Integrator},
+    {"MakeNamedMaterial", Directive::MakeNamedMaterial},
+    {"NamedMaterial", Directive::NamedMaterial},
+    {"ObjectBegin", Directive::ObjectBegin},
+    {"ObjectEnd", Directive::ObjectEnd},
+    {"ObjectInstance", Directive::ObjectInstance},
+    {"PixelFilter", Directive::PixelFilter},
+    {"Sampler", Directive::Sampler},
+    {"Shape", Directive::Shape},
+    {"Transform", Directive::Transform},
+    {"WorldBegin", Directive::WorldBegin},
+});
+
+inline Directive find_directive(std::string_view name) {
+  return DIRECTIVES.find(name).value_or(Directive::Unknown);
+}
+
+// Parameters are matched on their whole "type key" declaration, so the type
+// is checked by the same lookup that finds the key.
+enum class Parameter {
+  Unknown,
+  Filename,
+  Fov,
+  Indices,
+  L,
+  MaxDepth,
+  N,
+  P,
+  PixelSamples,
+  Reflectance,
+  Type,
+  Uv,
+  XRadius,
+  XResolution,
+  YRadius,
+  YResolution,
+};
+
+inline constexpr auto PARAMETERS = make_perfect_hash<Parameter>({
+    {"string filename", Parameter::Filename},
+    {"float fov", Parameter::Fov},
+    {"integer indices", Parameter::Indices},
+    {"rgb L", Parameter::L},
+    {"integer maxdepth", Parameter::MaxDepth},
+    {"normal N", Parameter::N},
+    {"point3 P", Parameter::P},
+    {"integer pixelsamples", Parameter::PixelSamples},
+    {"rgb reflectance", Parameter::Reflectance},
+    {"string type", Parameter::Type},
+    {"point2 uv", Parameter::Uv},
+    {"float xradius", Parameter::XRadius},
+    {"integer xresolution", Parameter::XResolution},
+    {"float yradius", Parameter::YRadius},
+    {"integer yresolution", Parameter::YResolution},
+});
+
+inline Parameter find_parameter(std::string_view declaration) {
+  return PARAMETERS.find(declaration).value_or(Parameter::Unknown);
+}
+
+// Names in the structs below are interned into the owning SceneData (see
+// SymbolTable) and stay valid as long as it does.
 struct IntegratorData {
-  std::string kind;
+  std::string_view kind;
   size_t max_depth;
 
   IntegratorData() : kind("path"), max_depth(1) {}
 };
 
 struct CameraData {
-  std::string kind;
+  std::string_view kind;
   float fov;
 
   CameraData() : kind("perspective"), fov(90.0f) {}
@@ -150,7 +416,7 @@ struct SamplerData {
 };
 
 struct FilmData {
-  std::string kind;
+  std::string_view kind;
   size_t x_resolution;
   size_t y_resolution;
   std::string_view filename;
@@ -181,11 +447,35 @@ struct MaterialData {
   std::variant<DiffuseMaterialData> data;
 };
 
+// Column major, like the values of a Transform directive.
+inline constexpr std::array<float, 16> IDENTITY_TRANSFORM = {
+    1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+
+// A numeric list that a parse with Parser::defer_attributes left in the
+// source text.
+struct DeferredArray {
+  // between '[' and ']'
+  std::string_view text;
+  size_t count;
+  // object to world transform still to be applied, for normals
+  std::array<float, 16> transform = IDENTITY_TRANSFORM;
+};
+
+enum class MeshAttribute { Uv, Normal };
+
 struct TriangleMeshShapeData {
-  std::vector<float> uvs;
-  std::vector<float> normals;
-  std::vector<float> positions;
-  std::vector<int> indices;
+  TriangleMeshShapeData() = default;
+  explicit TriangleMeshShapeData(std::pmr::memory_resource *arena)
+      : uvs(arena), normals(arena), positions(arena), indices(arena) {}
+
+  std::pmr::vector<float> uvs;
+  std::pmr::vector<float> normals;
+  std::pmr::vector<float> positions;
+  std::pmr::vector<int> indices;
+  // Set instead of uvs and normals until SceneData::load_attributes()
+  // decodes them.
+  std::optional<DeferredArray> deferred_uvs;
+  std::optional<DeferredArray> deferred_normals;
 };
 
 struct LightData {
@@ -193,336 +483,797 @@ struct LightData {
   std::string_view kind;
 };
 
+// Material id of shapes that were created before any NamedMaterial.
+inline constexpr uint32_t NO_MATERIAL = UINT32_MAX;
+
 struct ShapeData {
 
-  static ShapeData make_triangle_mesh() {
-    return ShapeData{.data = TriangleMeshShapeData{}};
+  static ShapeData make_triangle_mesh(
+      std::pmr::memory_resource *arena = std::pmr::get_default_resource()) {
+    return ShapeData{.data = TriangleMeshShapeData(arena)};
   }
 
   std::optional<LightData> light;
-  std::string_view material;
+  // index into SceneData::materials, or NO_MATERIAL
+  uint32_t material = NO_MATERIAL;
   std::variant<TriangleMeshShapeData> data;
 };
 
+// Moves the positions and normals of `mesh` from object to world space, on up
+// to `threads` threads for large meshes.
+void apply_transform(TriangleMeshShapeData &mesh,
+                     const Flow::Transform3 &transform, size_t threads = 1);
+
+// Shapes between ObjectBegin and ObjectEnd. They are stored once and drawn by
+// every ObjectInstance that names the object.
+struct ObjectData {
+  std::pmr::vector<ShapeData> shapes;
+};
+
+struct InstanceData {
+  std::string_view object;
+  // object to world
+  std::array<float, 16> transform;
+};
+
+// Deduplicated copies of the names a scene refers to, allocated from the
+// scene's arena. Interned names do not point into the source text, so the
+// source can be unmapped as soon as parsing is done.
+struct SymbolTable {
+  explicit SymbolTable(std::pmr::memory_resource *arena)
+      : arena(arena), symbols(arena) {}
+
+  std::string_view intern(std::string_view name) {
+    if (auto symbol = symbols.find(name); symbol != symbols.end()) {
+      return *symbol;
+    }
+    // null terminated, so file names can go straight to C APIs
+    auto *copy = static_cast<char *>(arena->allocate(name.size() + 1, 1));
+    std::copy(name.begin(), name.end(), copy);
+    copy[name.size()] = '\0';
+    return *symbols.insert(std::string_view(copy, name.size())).first;
+  }
+
+  size_t size() const { return symbols.size(); }
+
+private:
+  std::pmr::memory_resource *arena;
+  std::pmr::unordered_set<std::string_view> symbols;
+};
+
+// Tables and mesh arrays are allocated from `arena`. Containers are moved
+// between scenes only by construction, which keeps their arena, so move
+// assignment is deleted.
 struct SceneData {
+  // declared first so it is destroyed after everything allocated from it
+  std::shared_ptr<SceneArena> arena;
+  // arenas of scenes appended with append(), which own some of our arrays
+  std::vector<std::shared_ptr<SceneArena>> retained_arenas;
+
   IntegratorData integrator;
   CameraData camera;
   SamplerData sampler;
   FilmData film;
   PixelFilterData pixel_filter;
-  std::array<float, 16> transform;
-  std::unordered_map<std::string_view, MaterialData> materials;
-  std::vector<ShapeData> shapes;
-  SceneData() : integrator(), camera(), sampler(), film(), pixel_filter() {}
+  // world to camera
+  std::array<float, 16> transform = IDENTITY_TRANSFORM;
+  // every name below is interned here
+  SymbolTable symbols;
+  // Materials by dense id, in the order their names first appear. A name
+  // that NamedMaterial uses but MakeNamedMaterial never defines has an id
+  // and an empty entry.
+  std::pmr::vector<std::optional<MaterialData>> materials;
+  std::pmr::vector<std::string_view> material_names;
+  std::pmr::unordered_map<std::string_view, uint32_t> material_ids;
+  std::pmr::vector<ShapeData> shapes;
+  std::pmr::unordered_map<std::string_view, ObjectData> objects;
+  std::pmr::vector<InstanceData> instances;
+  // Files that deferred attribute arrays point into. load_attributes()
+  // releases them once no array is left deferred.
+  std::vector<SceneSource> sources;
+
+  SceneData() : SceneData(std::make_shared<SceneArena>()) {}
+  explicit SceneData(std::shared_ptr<SceneArena> arena)
+      : arena(std::move(arena)), integrator(), camera(), sampler(), film(),
+        pixel_filter(), symbols(this->arena.get()),
+        materials(this->arena.get()), material_names(this->arena.get()),
+        material_ids(this->arena.get()), shapes(this->arena.get()),
+        objects(this->arena.get()), instances(this->arena.get()) {}
+  SceneData(SceneData &&) = default;
+  SceneData &operator=(SceneData &&) = delete;
+
+  std::string_view intern(std::string_view name) {
+    return symbols.intern(name);
+  }
+
+  // Id of the material called `name`, assigning the next one if the name is
+  // new. The empty name is NO_MATERIAL.
+  uint32_t material_id(std::string_view name) {
+    if (name.empty()) {
+      return NO_MATERIAL;
+    }
+    if (auto id = material_ids.find(name); id != material_ids.end()) {
+      return id->second;
+    }
+    uint32_t id = materials.size();
+    auto interned = intern(name);
+    materials.emplace_back();
+    material_names.push_back(interned);
+    material_ids.insert({interned, id});
+    return id;
+  }
+
+  // The first definition of a name wins.
+  void define_material(std::string_view name, const MaterialData &material) {
+    auto &entry = materials[material_id(name)];
+    if (!entry) {
+      entry = material;
+    }
+  }
+
+  std::string_view material_name(uint32_t id) const {
+    return id == NO_MATERIAL ? std::string_view() : material_names[id];
+  }
+
+  // Decodes `attribute` of every mesh that has it deferred, in parallel.
+  void load_attributes(MeshAttribute attribute,
+                       size_t threads = default_thread_count());
+  bool has_deferred_attributes() const;
+
+  // Adds the materials, shapes, objects, instances and sources of `other`
+  // after this scene's own. Material ids of `other` are remapped by name,
+  // and the first definition of a name is kept. Shapes keep the arena they
+  // were allocated from.
+  void append(SceneData &&other) {
+    if (other.arena != arena) {
+      retained_arenas.push_back(std::move(other.arena));
+    }
+    for (auto &retained : other.retained_arenas) {
+      retained_arenas.push_back(std::move(retained));
+    }
+    std::vector<uint32_t> remap(other.materials.size());
+    for (uint32_t id = 0; id < other.materials.size(); id++) {
+      remap[id] = material_id(other.material_names[id]);
+      if (other.materials[id]) {
+        define_material(other.material_names[id], *other.materials[id]);
+      }
+    }
+    auto remap_material = [&](ShapeData &shape) {
+      if (shape.material != NO_MATERIAL) {
+        shape.material = remap[shape.material];
+      }
+    };
+    for (auto &shape : other.shapes) {
+      remap_material(shape);
+      shapes.push_back(std::move(shape));
+    }
+    for (auto &[name, object] : other.objects) {
+      for (auto &shape : object.shapes) {
+        remap_material(shape);
+      }
+      objects.insert({intern(name), std::move(object)});
+    }
+    for (auto &instance : other.instances) {
+      instances.push_back(InstanceData{.object = intern(instance.object),
+                                       .transform = instance.transform});
+    }
+    for (auto &source : other.sources) {
+      sources.push_back(std::move(source));
+    }
+  }
 };
 
+// Imports from every load, nested ones included, run on this pool, so a
+// scene with many Import directives never has more than
+// default_thread_count() threads parsing them.
+inline ThreadPool &import_pool() {
+  static ThreadPool pool(default_thread_count());
+  return pool;
+}
+
 struct Parser {
-  const std::vector<Token> &tokens;
-  size_t position;
+  Tokenizer &tokenizer;
+  // Single token of lookahead; the grammar never needs more, so the parser
+  // holds O(1) tokens no matter how large the scene is.
+  Token current;
+  // Graphics state. Attribute and object blocks restore both when they end.
+  std::string_view material;
+  std::array<float, 16> transform = IDENTITY_TRANSFORM;
+  // Transform sets the camera transform before WorldBegin and the current
+  // transform after it.
+  bool in_world = false;
+  // Directory that file names in the scene are relative to.
+  std::filesystem::path base_directory;
+  // Where the parsed scene is allocated; parse() creates one if unset.
+  std::shared_ptr<SceneArena> arena;
+  // Names kept in the scene are interned here rather than pointing into the
+  // source. Set by parse_into().
+  SymbolTable *symbols = nullptr;
+  // Leaves trianglemesh uv and N lists in the source text for
+  // SceneData::load_attributes(), so the source must outlive the scene
+  // until they are loaded. Files opened by Include and Import are kept in
+  // SceneData::sources for this.
+  bool defer_attributes = false;
+
+  // An Import being parsed on its own thread, and where in the shape list its
+  // shapes belong.
+  struct PendingImport {
+    size_t shape_index;
+    std::future<SceneData> scene;
+    ThreadPool::Task task;
+  };
+  std::vector<PendingImport> imports;
 
-  Parser(const std::vector<Token> &tokens) : tokens(tokens), position(0) {}
+  explicit Parser(Tokenizer &tokenizer)
+      : tokenizer(tokenizer), current{.type = TokenType::Undefined} {
+    advance();
+  }
+
+  void advance() {
+    current = tokenizer.next().value_or(Token{.type = TokenType::Undefined});
+  }
+
+  bool at_end() const { return current.type == TokenType::Undefined; }
 
   SceneData parse() {
-    SceneData scene_data;
-    while (position < tokens.size()) {
-      const auto &token = tokens.at(position);
+    if (!arena) {
+      arena = std::make_shared<SceneArena>();
+    }
+    SceneData scene_data(arena);
+    parse_into(scene_data);
+    merge_imports(scene_data);
+    return scene_data;
+  }
+
+  void parse_into(SceneData &scene_data) {
+    if (!arena) {
+      arena = scene_data.arena;
+    }
+    symbols = &scene_data.symbols;
+    while (!at_end()) {
+      const auto &token = current;
       switch (token.type) {
       case TokenType::Identifier: {
-        if (token.value == "Integrator") {
+        switch (find_directive(token.value)) {
+        case Directive::Integrator:
           scene_data.integrator = parse_integrator();
-        } else if (token.value == "Transform") {
-          scene_data.transform = parse_transform();
-        } else if (token.value == "Sampler") {
+          break;
+        case Directive::Transform:
+          if (in_world) {
+            transform = parse_transform();
+          } else {
+            scene_data.transform = parse_transform();
+          }
+          break;
+        case Directive::Sampler:
           scene_data.sampler = parse_sampler();
-        } else if (token.value == "PixelFilter") {
+          break;
+        case Directive::PixelFilter:
           scene_data.pixel_filter = parse_pixel_filter();
-        } else if (token.value == "Film") {
+          break;
+        case Directive::Film:
           scene_data.film = parse_film();
-        } else if (token.value == "WorldBegin") {
-          parse_world(scene_data);
-        } else if (token.value == "AttributeBegin") {
+          break;
+        case Directive::WorldBegin:
+          in_world = true;
+          advance();
+          break;
+        case Directive::MakeNamedMaterial: {
+          auto [name, material_data] = parse_material();
+          scene_data.define_material(name, material_data);
+          break;
+        }
+        case Directive::NamedMaterial:
+          material = parse_named_material();
+          break;
+        case Directive::Shape: {
+          ShapeData shape{.material = scene_data.material_id(material)};
+          parse_shape(shape);
+          scene_data.shapes.push_back(std::move(shape));
+          break;
+        }
+        case Directive::AttributeBegin:
           parse_attribute(scene_data);
-        } else if (token.value == "Camera") {
+          break;
+        case Directive::ObjectBegin:
+          parse_object(scene_data);
+          break;
+        case Directive::ObjectInstance:
+          scene_data.instances.push_back(parse_object_instance());
+          break;
+        case Directive::Camera:
           scene_data.camera = parse_camera();
+          break;
+        case Directive::Include:
+          parse_include(scene_data);
+          break;
+        case Directive::Import:
+          parse_import(scene_data);
+          break;
+        default:
+          parse_error("unsupported directive ", token.value);
         }
         break;
       }
       default:
-        std::cout << token << std::endl;
-        std::cout << "not implemented" << std::endl;
-        exit(1);
+        parse_error("not implemented: ", token);
       }
     }
-    return scene_data;
   }
 
-  void parse_world(SceneData &scene_data) {
-    position += 1;
-    while (tokens.at(position).type == TokenType::Identifier &&
-           tokens.at(position).value == "MakeNamedMaterial") {
-      scene_data.materials.insert(parse_material());
+  static SceneSource map_scene(const std::filesystem::path &path) {
+    auto source = SceneSource::map_file(path.c_str());
+    if (!source) {
+      parse_error("failed to read scene ", path.string());
     }
+    return std::move(*source);
+  }
+
+  // Include splices the file in place: it shares the graphics state and its
+  // NamedMaterial changes stay in effect afterwards. The file is unmapped
+  // once it is parsed.
+  void parse_include(SceneData &scene_data) {
+    advance();
+    auto source = map_scene(base_directory / current.value);
+    advance();
+
+    Tokenizer included_tokenizer(source.view());
+    included_tokenizer.threads = tokenizer.threads;
+    Parser parser(included_tokenizer);
+    parser.material = material;
+    parser.transform = transform;
+    parser.in_world = in_world;
+    parser.base_directory = base_directory;
+    parser.arena = arena;
+    parser.defer_attributes = defer_attributes;
+    parser.parse_into(scene_data);
+    material = parser.material;
+    transform = parser.transform;
+    in_world = parser.in_world;
+    for (auto &import : parser.imports) {
+      imports.push_back(std::move(import));
+    }
+    if (defer_attributes) {
+      scene_data.sources.push_back(std::move(source));
+    }
+  }
 
-    while (tokens.at(position).type == TokenType::Identifier &&
-           tokens.at(position).value == "NamedMaterial") {
-      ShapeData data;
-      data.material = parse_named_material();
-      parse_shape(data);
+  // Import cannot change the importing file's graphics state, so the file is
+  // parsed on the shared import pool while the rest of this one is parsed,
+  // and merged at the end. A failure in the import is rethrown by
+  // merge_imports.
+  void parse_import(SceneData &scene_data) {
+    advance();
+    auto path = base_directory / current.value;
+    advance();
+
+    auto load = [path, material = material, transform = transform,
+                 in_world = in_world, base_directory = base_directory,
+                 arena = arena, threads = tokenizer.threads,
+                 defer_attributes = defer_attributes]() {
+      auto source = map_scene(path);
+      Tokenizer tokenizer(source.view());
+      tokenizer.threads = threads;
+      Parser parser(tokenizer);
+      parser.material = material;
+      parser.transform = transform;
+      parser.in_world = in_world;
+      parser.arena = arena;
+      parser.base_directory = base_directory;
+      parser.defer_attributes = defer_attributes;
+      auto scene_data = parser.parse();
+      if (defer_attributes) {
+        scene_data.sources.push_back(std::move(source));
+      }
+      return scene_data;
+    };
+    auto task = std::make_shared<std::packaged_task<SceneData()>>(load);
+    auto scene = task->get_future();
+    imports.push_back(PendingImport{
+        .shape_index = scene_data.shapes.size(),
+        .scene = std::move(scene),
+        .task = import_pool().submit([task]() { (*task)(); })});
+  }
+
+  // Waits for every Import and splices its shapes in where the Import
+  // directive was, so the result does not depend on which file finished
+  // first.
+  void merge_imports(SceneData &scene_data) {
+    if (imports.empty()) {
+      return;
+    }
+    auto own_shapes = std::move(scene_data.shapes);
+    scene_data.shapes.clear();
+    size_t next = 0;
+    for (auto &import : imports) {
+      for (; next < import.shape_index; next++) {
+        scene_data.shapes.push_back(std::move(own_shapes[next]));
+      }
+      import.task.wait();
+      scene_data.append(import.scene.get());
     }
+    for (; next < own_shapes.size(); next++) {
+      scene_data.shapes.push_back(std::move(own_shapes[next]));
+    }
+    imports.clear();
   }
 
   void parse_attribute(SceneData &scene_data) {
-    position += 1;
-    ShapeData shape;
-    while (tokens.at(position).value != "AttributeEnd") {
-      if (tokens.at(position).value == "AreaLightSource") {
-        shape.light = parse_light();
-      } else if (tokens.at(position).value == "NamedMaterial") {
-        auto res = parse_named_material();
-        shape.material = res;
-      } else if (tokens.at(position).value == "Shape") {
+    advance();
+    // attribute blocks start from the enclosing state and discard their
+    // changes at AttributeEnd
+    std::optional<LightData> light;
+    auto saved_material = material;
+    auto saved_transform = transform;
+    for (auto directive = find_directive(current.value);
+         !at_end() && directive != Directive::AttributeEnd;
+         directive = find_directive(current.value)) {
+      switch (directive) {
+      case Directive::AreaLightSource:
+        light = parse_light();
+        break;
+      case Directive::NamedMaterial:
+        material = parse_named_material();
+        break;
+      case Directive::Transform:
+        transform = parse_transform();
+        break;
+      case Directive::Shape: {
+        ShapeData shape{.light = light,
+                        .material = scene_data.material_id(material)};
         parse_shape(shape);
+        scene_data.shapes.push_back(std::move(shape));
+        break;
+      }
+      case Directive::ObjectBegin:
+        parse_object(scene_data);
+        break;
+      case Directive::ObjectInstance:
+        scene_data.instances.push_back(parse_object_instance());
+        break;
+      default:
+        parse_error("unsupported attribute directive ", current.value);
       }
     }
-    position += 1;
+    advance();
+    material = saved_material;
+    transform = saved_transform;
+  }
+
+  // The shapes of an object stay in object space; every instance supplies
+  // its own transform.
+  void parse_object(SceneData &scene_data) {
+    advance();
+    auto name = intern(current.value);
+    advance();
+    ObjectData object{.shapes = std::pmr::vector<ShapeData>(arena.get())};
+    auto saved_material = material;
+    for (auto directive = find_directive(current.value);
+         !at_end() && directive != Directive::ObjectEnd;
+         directive = find_directive(current.value)) {
+      if (directive == Directive::NamedMaterial) {
+        material = parse_named_material();
+      } else if (directive == Directive::Shape) {
+        ShapeData shape{.material = scene_data.material_id(material)};
+        parse_shape(shape, false);
+        object.shapes.push_back(std::move(shape));
+      } else {
+        parse_error("unsupported object directive ", current.value);
+      }
+    }
+    advance();
+    material = saved_material;
+    scene_data.objects.insert({name, std::move(object)});
+  }
+
+  InstanceData parse_object_instance() {
+    advance();
+    InstanceData instance{.object = intern(current.value),
+                          .transform = transform};
+    advance();
+    return instance;
   }
 
   LightData parse_light() {
-    position += 1;
+    advance();
     LightData light;
-    light.kind = tokens.at(position).value;
-    position += 1;
-    while (tokens.at(position).type != TokenType::Identifier) {
-      auto [type, key] = parse_type_and_key();
-      if (type == "rgb" && key == "L") {
+    light.kind = intern(current.value);
+    advance();
+    while (current.type == TokenType::StringLiteral) {
+      auto [parameter, declaration] = parse_parameter();
+      if (parameter == Parameter::L) {
         light.l = parse_values<float, 3>();
       } else {
-        std::cerr << "unknown type and key for light " << key << ": " << type
-                  << std::endl;
+        skip_unknown("light", declaration);
       }
     }
     return light;
   }
 
   std::string_view parse_named_material() {
-    position += 1;
-    auto temp = tokens.at(position).value;
-    position += 1;
+    advance();
+    auto temp = intern(current.value);
+    advance();
     return temp;
   }
 
-  void parse_shape(ShapeData &shape_data) {
-    position += 1;
-    auto shape_type = tokens.at(position).value;
+  // Shapes outside objects are moved to world space with the current
+  // transform.
+  void parse_shape(ShapeData &shape_data, bool to_world = true) {
+    advance();
+    auto shape_type = current.value;
     if (shape_type == "trianglemesh") {
-      TriangleMeshShapeData shape;
-      position += 1;
-      while (tokens.at(position).type != TokenType::Identifier) {
-        auto [type, key] = parse_type_and_key();
-        if (type == "point2" && key == "uv") {
-          shape.uvs = parse_unknown_values<float>();
-        } else if (type == "normal" && key == "N") {
-          shape.normals = parse_unknown_values<float>();
-        } else if (type == "point3" && key == "P") {
-          shape.positions = parse_unknown_values<float>();
-        } else if (type == "integer" && key == "indices") {
-          shape.indices = parse_unknown_values<int>();
+      auto &shape =
+          shape_data.data.emplace<TriangleMeshShapeData>(arena.get());
+      advance();
+      while (current.type == TokenType::StringLiteral) {
+        auto [parameter, declaration] = parse_parameter();
+        switch (parameter) {
+        case Parameter::Uv:
+          parse_mesh_attribute(shape.uvs, shape.deferred_uvs);
+          break;
+        case Parameter::N:
+          parse_mesh_attribute(shape.normals, shape.deferred_normals);
+          break;
+        case Parameter::P:
+          parse_unknown_values(shape.positions);
+          break;
+        case Parameter::Indices:
+          parse_unknown_values(shape.indices);
+          break;
+        default:
+          skip_unknown("trianglemesh", declaration);
+        }
+      }
+    } else if (shape_type == "plymesh") {
+      auto &shape =
+          shape_data.data.emplace<TriangleMeshShapeData>(arena.get());
+      advance();
+      while (current.type == TokenType::StringLiteral) {
+        auto [parameter, declaration] = parse_parameter();
+        if (parameter == Parameter::Filename) {
+          auto path = base_directory / parse_string_values<1>()[0];
+          if (!load_ply_mesh(path.c_str(), shape, tokenizer.threads)) {
+            parse_error("failed to read plymesh ", path.string());
+          }
         } else {
-          std::cerr << "unknown key " << key << "  and type: " << type
-                    << std::endl;
+          skip_unknown("plymesh", declaration);
         }
       }
-      shape_data.data = shape;
     } else {
       std::cerr << "unsupported shape type " << shape_type << std::endl;
     }
+    if (to_world && transform != IDENTITY_TRANSFORM) {
+      auto &mesh = std::get<TriangleMeshShapeData>(shape_data.data);
+      apply_transform(mesh, Flow::Transform3(transform), tokenizer.threads);
+      if (mesh.deferred_normals) {
+        mesh.deferred_normals->transform = transform;
+      }
+    }
+  }
+
+  // Converts a uv or N list now, or with defer_attributes only records where
+  // it is and how many numbers it holds.
+  void parse_mesh_attribute(std::pmr::vector<float> &values,
+                            std::optional<DeferredArray> &deferred) {
+    if (!defer_attributes) {
+      parse_unknown_values(values);
+      return;
+    }
+    auto list = tokenizer.number_list();
+    tokenizer.skip_number_list(list);
+    deferred = DeferredArray{
+        .text = list, .count = scan::count_words(list.data(), list.size())};
+    advance();
   }
 
   std::pair<std::string_view, MaterialData> parse_material() {
-    position += 1;
-    auto key = tokens.at(position).value;
-    position += 1;
-    MaterialData material_data;
-
-    {
-      auto [type, key] = parse_type_and_key();
-      std::string material_type;
-      std::array<float, 3> reflectance;
-      if (type == "string") {
+    advance();
+    auto name = current.value;
+    advance();
+    std::string_view material_type;
+    std::array<float, 3> reflectance{};
+    while (current.type == TokenType::StringLiteral) {
+      auto [parameter, declaration] = parse_parameter();
+      if (parameter == Parameter::Type) {
         material_type = parse_string_values<1>()[0];
-      }
-
-      auto [data_type, name] = parse_type_and_key();
-      if (data_type == "rgb" && name == "reflectance") {
+      } else if (parameter == Parameter::Reflectance) {
         reflectance = parse_values<float, 3>();
       } else {
-        std::cerr << "unsupported material type " << key << std::endl;
-      }
-      if (material_type == "diffuse") {
-        material_data = MaterialData::make_diffuse(reflectance);
+        skip_unknown("material", declaration);
       }
     }
-
-    return {key, material_data};
+    // pbrt's default material type is diffuse
+    if (!material_type.empty() && material_type != "diffuse") {
+      std::cerr << "unsupported material type " << material_type << std::endl;
+    }
+    return {name, MaterialData::make_diffuse(reflectance)};
   }
 
   IntegratorData parse_integrator() {
     IntegratorData integrator_data;
-    position += 1; // skip integrator identifier
-    integrator_data.kind = tokens.at(position).value;
-    position += 1;
-    while (tokens.at(position).type != TokenType::Identifier) {
-      auto [type, key] = parse_type_and_key();
-      if (key == "maxdepth") {
+    advance(); // skip integrator identifier
+    integrator_data.kind = intern(current.value);
+    advance();
+    while (current.type == TokenType::StringLiteral) {
+      auto [parameter, declaration] = parse_parameter();
+      if (parameter == Parameter::MaxDepth) {
         integrator_data.max_depth = parse_values<int, 1>()[0];
       } else {
-        std::cerr << "unknown key " << key << std::endl;
+        skip_unknown("integrator", declaration);
       }
     }
     return integrator_data;
   }
 
+  std::string_view intern(std::string_view name) {
+    return symbols->intern(name);
+  }
+
   std::array<float, 16> parse_transform() {
-    position += 1;
+    advance();
     auto res = parse_values<float, 16>();
     return res;
   }
 
-  std::array<std::string_view, 2> parse_type_and_key() {
-    auto &type_and_key = tokens.at(position).value;
-    auto split_index = type_and_key.find(" ");
-    auto type = type_and_key.substr(0, split_index);
-    auto key = type_and_key.substr(split_index + 1);
-    position += 1;
-    return {type, key};
+  // Looks up the "type key" declaration in `current` and moves past it. The
+  // declaration is returned too, for diagnostics.
+  std::pair<Parameter, std::string_view> parse_parameter() {
+    auto declaration = current.value;
+    advance();
+    return {find_parameter(declaration), declaration};
+  }
+
+  void skip_unknown(std::string_view owner, std::string_view declaration) {
+    std::cerr << "unknown " << owner << " parameter " << declaration
+              << std::endl;
+    skip_values();
   }
 
   CameraData parse_camera() {
-    position += 1;
+    advance();
     CameraData camera;
-    camera.kind = tokens.at(position).value;
-    position += 1;
-    while (tokens.at(position).type != TokenType::Identifier) {
-      auto [type, key] = parse_type_and_key();
-      if (type == "float" && key == "fov") {
+    camera.kind = intern(current.value);
+    advance();
+    while (current.type == TokenType::StringLiteral) {
+      auto [parameter, declaration] = parse_parameter();
+      if (parameter == Parameter::Fov) {
         camera.fov = parse_values<float, 1>()[0];
       } else {
-        std::cerr << "unknonw camera parameter " << key << std::endl;
+        skip_unknown("camera", declaration);
       }
     }
     return camera;
   }
 
   SamplerData parse_sampler() {
-    position += 1;
+    advance();
     SamplerData sampler_data;
-    sampler_data.kind = tokens.at(position).value;
-    position += 1;
+    sampler_data.kind = intern(current.value);
+    advance();
 
-    while (tokens.at(position).type != TokenType::Identifier) {
-      auto [type, key] = parse_type_and_key();
-      if (key == "pixelsamples") {
+    while (current.type == TokenType::StringLiteral) {
+      auto [parameter, declaration] = parse_parameter();
+      if (parameter == Parameter::PixelSamples) {
         sampler_data.samples = parse_values<int, 1>()[0];
       } else {
-        std::cerr << "unknown key " << key << std::endl;
+        skip_unknown("sampler", declaration);
       }
     }
     return sampler_data;
   }
 
   PixelFilterData parse_pixel_filter() {
-    position += 1;
+    advance();
     PixelFilterData pixel_filter_data;
-    pixel_filter_data.kind = tokens[position].value;
-    position += 1;
-    while (tokens.at(position).type != TokenType::Identifier) {
-      auto [type, key] = parse_type_and_key();
-      if (key == "xradius") {
-        if (type == "float") {
-          pixel_filter_data.x_radius = parse_values<float, 1>()[0];
-        }
-      } else if (key == "yradius") {
-        if (type == "float") {
-          pixel_filter_data.y_radius = parse_values<float, 1>()[0];
-        }
+    pixel_filter_data.kind = intern(current.value);
+    advance();
+    while (current.type == TokenType::StringLiteral) {
+      auto [parameter, declaration] = parse_parameter();
+      if (parameter == Parameter::XRadius) {
+        pixel_filter_data.x_radius = parse_values<float, 1>()[0];
+      } else if (parameter == Parameter::YRadius) {
+        pixel_filter_data.y_radius = parse_values<float, 1>()[0];
+      } else {
+        skip_unknown("pixel filter", declaration);
       }
     }
     return pixel_filter_data;
   }
 
   FilmData parse_film() {
-    position += 1;
+    advance();
     FilmData film_data;
-    film_data.kind = tokens.at(position).value;
-    position += 1;
-
-    while (tokens.at(position).type != TokenType::Identifier) {
-      auto [type, key] = parse_type_and_key();
-      if (key == "filename" && type == "string") {
-        film_data.filename = parse_string_values<1>()[0];
-      } else if (type == "integer") {
-        if (key == "xresolution") {
-          film_data.x_resolution = parse_values<int, 1>()[0];
-        } else if (key == "yresolution") {
-          film_data.y_resolution = parse_values<int, 1>()[0];
-        } else {
-          std::cerr << "unknown key " << key << std::endl;
-        }
-      } else {
-        std::cerr << "unknown property " << key << " : " << type << std::endl;
+    film_data.kind = intern(current.value);
+    advance();
+
+    while (current.type == TokenType::StringLiteral) {
+      auto [parameter, declaration] = parse_parameter();
+      switch (parameter) {
+      case Parameter::Filename:
+        film_data.filename = intern(parse_string_values<1>()[0]);
+        break;
+      case Parameter::XResolution:
+        film_data.x_resolution = parse_values<int, 1>()[0];
+        break;
+      case Parameter::YResolution:
+        film_data.y_resolution = parse_values<int, 1>()[0];
+        break;
+      default:
+        skip_unknown("film", declaration);
       }
     }
 
     return film_data;
   }
 
+  // Skips the value list of a parameter that is not understood.
+  void skip_values() {
+    while (!at_end() && current.type != TokenType::ListEnd) {
+      advance();
+    }
+    advance();
+  }
+
   template <int n> std::array<std::string_view, n> parse_string_values() {
     std::array<std::string_view, n> res;
-    position += 1;
+    advance();
     for (int i = 0; i < n; i++) {
-      res[i] = tokens.at(position).value;
-      position += 1;
+      res[i] = current.value;
+      advance();
     }
-    position += 1;
+    advance();
     return res;
   }
 
-  template <typename T> std::vector<T> parse_unknown_values() {
-    std::vector<T> res;
-    position += 1;
-    while (tokens.at(position).type != TokenType::ListEnd) {
-      if (std::is_same_v<T, int>) {
-        std::string v = std::string(tokens.at(position).value);
-        res.push_back(std::stoi(v, nullptr, 10));
-      } else if (std::is_same_v<T, float>) {
-        std::string v = std::string(tokens.at(position).value);
-        res.push_back(std::stof(v));
-      } else {
-        std::cerr << "unsupported value types " << std::endl;
-      }
-      position += 1;
-    }
-    position += 1;
-    return res;
+  // `current` is the list start; the numbers themselves never become tokens.
+  template <typename T, typename Allocator>
+  void parse_unknown_values(std::vector<T, Allocator> &values) {
+    tokenizer.read_number_list(values);
+    advance();
   }
 
   template <typename T, int n> std::array<T, n> parse_values() {
     std::array<T, n> res;
-    position += 1; // skip list start
+    advance(); // skip list start
     for (int i = 0; i < n; i++) {
-      if (std::is_same_v<T, int>) {
-        std::string v = std::string(tokens.at(position).value);
-        res[i] = std::stoi(v, nullptr, 10);
-      } else if (std::is_same_v<T, float>) {
-        std::string v = std::string(tokens.at(position).value);
-        res[i] = std::stof(v);
-      } else {
-        std::cerr << "unsupported value types " << std::endl;
-      }
-      position += 1;
+      res[i] = parse_number<T>(current.value);
+      advance();
     }
 
-    position += 1; // skip list end;
+    advance(); // skip list end;
     return res;
   }
 };
+
+// Parses `source` on up to `threads` threads. The world block is cut at
+// top-level directive boundaries into chunks of about `chunk_bytes`, each
+// chunk is tokenized and parsed on its own, and the results are stitched back
+// together in source order, so the SceneData matches Parser::parse().
+SceneData parse_parallel(std::string_view source,
+                         size_t threads = default_thread_count(),
+                         size_t chunk_bytes = 1 << 16,
+                         const std::filesystem::path &base_directory = {},
+                         bool defer_attributes = false);
+
+// Parses a scene whose text arrives in pieces: `next_block` replaces its
+// argument with the next piece and returns false after the last one. Text is
+// parsed as soon as it holds complete top-level statements, so only the
+// statement in progress and the latest block are held in memory. Long
+// numeric lists are converted as their numbers arrive, so a large mesh in
+// the statement in progress is not held as text either.
+SceneData parse_blocks(const std::function<bool(std::string &)> &next_block,
+                       size_t threads = default_thread_count(),
+                       const std::filesystem::path &base_directory = {});
+
+// Maps the scene file at `path` and parses it with parse_parallel(). File
+// names inside the scene are resolved against the file's directory. The file
+// is unmapped before returning, unless `defer_attributes` is set, in which
+// case the SceneData keeps it until its attributes are loaded.
+//
+// A path ending in .gz is decompressed on a separate thread and handed to
+// parse_blocks() as it arrives; `defer_attributes` does not apply to it,
+// since its text is discarded while parsing.
+SceneData load_scene(const std::filesystem::path &path,
+                     size_t threads = default_thread_count(),
+                     bool defer_attributes = false);
@@ -0,0 +1,104 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+// Maps a fixed set of names to ids with one hash and one string compare. The
+// seed that makes the hash collision free is searched for at compile time;
+// a name set without one fails to compile.
+template <typename Id, size_t N> class PerfectHash {
+public:
+  using Entry = std::pair<std::string_view, Id>;
+
+  consteval explicit PerfectHash(const Entry (&names)[N]) {
+    for (size_t i = 0; i < N; i++) {
+      entries[i] = names[i];
+    }
+    for (seed = 1; seed < MAX_SEED; seed++) {
+      if (try_seed()) {
+        return;
+      }
+    }
+    throw "no collision free seed for this name set";
+  }
+
+  constexpr std::optional<Id> find(std::string_view name) const {
+    auto slot = slots[slot_of(name, seed)];
+    if (slot == EMPTY || entries[slot].first != name) {
+      return std::nullopt;
+    }
+    return entries[slot].second;
+  }
+
+  // in the order they were given
+  constexpr const std::array<Entry, N> &names() const { return entries; }
+
+private:
+  static_assert(N < 255, "slots are stored as uint8_t");
+  static constexpr size_t SLOTS = std::bit_ceil(4 * N);
+  static constexpr uint8_t EMPTY = 255;
+  static constexpr uint32_t MAX_SEED = 1 << 16;
+
+  // Little endian load of `Size` bytes.
+  template <size_t Size> static constexpr uint64_t load(const char *p) {
+    uint64_t word = 0;
+    if (!std::is_constant_evaluated()) {
+      std::memcpy(&word, p, Size);
+      return word;
+    }
+    for (size_t i = 0; i < Size; i++) {
+      word |= uint64_t(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return word;
+  }
+
+  // Mixes the length with possibly overlapping words from the start, middle
+  // and end of the name. That tells apart names that differ in a single
+  // character, like "float xradius" and "float yradius", with a fixed number
+  // of loads instead of a loop over every byte.
+  static constexpr size_t slot_of(std::string_view name, uint32_t seed) {
+    const char *p = name.data();
+    size_t n = name.size();
+    uint64_t h = 0;
+    if (n >= 8) {
+      h = load<8>(p) * 0x9e3779b97f4a7c15ull ^
+          load<8>(p + n / 2 - 4) * 0xc2b2ae3d27d4eb4full ^
+          load<8>(p + n - 8) * 0x165667b19e3779f9ull;
+    } else if (n >= 4) {
+      h = (load<4>(p) | load<4>(p + n - 4) << 32) * 0x9e3779b97f4a7c15ull;
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        h = (h << 8 | static_cast<unsigned char>(p[i])) * 0x9e3779b97f4a7c15ull;
+      }
+    }
+    h = (h ^ n ^ seed) * 0xff51afd7ed558ccdull;
+    return (h >> 32) & (SLOTS - 1);
+  }
+
+  constexpr bool try_seed() {
+    slots.fill(EMPTY);
+    for (size_t i = 0; i < N; i++) {
+      auto &slot = slots[slot_of(entries[i].first, seed)];
+      if (slot != EMPTY) {
+        return false;
+      }
+      slot = uint8_t(i);
+    }
+    return true;
+  }
+
+  std::array<Entry, N> entries{};
+  std::array<uint8_t, SLOTS> slots{};
+  uint32_t seed = 0;
+};
+
+template <typename Id, size_t N>
+consteval PerfectHash<Id, N>
+make_perfect_hash(const std::pair<std::string_view, Id> (&names)[N]) {
+  return PerfectHash<Id, N>(names);
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "parallel.h"
+
+struct TriangleMeshShapeData;
+
+// Loads a binary little-endian PLY file into `mesh`. The file is memory
+// mapped and vertex and face records are decoded straight into the mesh
+// arrays, split across `threads` threads for large meshes. Faces with more
+// than three vertices are fan triangulated, and face lists may use 8, 16 or
+// 32 bit indices.
+bool load_ply_mesh(const char *path, TriangleMeshShapeData &mesh,
+                   size_t threads = default_thread_count());
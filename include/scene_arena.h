@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+
+// Monotonic arena that every array and table of one SceneData is allocated
+// from. Nothing is returned to the system until the arena itself is
+// destroyed, which releases the whole scene in a few large frees. Allocation
+// is serialized by a mutex, so the threads of parse_parallel can share one
+// arena.
+struct SceneArena : std::pmr::memory_resource {
+  explicit SceneArena(size_t initial_size = 1 << 16);
+
+  // Bytes in live allocations.
+  size_t used_bytes() const;
+  // Highest used_bytes() seen so far.
+  size_t peak_bytes() const;
+  // Bytes obtained from the system, including unused tails of blocks.
+  size_t reserved_bytes() const;
+
+private:
+  // Counts the blocks the monotonic resource asks the heap for.
+  struct Upstream : std::pmr::memory_resource {
+    size_t reserved = 0;
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const memory_resource &other) const noexcept override;
+  };
+
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+  bool do_is_equal(const memory_resource &other) const noexcept override;
+
+  mutable std::mutex mutex;
+  Upstream upstream;
+  std::pmr::monotonic_buffer_resource arena;
+  size_t used = 0;
+  size_t peak = 0;
+};
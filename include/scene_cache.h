@@ -0,0 +1,144 @@
+#pragma once
+#include "pbrt.h"
+#include "scene_source.h"
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+// Binary image of a SceneData that is memory mapped read-only and used in
+// place. Every reference inside the file is a byte offset from its start, so
+// the same file can be mapped at any address and shared between processes
+// through the page cache. The header records a hash of the .pbrt text the
+// image was built from, and opening fails when it does not match.
+
+struct CachedString {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct CachedArray {
+  uint64_t offset;
+  uint64_t count;
+};
+
+// Stored in material id order.
+struct CachedMaterial {
+  CachedString name;
+  uint32_t defined;
+  std::array<float, 3> reflectance;
+};
+
+struct CachedShape {
+  // index into the material table, or NO_MATERIAL
+  uint32_t material;
+  uint32_t has_light;
+  std::array<float, 3> light_l;
+  CachedString light_kind;
+  // float, float, float and int32 arrays
+  CachedArray uvs;
+  CachedArray normals;
+  CachedArray positions;
+  CachedArray indices;
+};
+
+struct CachedObject {
+  CachedString name;
+  // CachedShape array
+  CachedArray shapes;
+};
+
+struct CachedInstance {
+  CachedString object;
+  std::array<float, 16> transform;
+};
+
+struct CacheHeader {
+  static constexpr std::array<char, 8> MAGIC = {'F', 'L', 'O', 'W',
+                                                'S', 'C', 'N', '\0'};
+  static constexpr uint32_t VERSION = 3;
+
+  std::array<char, 8> magic;
+  uint32_t version;
+  uint64_t source_hash;
+
+  CachedString integrator_kind;
+  uint64_t max_depth;
+  CachedString camera_kind;
+  float fov;
+  CachedString sampler_kind;
+  uint64_t samples;
+  CachedString film_kind;
+  uint64_t x_resolution;
+  uint64_t y_resolution;
+  CachedString film_filename;
+  CachedString pixel_filter_kind;
+  float x_radius;
+  float y_radius;
+  std::array<float, 16> transform;
+
+  CachedArray materials;
+  CachedArray shapes;
+  CachedArray objects;
+  CachedArray instances;
+};
+
+// Content hash of a scene's text, used as the cache key.
+uint64_t hash_scene_source(std::string_view source);
+
+struct SceneCache {
+  // Maps the cache at `path` if it exists and was built from a source with
+  // `source_hash`.
+  static std::optional<SceneCache> open(const char *path, uint64_t source_hash);
+
+  // Writes `scene` to `path` through a temporary file that is renamed into
+  // place, so readers never map a half written cache. Fails if `scene` has
+  // deferred attributes.
+  static bool write(const char *path, const SceneData &scene,
+                    uint64_t source_hash);
+
+  const CacheHeader &header() const {
+    return *reinterpret_cast<const CacheHeader *>(bytes().data());
+  }
+
+  std::span<const CachedMaterial> materials() const {
+    return array<CachedMaterial>(header().materials);
+  }
+
+  std::span<const CachedShape> shapes() const {
+    return array<CachedShape>(header().shapes);
+  }
+
+  std::span<const CachedObject> objects() const {
+    return array<CachedObject>(header().objects);
+  }
+
+  std::span<const CachedInstance> instances() const {
+    return array<CachedInstance>(header().instances);
+  }
+
+  std::string_view string(const CachedString &s) const {
+    return bytes().substr(s.offset, s.size);
+  }
+
+  template <typename T> std::span<const T> array(const CachedArray &a) const {
+    return std::span<const T>(
+        reinterpret_cast<const T *>(bytes().data() + a.offset), a.count);
+  }
+
+  // Rebuilds a SceneData. Names are interned and mesh arrays copied, so the
+  // scene does not refer to the mapping.
+  SceneData to_scene_data() const;
+
+private:
+  explicit SceneCache(SceneSource mapping) : mapping(std::move(mapping)) {}
+
+  std::string_view bytes() const { return mapping.view(); }
+  bool validate() const;
+  bool validate_shapes(std::span<const CachedShape> shapes) const;
+  bool string_fits(const CachedString &s) const;
+  bool array_fits(const CachedArray &a, size_t element_size,
+                  size_t alignment) const;
+
+  SceneSource mapping;
+};
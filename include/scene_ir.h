@@ -0,0 +1,86 @@
+#pragma once
+#include "math.h"
+#include "parallel.h"
+#include "pbrt.h"
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace Flow {
+
+// Flat scene that every front end lowers into and the renderer consumes.
+// All meshes share one vertex pool and one index pool with their transforms
+// already applied, and materials and emitters are referenced by dense ids.
+struct SceneIR {
+  struct Material {
+    std::array<float, 3> reflectance;
+  };
+
+  // Indices [first_index, first_index + index_count) of the index pool.
+  // They are absolute indices into the vertex pools.
+  struct Mesh {
+    uint32_t first_vertex;
+    uint32_t vertex_count;
+    uint32_t first_index;
+    uint32_t index_count;
+    uint32_t material;
+    // index into emitters, or -1
+    int32_t emitter;
+  };
+
+  struct Emitter {
+    uint32_t mesh;
+    std::array<float, 3> radiance;
+  };
+
+  // The camera looks down +z of its own space, as in pbrt and Mitsuba.
+  struct Camera {
+    std::array<float, 16> camera_to_world;
+    float fov;
+  };
+
+  Camera camera;
+  uint32_t width;
+  uint32_t height;
+  uint32_t samples;
+  uint32_t max_depth;
+
+  std::vector<Vec3f> positions;
+  // both as long as positions, zero for meshes that had none
+  std::vector<Vec3f> normals;
+  std::vector<Vec2f> uvs;
+  std::vector<uint32_t> indices;
+
+  std::vector<Material> materials;
+  std::vector<Mesh> meshes;
+  std::vector<Emitter> emitters;
+};
+
+// A mesh handed to lower_meshes(). Arrays are flat like the ones in
+// TriangleMeshShapeData; normals and uvs may be null.
+struct MeshSource {
+  const float *positions;
+  const float *normals;
+  const float *uvs;
+  size_t vertex_count;
+  const int *indices;
+  size_t index_count;
+  std::array<float, 16> transform;
+  uint32_t material;
+  std::optional<std::array<float, 3>> emission;
+};
+
+// Appends `sources` to the pools of `scene`. The layout is computed up
+// front, then vertices are transformed and indices rebased in parallel.
+void lower_meshes(SceneIR &scene, std::span<const MeshSource> sources,
+                  size_t threads = default_thread_count());
+
+// Lowers a parsed pbrt scene. Every instance of an object becomes its own
+// copy of the object's meshes. Attributes that are still deferred are left
+// zero, like missing ones.
+SceneIR lower_scene(const SceneData &scene,
+                    size_t threads = default_thread_count());
+
+} // namespace Flow
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+// Read-only, memory-mapped view of a scene file. Tokens, and the arrays a
+// parse with deferred attributes leaves behind, are string_views into this
+// mapping, so it has to outlive them.
+struct SceneSource {
+  static std::optional<SceneSource> map_file(const char *path);
+
+  SceneSource(SceneSource &&other) noexcept;
+  SceneSource &operator=(SceneSource &&other) noexcept;
+  SceneSource(const SceneSource &) = delete;
+  SceneSource &operator=(const SceneSource &) = delete;
+  ~SceneSource();
+
+  std::string_view view() const { return std::string_view(data, size); }
+
+private:
+  SceneSource(const char *data, size_t size) : data(data), size(size) {}
+
+  const char *data;
+  size_t size;
+};
@@ -0,0 +1,184 @@
+#pragma once
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_AVX2_DISPATCH 1
+#endif
+
+// Character classification for the pbrt lexer. Each scan returns the length of
+// the longest prefix of [p, p + n) whose bytes all belong to a class. Runs are
+// classified 16 bytes at a time with SSE2 (32 with AVX2 when the CPU has it)
+// and the first byte outside the class is found with a count-trailing-zeros
+// on the lane mask, so the lexer does not branch per character.
+namespace scan {
+
+enum class CharClass {
+  // ' ' and '\n', the only whitespace the tokenizer accepts
+  Space,
+  // [A-Za-z0-9], the same set isalnum() accepts in the "C" locale
+  Identifier,
+  // [0-9.e-]
+  Number,
+  // anything except '"'
+  StringBody,
+};
+
+template <CharClass C> inline bool matches(char ch) {
+  if constexpr (C == CharClass::Space) {
+    return ch == ' ' || ch == '\n';
+  } else if constexpr (C == CharClass::Identifier) {
+    return isalnum(static_cast<unsigned char>(ch));
+  } else if constexpr (C == CharClass::Number) {
+    return isdigit(static_cast<unsigned char>(ch)) || ch == '.' ||
+           ch == '-' || ch == 'e';
+  } else {
+    return ch != '"';
+  }
+}
+
+template <CharClass C> inline size_t span_scalar(const char *p, size_t n) {
+  size_t i = 0;
+  while (i < n && matches<C>(p[i])) {
+    i += 1;
+  }
+  return i;
+}
+
+#if defined(__SSE2__)
+// Lane mask of the bytes in `v` that belong to class C.
+template <CharClass C> inline uint32_t classify(__m128i v) {
+  // signed compares, so bytes >= 0x80 are never in an ASCII range
+  auto in_range = [](__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+  };
+  auto equals = [&](char ch) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(ch)); };
+
+  __m128i m;
+  if constexpr (C == CharClass::Space) {
+    m = _mm_or_si128(equals(' '), equals('\n'));
+  } else if constexpr (C == CharClass::Identifier) {
+    // folding to lower case maps [A-Z] onto [a-z] and keeps digits apart
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    m = _mm_or_si128(in_range(lower, 'a', 'z'), in_range(v, '0', '9'));
+  } else if constexpr (C == CharClass::Number) {
+    m = _mm_or_si128(_mm_or_si128(in_range(v, '0', '9'), equals('.')),
+                     _mm_or_si128(equals('-'), equals('e')));
+  } else {
+    return ~static_cast<uint32_t>(_mm_movemask_epi8(equals('"'))) & 0xffff;
+  }
+  return static_cast<uint32_t>(_mm_movemask_epi8(m));
+}
+
+template <CharClass C> inline size_t span_sse2(const char *p, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    uint32_t outside = ~classify<C>(v) & 0xffff;
+    if (outside != 0) {
+      return i + __builtin_ctz(outside);
+    }
+  }
+  return i + span_scalar<C>(p + i, n - i);
+}
+#endif
+
+#if defined(SCAN_AVX2_DISPATCH)
+// Lambdas would not inherit the target attribute, hence the small helpers.
+__attribute__((target("avx2"))) inline __m256i equals_avx2(__m256i v,
+                                                          char ch) {
+  return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch));
+}
+
+__attribute__((target("avx2"))) inline __m256i
+in_range_avx2(__m256i v, char lo, char hi) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+template <CharClass C>
+__attribute__((target("avx2"))) inline uint32_t classify_avx2(__m256i v) {
+  __m256i m;
+  if constexpr (C == CharClass::Space) {
+    m = _mm256_or_si256(equals_avx2(v, ' '), equals_avx2(v, '\n'));
+  } else if constexpr (C == CharClass::Identifier) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    m = _mm256_or_si256(in_range_avx2(lower, 'a', 'z'),
+                        in_range_avx2(v, '0', '9'));
+  } else if constexpr (C == CharClass::Number) {
+    m = _mm256_or_si256(
+        _mm256_or_si256(in_range_avx2(v, '0', '9'), equals_avx2(v, '.')),
+        _mm256_or_si256(equals_avx2(v, '-'), equals_avx2(v, 'e')));
+  } else {
+    return ~static_cast<uint32_t>(_mm256_movemask_epi8(equals_avx2(v, '"')));
+  }
+  return static_cast<uint32_t>(_mm256_movemask_epi8(m));
+}
+
+template <CharClass C>
+__attribute__((target("avx2"))) inline size_t span_avx2(const char *p,
+                                                        size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    uint32_t outside = ~classify_avx2<C>(v);
+    if (outside != 0) {
+      return i + __builtin_ctz(outside);
+    }
+  }
+  return i + span_sse2<C>(p + i, n - i);
+}
+
+inline const bool cpu_has_avx2 = [] {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+}();
+#endif
+
+// Length of the run of class C at the start of [p, p + n).
+template <CharClass C> inline size_t span(const char *p, size_t n) {
+#if defined(SCAN_AVX2_DISPATCH)
+  // most tokens are shorter than a vector, so only long runs take the wide
+  // path
+  if (n >= 64 && cpu_has_avx2) {
+    return span_avx2<C>(p, n);
+  }
+#endif
+#if defined(__SSE2__)
+  return span_sse2<C>(p, n);
+#else
+  return span_scalar<C>(p, n);
+#endif
+}
+
+// Number of whitespace separated words in [p, p + n).
+inline size_t count_words(const char *p, size_t n) {
+  size_t count = 0;
+  size_t i = 0;
+  // whether the byte before the current block was whitespace
+  uint32_t previous_space = 1;
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    uint32_t space = classify<CharClass::Space>(v);
+    // a word starts wherever a non-space byte follows a space byte
+    uint32_t starts = ~space & ((space << 1) | previous_space) & 0xffff;
+    count += __builtin_popcount(starts);
+    previous_space = (space >> 15) & 1;
+  }
+#endif
+  for (; i < n; i++) {
+    uint32_t space = matches<CharClass::Space>(p[i]);
+    count += !space && previous_space;
+    previous_space = space;
+  }
+  return count;
+}
+
+} // namespace scan
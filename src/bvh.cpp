@@ -0,0 +1,1150 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace Flow {
+
+namespace {
+
+constexpr uint32_t MAX_LEAF_SIZE = 8;
+constexpr uint32_t LBVH_LEAF_SIZE = 4;
+constexpr int BINS = 16;
+// cost of visiting a node relative to intersecting one primitive
+constexpr float TRAVERSAL_COST = 1.0f;
+// ranges at least this large are binned and partitioned on several threads,
+// and their two subtrees built on separate threads
+constexpr uint32_t PARALLEL_RANGE = 1 << 14;
+// smallest piece of a range worth handing to a thread
+constexpr uint32_t PARALLEL_GRAIN = 1 << 12;
+
+struct Bin {
+  Bounds3f bounds;
+  uint32_t count = 0;
+};
+
+// Number of pieces a pass over `count` primitives is cut into, one when
+// threads are not worth it.
+size_t piece_count(uint32_t count, size_t threads) {
+  if (threads <= 1 || count < PARALLEL_RANGE) {
+    return 1;
+  }
+  return std::min<size_t>(4 * threads, count / PARALLEL_GRAIN);
+}
+
+uint32_t piece_start(uint32_t begin, uint32_t end, size_t piece,
+                     size_t pieces) {
+  return begin + uint32_t(uint64_t(end - begin) * piece / pieces);
+}
+
+// Runs f(piece, piece_begin, piece_end) for consecutive pieces of
+// [begin, end) on up to `threads` threads and returns the number of pieces.
+template <typename F>
+size_t for_each_piece(uint32_t begin, uint32_t end, size_t threads, F &&f) {
+  size_t pieces = piece_count(end - begin, threads);
+  parallel_for(pieces, threads, [&](size_t i) {
+    f(i, piece_start(begin, end, i, pieces),
+      piece_start(begin, end, i + 1, pieces));
+  });
+  return pieces;
+}
+
+// Runs f(result, piece_begin, piece_end) for pieces of [begin, end) like
+// for_each_piece, each into its own T, and folds them with merge(into, from).
+template <typename T, typename F, typename M>
+T reduce_pieces(uint32_t begin, uint32_t end, size_t threads, F &&f,
+                M &&merge) {
+  size_t pieces = piece_count(end - begin, threads);
+  if (pieces == 1) {
+    T result{};
+    f(result, begin, end);
+    return result;
+  }
+  std::vector<T> results(pieces);
+  for_each_piece(begin, end, threads,
+                 [&](size_t piece, uint32_t b, uint32_t e) {
+                   f(results[piece], b, e);
+                 });
+  for (size_t piece = 1; piece < pieces; piece++) {
+    merge(results[0], results[piece]);
+  }
+  return results[0];
+}
+
+// Partitions primitives[begin, end) by `left` and returns where the right
+// side starts. Large ranges count and scatter their pieces in parallel
+// through a scratch buffer.
+template <typename F>
+uint32_t partition(std::vector<uint32_t> &primitives, uint32_t begin,
+                   uint32_t end, size_t threads, F &&left) {
+  auto first = primitives.begin();
+  if (threads <= 1 || end - begin < PARALLEL_RANGE) {
+    return std::partition(first + begin, first + end, left) - first;
+  }
+  std::vector<uint32_t> left_counts(piece_count(end - begin, threads));
+  size_t pieces = for_each_piece(begin, end, threads,
+                                 [&](size_t piece, uint32_t b, uint32_t e) {
+                                   left_counts[piece] = std::count_if(
+                                       first + b, first + e, left);
+                                 });
+  uint32_t middle = begin;
+  for (size_t piece = 0; piece < pieces; piece++) {
+    middle += left_counts[piece];
+  }
+  // where each piece writes its left and right primitives
+  std::vector<uint32_t> left_at(pieces);
+  std::vector<uint32_t> right_at(pieces);
+  uint32_t left_cursor = 0;
+  uint32_t right_cursor = middle - begin;
+  for (size_t piece = 0; piece < pieces; piece++) {
+    uint32_t size = piece_start(begin, end, piece + 1, pieces) -
+                    piece_start(begin, end, piece, pieces);
+    left_at[piece] = left_cursor;
+    right_at[piece] = right_cursor;
+    left_cursor += left_counts[piece];
+    right_cursor += size - left_counts[piece];
+  }
+  std::vector<uint32_t> scratch(end - begin);
+  for_each_piece(begin, end, threads,
+                 [&](size_t piece, uint32_t b, uint32_t e) {
+                   for (uint32_t i = b; i < e; i++) {
+                     auto primitive = primitives[i];
+                     auto &at = left(primitive) ? left_at[piece]
+                                                : right_at[piece];
+                     scratch[at++] = primitive;
+                   }
+                 });
+  for_each_piece(begin, end, threads,
+                 [&](size_t, uint32_t b, uint32_t e) {
+                   std::copy(scratch.begin() + (b - begin),
+                             scratch.begin() + (e - begin), first + b);
+                 });
+  return middle;
+}
+
+// Appends the subtrees over [begin, middle) and [middle, end) as the
+// children of nodes[index] through build(nodes, begin, end, threads). With
+// threads to spare the second subtree is built on another thread into its
+// own vector, then moved in behind the first.
+template <typename F>
+void build_children(std::vector<BvhNode> &nodes, uint32_t index,
+                    uint32_t begin, uint32_t middle, uint32_t end,
+                    size_t threads, F &&build) {
+  nodes[index].count = 0;
+  if (threads <= 1 || end - begin < PARALLEL_RANGE) {
+    build(nodes, begin, middle, threads);
+    nodes[index].offset = nodes.size();
+    build(nodes, middle, end, threads);
+    return;
+  }
+  std::vector<BvhNode> second;
+  parallel_for(2, 2, [&](size_t i) {
+    if (i == 0) {
+      build(nodes, begin, middle, threads - threads / 2);
+    } else {
+      build(second, middle, end, threads / 2);
+    }
+  });
+  uint32_t base = nodes.size();
+  nodes[index].offset = base;
+  for (auto node : second) {
+    if (node.count == 0) {
+      node.offset += base;
+    }
+    nodes.push_back(node);
+  }
+}
+
+struct SahBuilder {
+  std::span<const Bounds3f> bounds;
+  std::vector<Vec3f> centroids;
+  std::vector<uint32_t> &primitives;
+
+  int bin_of(const Bounds3f &centroid_bounds, int axis, uint32_t primitive) {
+    float min = centroid_bounds.min[axis];
+    float extent = centroid_bounds.max[axis] - min;
+    int bin = int(BINS * ((centroids[primitive][axis] - min) / extent));
+    return std::clamp(bin, 0, BINS - 1);
+  }
+
+  struct Split {
+    int axis = -1;
+    // the left side takes bins [0, bin]
+    int bin = 0;
+    float cost = INFINITY;
+  };
+
+  using Bins = std::array<std::array<Bin, BINS>, 3>;
+
+  // Bounds of the primitives in [begin, end) and of their centroids.
+  std::pair<Bounds3f, Bounds3f> range_bounds(uint32_t begin, uint32_t end,
+                                             size_t threads) {
+    using Result = std::pair<Bounds3f, Bounds3f>;
+    return reduce_pieces<Result>(
+        begin, end, threads,
+        [&](Result &result, uint32_t b, uint32_t e) {
+          for (uint32_t i = b; i < e; i++) {
+            result.first.extend(bounds[primitives[i]]);
+            result.second.extend(centroids[primitives[i]]);
+          }
+        },
+        [](Result &into, const Result &from) {
+          into.first.extend(from.first);
+          into.second.extend(from.second);
+        });
+  }
+
+  // Cheapest split between bins on any axis, in units of the node's surface
+  // area. Splits that leave a side empty are not considered.
+  Split find_split(uint32_t begin, uint32_t end,
+                   const Bounds3f &centroid_bounds, size_t threads) {
+    bool active[3];
+    for (int axis = 0; axis < 3; axis++) {
+      active[axis] = centroid_bounds.max[axis] > centroid_bounds.min[axis];
+    }
+    auto bins = reduce_pieces<Bins>(
+        begin, end, threads,
+        [&](Bins &bins, uint32_t b, uint32_t e) {
+          for (uint32_t i = b; i < e; i++) {
+            for (int axis = 0; axis < 3; axis++) {
+              if (active[axis]) {
+                auto &bin =
+                    bins[axis][bin_of(centroid_bounds, axis, primitives[i])];
+                bin.bounds.extend(bounds[primitives[i]]);
+                bin.count += 1;
+              }
+            }
+          }
+        },
+        [](Bins &into, const Bins &from) {
+          for (int axis = 0; axis < 3; axis++) {
+            for (int b = 0; b < BINS; b++) {
+              into[axis][b].bounds.extend(from[axis][b].bounds);
+              into[axis][b].count += from[axis][b].count;
+            }
+          }
+        });
+
+    Split best;
+    for (int axis = 0; axis < 3; axis++) {
+      if (!active[axis]) {
+        continue;
+      }
+      // right side costs of splitting after each bin, swept from the right
+      float right_cost[BINS];
+      Bounds3f right;
+      uint32_t right_count = 0;
+      for (int b = BINS - 1; b > 0; b--) {
+        right.extend(bins[axis][b].bounds);
+        right_count += bins[axis][b].count;
+        right_cost[b - 1] = right_count * right.surface_area();
+      }
+      Bounds3f left;
+      uint32_t left_count = 0;
+      for (int b = 0; b < BINS - 1; b++) {
+        left.extend(bins[axis][b].bounds);
+        left_count += bins[axis][b].count;
+        if (left_count == 0 || left_count == end - begin) {
+          continue;
+        }
+        float cost = left_count * left.surface_area() + right_cost[b];
+        if (cost < best.cost) {
+          best = Split{.axis = axis, .bin = b, .cost = cost};
+        }
+      }
+    }
+    return best;
+  }
+
+  void build(std::vector<BvhNode> &nodes, uint32_t begin, uint32_t end,
+             int depth, size_t threads) {
+    uint32_t index = nodes.size();
+    nodes.push_back(BvhNode{});
+    auto [node_bounds, centroid_bounds] = range_bounds(begin, end, threads);
+    nodes[index].bounds = node_bounds;
+
+    auto make_leaf = [&] {
+      nodes[index].offset = begin;
+      nodes[index].count = end - begin;
+    };
+    uint32_t count = end - begin;
+    int axis = centroid_bounds.largest_axis();
+    bool same_centroids =
+        centroid_bounds.max[axis] == centroid_bounds.min[axis];
+    if (count == 1 || (same_centroids && count <= MAX_LEAF_SIZE)) {
+      make_leaf();
+      return;
+    }
+
+    uint32_t middle = begin + count / 2;
+    auto split = depth < Bvh::MAX_DEPTH && !same_centroids
+                     ? find_split(begin, end, centroid_bounds, threads)
+                     : Split{};
+    if (split.axis >= 0) {
+      float area = node_bounds.surface_area();
+      float split_cost =
+          TRAVERSAL_COST + (area > 0.0f ? split.cost / area : count);
+      if (count <= MAX_LEAF_SIZE && split_cost >= count) {
+        make_leaf();
+        return;
+      }
+      middle = partition(primitives, begin, end, threads,
+                         [&](uint32_t primitive) {
+                           return bin_of(centroid_bounds, split.axis,
+                                         primitive) <= split.bin;
+                         });
+    } else {
+      // past the depth limit, with all centroids in one bin, or with too
+      // many coincident centroids for one leaf
+      std::nth_element(primitives.begin() + begin,
+                       primitives.begin() + middle, primitives.begin() + end,
+                       [&](uint32_t a, uint32_t b) {
+                         return centroids[a][axis] < centroids[b][axis];
+                       });
+    }
+    build_children(nodes, index, begin, middle, end, threads,
+                   [&](std::vector<BvhNode> &nodes, uint32_t begin,
+                       uint32_t end, size_t threads) {
+                     build(nodes, begin, end, depth + 1, threads);
+                   });
+  }
+};
+
+// 10 bits of each coordinate in [0, 1], interleaved.
+uint32_t morton_code(const Vec3f &p) {
+  auto spread = [](float x) {
+    uint32_t v = uint32_t(std::clamp(x * 1024.0f, 0.0f, 1023.0f));
+    v = (v * 0x00010001u) & 0xff0000ffu;
+    v = (v * 0x00000101u) & 0x0f00f00fu;
+    v = (v * 0x00000011u) & 0xc30c30c3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+  };
+  return spread(p.x) << 2 | spread(p.y) << 1 | spread(p.z);
+}
+
+// Least significant digit radix sort of primitives by their codes, in three
+// passes of 10 bits. Each pass counts and scatters pieces in parallel.
+void sort_by_code(std::vector<uint32_t> &codes,
+                  std::vector<uint32_t> &primitives, size_t threads) {
+  constexpr uint32_t DIGITS = 1 << 10;
+  uint32_t count = codes.size();
+  std::vector<uint32_t> codes_out(count);
+  std::vector<uint32_t> primitives_out(count);
+  std::vector<std::array<uint32_t, DIGITS>> histograms(
+      piece_count(count, threads));
+  for (int shift = 0; shift < 30; shift += 10) {
+    auto digit = [&](uint32_t code) { return code >> shift & (DIGITS - 1); };
+    size_t pieces = for_each_piece(
+        0, count, threads, [&](size_t piece, uint32_t b, uint32_t e) {
+          histograms[piece].fill(0);
+          for (uint32_t i = b; i < e; i++) {
+            histograms[piece][digit(codes[i])] += 1;
+          }
+        });
+    // turn the counts into the first output slot of each digit and piece
+    uint32_t at = 0;
+    for (uint32_t d = 0; d < DIGITS; d++) {
+      for (size_t piece = 0; piece < pieces; piece++) {
+        uint32_t n = histograms[piece][d];
+        histograms[piece][d] = at;
+        at += n;
+      }
+    }
+    for_each_piece(0, count, threads,
+                   [&](size_t piece, uint32_t b, uint32_t e) {
+                     for (uint32_t i = b; i < e; i++) {
+                       uint32_t slot = histograms[piece][digit(codes[i])]++;
+                       codes_out[slot] = codes[i];
+                       primitives_out[slot] = primitives[i];
+                     }
+                   });
+    codes.swap(codes_out);
+    primitives.swap(primitives_out);
+  }
+}
+
+// Splits each range where the highest bit that differs between its sorted
+// codes changes, so every level halves the space a node covers along one
+// axis. Bounds are gathered bottom up.
+struct LbvhBuilder {
+  std::span<const Bounds3f> bounds;
+  std::vector<uint32_t> codes;
+  std::vector<uint32_t> &primitives;
+
+  void build(std::vector<BvhNode> &nodes, uint32_t begin, uint32_t end,
+             size_t threads) {
+    uint32_t index = nodes.size();
+    nodes.push_back(BvhNode{});
+    uint32_t count = end - begin;
+    if (count <= LBVH_LEAF_SIZE) {
+      for (uint32_t i = begin; i < end; i++) {
+        nodes[index].bounds.extend(bounds[primitives[i]]);
+      }
+      nodes[index].offset = begin;
+      nodes[index].count = count;
+      return;
+    }
+
+    uint32_t first = codes[begin];
+    uint32_t last = codes[end - 1];
+    uint32_t middle = begin + count / 2;
+    if (first != last) {
+      int bit = 31 - std::countl_zero(first ^ last);
+      middle = std::partition_point(codes.begin() + begin,
+                                    codes.begin() + end,
+                                    [&](uint32_t code) {
+                                      return (code >> bit & 1) == 0;
+                                    }) -
+               codes.begin();
+    }
+    build_children(nodes, index, begin, middle, end, threads,
+                   [&](std::vector<BvhNode> &nodes, uint32_t begin,
+                       uint32_t end, size_t threads) {
+                     build(nodes, begin, end, threads);
+                   });
+    nodes[index].bounds = nodes[index + 1].bounds;
+    nodes[index].bounds.extend(nodes[nodes[index].offset].bounds);
+  }
+};
+
+Vec3f vertex(const TriangleMeshShapeData &mesh, int index) {
+  auto *p = mesh.positions.data() + 3 * size_t(index);
+  return Vec3f(p[0], p[1], p[2]);
+}
+
+Bounds3f transform_bounds(const std::array<float, 16> &m, const Bounds3f &b) {
+  Bounds3f result;
+  for (int corner = 0; corner < 8; corner++) {
+    auto p = Vec3f(corner & 1 ? b.max.x : b.min.x,
+                   corner & 2 ? b.max.y : b.min.y,
+                   corner & 4 ? b.max.z : b.min.z);
+    result.extend(transform_point(m, p));
+  }
+  return result;
+}
+
+Vec3f permute(const Vec3f &p, int kx, int ky, int kz) {
+  return Vec3f(p[kx], p[ky], p[kz]);
+}
+
+float exponent_scale(int exponent) {
+  return std::bit_cast<float>(uint32_t(exponent + 127) << 23);
+}
+
+// Plane spacing for quantizing [min, max] in 255 steps: the smallest power
+// of two for which the last plane still reaches max.
+int8_t quantization_exponent(float min, float max) {
+  float step = (max - min) / 255.0f;
+  int exponent = step > 0.0f ? std::ilogb(step) : -126;
+  exponent = std::clamp(exponent, -126, 127);
+  while (exponent < 127 && min + 255.0f * exponent_scale(exponent) < max) {
+    exponent++;
+  }
+  return int8_t(exponent);
+}
+
+// Planes at or below `value` and at or above it, decoded the same way
+// traversal decodes them.
+uint8_t quantize_down(float value, float origin, float scale) {
+  float q = std::clamp(std::floor((value - origin) / scale), 0.0f, 255.0f);
+  while (q > 0.0f && q * scale + origin > value) {
+    q--;
+  }
+  return uint8_t(q);
+}
+
+uint8_t quantize_up(float value, float origin, float scale) {
+  float q = std::clamp(std::ceil((value - origin) / scale), 0.0f, 255.0f);
+  while (q < 255.0f && q * scale + origin < value) {
+    q++;
+  }
+  return uint8_t(q);
+}
+
+// Adds the wide node standing for binary node `index` and, depth first, its
+// descendants. Returns its index.
+template <int N>
+uint32_t collapse_node(const Bvh &bvh, uint32_t index,
+                       std::vector<WideNode<N>> &nodes) {
+  auto &binary = bvh.nodes;
+  std::array<uint32_t, N> children;
+  int size = 0;
+  if (binary[index].count > 0) {
+    children[size++] = index;
+  } else {
+    children[size++] = index + 1;
+    children[size++] = binary[index].offset;
+  }
+  while (size < N) {
+    int open = -1;
+    float largest = -1.0f;
+    for (int i = 0; i < size; i++) {
+      auto &child = binary[children[i]];
+      if (child.count == 0 && child.bounds.surface_area() > largest) {
+        open = i;
+        largest = child.bounds.surface_area();
+      }
+    }
+    if (open < 0) {
+      break;
+    }
+    uint32_t opened = children[open];
+    children[open] = opened + 1;
+    children[size++] = binary[opened].offset;
+  }
+
+  WideNode<N> node;
+  auto &parent = binary[index].bounds;
+  node.origin = parent.min;
+  node.children = size;
+  std::fill_n(&node.lo[0][0], 3 * N, 255);
+  std::fill_n(&node.hi[0][0], 3 * N, 0);
+  std::fill_n(node.count, N, 0);
+  std::fill_n(node.child, N, 0);
+  for (int axis = 0; axis < 3; axis++) {
+    node.exponent[axis] =
+        quantization_exponent(parent.min[axis], parent.max[axis]);
+    float scale = exponent_scale(node.exponent[axis]);
+    for (int i = 0; i < size; i++) {
+      auto &bounds = binary[children[i]].bounds;
+      node.lo[axis][i] = quantize_down(bounds.min[axis], parent.min[axis],
+                                       scale);
+      node.hi[axis][i] = quantize_up(bounds.max[axis], parent.min[axis],
+                                     scale);
+    }
+  }
+
+  uint32_t wide_index = nodes.size();
+  nodes.emplace_back();
+  for (int i = 0; i < size; i++) {
+    auto &child = binary[children[i]];
+    // leaves hold at most MAX_LEAF_SIZE primitives, so counts fit a byte
+    node.count[i] = child.count;
+    node.child[i] =
+        child.count > 0 ? child.offset : collapse_node(bvh, children[i], nodes);
+  }
+  nodes[wide_index] = node;
+  return wide_index;
+}
+
+// Slab test of every child box of `node` at once; lanes past the used
+// children are garbage. Written for any width so the same code serves
+// every instruction set it is compiled for.
+template <int N>
+MaskN<N> child_slabs(const WideNode<N> &node, const WideRay &ray,
+                     float t_max, float *t_entry) {
+  FloatN<N> t0(0.0f);
+  FloatN<N> t1(t_max);
+  for (int axis = 0; axis < 3; axis++) {
+    float scale = exponent_scale(node.exponent[axis]);
+    auto *near = ray.negative[axis] ? node.hi[axis] : node.lo[axis];
+    auto *far = ray.negative[axis] ? node.lo[axis] : node.hi[axis];
+    // same rounding and far widening as Bounds3f::intersect on the decoded
+    // box, and a NaN from a plane through the origin of an axis parallel ray
+    // is ignored
+    auto t_near = (FloatN<N>::from_bytes(near) * scale + node.origin[axis] -
+                   ray.origin[axis]) *
+                  ray.inv_direction[axis];
+    auto t_far = (FloatN<N>::from_bytes(far) * scale + node.origin[axis] -
+                  ray.origin[axis]) *
+                 ray.inv_direction[axis] * SLAB_FAR_SCALE;
+    t0 = max(t_near, t0);
+    t1 = min(t_far, t1);
+  }
+  t0.store(t_entry);
+  return t0 <= t1;
+}
+
+uint32_t used_lanes(int children) { return (uint32_t(1) << children) - 1; }
+
+// Nearest triangle of a BlockBvh leaf closer than t_max, tested a block at a
+// time.
+template <int N>
+bool intersect_leaf(const BlockBvh<N> &wide, const TriangleRay &ray,
+                    uint32_t first, uint32_t count, float &t_max, Hit &hit) {
+  constexpr uint32_t lanes = BlockBvh<N>::LANES;
+  bool found = false;
+  for (uint32_t k = 0; k < count; k += lanes) {
+    auto &block = wide.blocks[first + k / lanes];
+    float t, u, v;
+    int lane = intersect_triangles(
+        ray, block, std::min<uint32_t>(count - k, lanes), 0.0f, t_max, t, u,
+        v);
+    if (lane < 0) {
+      continue;
+    }
+    t_max = t;
+    hit.t = t;
+    hit.u = u;
+    hit.v = v;
+    hit.triangle = block.triangle[lane];
+    found = true;
+  }
+  return found;
+}
+
+template <int N>
+bool occludes_leaf(const BlockBvh<N> &wide, const TriangleRay &ray,
+                   uint32_t first, uint32_t count, float t_min, float t_max) {
+  constexpr uint32_t lanes = BlockBvh<N>::LANES;
+  for (uint32_t k = 0; k < count; k += lanes) {
+    float t, u, v;
+    if (intersect_triangles(ray, wide.blocks[first + k / lanes],
+                            std::min<uint32_t>(count - k, lanes), t_min,
+                            t_max, t, u, v) >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#if defined(SCAN_AVX2_DISPATCH)
+// child_slabs<8> in one AVX2 register per term. Written with intrinsics
+// because 32 byte vectors are passed differently with and without AVX, so
+// this cannot call the generic FloatN code.
+__attribute__((target("avx2"))) inline __m256 planes_avx2(const uint8_t *q,
+                                                          float scale,
+                                                          float origin) {
+  auto bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(q));
+  auto lanes = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+  return _mm256_add_ps(_mm256_mul_ps(lanes, _mm256_set1_ps(scale)),
+                       _mm256_set1_ps(origin));
+}
+
+__attribute__((target("avx2"))) uint32_t
+intersect_children_avx2(const WideNode<8> &node, const WideRay &ray,
+                        float t_max, float *t_entry) {
+  auto t0 = _mm256_setzero_ps();
+  auto t1 = _mm256_set1_ps(t_max);
+  for (int axis = 0; axis < 3; axis++) {
+    float scale = exponent_scale(node.exponent[axis]);
+    auto *near = ray.negative[axis] ? node.hi[axis] : node.lo[axis];
+    auto *far = ray.negative[axis] ? node.lo[axis] : node.hi[axis];
+    auto origin = _mm256_set1_ps(ray.origin[axis]);
+    auto inv_direction = _mm256_set1_ps(ray.inv_direction[axis]);
+    auto t_near = _mm256_mul_ps(
+        _mm256_sub_ps(planes_avx2(near, scale, node.origin[axis]), origin),
+        inv_direction);
+    auto t_far = _mm256_mul_ps(
+        _mm256_mul_ps(
+            _mm256_sub_ps(planes_avx2(far, scale, node.origin[axis]), origin),
+            inv_direction),
+        _mm256_set1_ps(SLAB_FAR_SCALE));
+    // maxps and minps return their second operand for a NaN
+    t0 = _mm256_max_ps(t_near, t0);
+    t1 = _mm256_min_ps(t_far, t1);
+  }
+  _mm256_storeu_ps(t_entry, t0);
+  return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) &
+         used_lanes(node.children);
+}
+#endif
+
+} // namespace
+
+TriangleRay::TriangleRay(const Ray &ray) : origin(ray.origin) {
+  auto d = ray.direction.abs();
+  kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+  kx = kz == 2 ? 0 : kz + 1;
+  ky = kx == 2 ? 0 : kx + 1;
+  // keeps the winding of triangles
+  if (ray.direction[kz] < 0.0f) {
+    std::swap(kx, ky);
+  }
+  auto direction = permute(ray.direction, kx, ky, kz);
+  sx = -direction.x / direction.z;
+  sy = -direction.y / direction.z;
+  sz = 1.0f / direction.z;
+}
+
+bool intersect_triangle(const TriangleRay &ray, const Vec3f &p0,
+                        const Vec3f &p1, const Vec3f &p2, float t_max,
+                        float &t, float &u, float &v) {
+  // vertices in ray space, where the ray is the +z axis
+  auto p0t = permute(p0 - ray.origin, ray.kx, ray.ky, ray.kz);
+  auto p1t = permute(p1 - ray.origin, ray.kx, ray.ky, ray.kz);
+  auto p2t = permute(p2 - ray.origin, ray.kx, ray.ky, ray.kz);
+  p0t.x += ray.sx * p0t.z;
+  p0t.y += ray.sy * p0t.z;
+  p1t.x += ray.sx * p1t.z;
+  p1t.y += ray.sy * p1t.z;
+  p2t.x += ray.sx * p2t.z;
+  p2t.y += ray.sy * p2t.z;
+
+  // edge functions of the origin against the projected triangle
+  float e0 = p1t.x * p2t.y - p1t.y * p2t.x;
+  float e1 = p2t.x * p0t.y - p2t.y * p0t.x;
+  float e2 = p0t.x * p1t.y - p0t.y * p1t.x;
+  // a zero in float may be a sign in double; on an edge that sign decides
+  // which of the two triangles sharing it is hit
+  if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f) {
+    e0 = float(double(p1t.x) * p2t.y - double(p1t.y) * p2t.x);
+    e1 = float(double(p2t.x) * p0t.y - double(p2t.y) * p0t.x);
+    e2 = float(double(p0t.x) * p1t.y - double(p0t.y) * p1t.x);
+  }
+  if ((e0 < 0.0f || e1 < 0.0f || e2 < 0.0f) &&
+      (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f)) {
+    return false;
+  }
+  float det = e0 + e1 + e2;
+  if (det == 0.0f) {
+    return false;
+  }
+
+  // t scaled by det, so the range test needs no division
+  p0t.z *= ray.sz;
+  p1t.z *= ray.sz;
+  p2t.z *= ray.sz;
+  float t_scaled = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
+  if (det < 0.0f && (t_scaled >= 0.0f || t_scaled <= t_max * det)) {
+    return false;
+  }
+  if (det > 0.0f && (t_scaled <= 0.0f || t_scaled >= t_max * det)) {
+    return false;
+  }
+
+  float inv_det = 1.0f / det;
+  t = t_scaled * inv_det;
+
+  // t has to be clear of the error accumulated above
+  float max_x = std::max({std::abs(p0t.x), std::abs(p1t.x), std::abs(p2t.x)});
+  float max_y = std::max({std::abs(p0t.y), std::abs(p1t.y), std::abs(p2t.y)});
+  float max_z = std::max({std::abs(p0t.z), std::abs(p1t.z), std::abs(p2t.z)});
+  float max_e = std::max({std::abs(e0), std::abs(e1), std::abs(e2)});
+  float delta_x = gamma(5) * (max_x + max_z);
+  float delta_y = gamma(5) * (max_y + max_z);
+  float delta_z = gamma(3) * max_z;
+  float delta_e =
+      2 * (gamma(2) * max_x * max_y + delta_y * max_x + delta_x * max_y);
+  float delta_t = 3 *
+                  (gamma(3) * max_e * max_z + delta_e * max_z +
+                   delta_z * max_e) *
+                  std::abs(inv_det);
+  if (t <= delta_t) {
+    return false;
+  }
+  u = e1 * inv_det;
+  v = e2 * inv_det;
+  return true;
+}
+
+template <int N>
+int intersect_triangles(const TriangleRay &ray, const TriangleBlock<N> &block,
+                        int lanes, float t_min, float t_max, float &t,
+                        float &u, float &v) {
+  using Float = FloatN<N>;
+  // vertices in ray space; the permutation is a choice of rows
+  Float x[3], y[3], z[3];
+  for (int k = 0; k < 3; k++) {
+    z[k] = Float::load(block.p[k][ray.kz]) - ray.origin[ray.kz];
+    x[k] = Float::load(block.p[k][ray.kx]) - ray.origin[ray.kx] +
+           Float(ray.sx) * z[k];
+    y[k] = Float::load(block.p[k][ray.ky]) - ray.origin[ray.ky] +
+           Float(ray.sy) * z[k];
+  }
+  auto active = MaskN<N>();
+  for (int lane = 0; lane < lanes; lane++) {
+    active.v[lane] = -1;
+  }
+
+  Float e0 = x[1] * y[2] - y[1] * x[2];
+  Float e1 = x[2] * y[0] - y[2] * x[0];
+  Float e2 = x[0] * y[1] - y[0] * x[1];
+  // rare enough to redo lane by lane
+  auto zero = (e0 == 0.0f) | (e1 == 0.0f) | (e2 == 0.0f);
+  for (uint32_t bits = (zero & active).bits(); bits != 0; bits &= bits - 1) {
+    int i = std::countr_zero(bits);
+    e0.set(i, float(double(x[1][i]) * y[2][i] - double(y[1][i]) * x[2][i]));
+    e1.set(i, float(double(x[2][i]) * y[0][i] - double(y[2][i]) * x[0][i]));
+    e2.set(i, float(double(x[0][i]) * y[1][i] - double(y[0][i]) * x[1][i]));
+  }
+  auto negative = (e0 < 0.0f) | (e1 < 0.0f) | (e2 < 0.0f);
+  auto positive = (e0 > 0.0f) | (e1 > 0.0f) | (e2 > 0.0f);
+  Float det = e0 + e1 + e2;
+  for (int k = 0; k < 3; k++) {
+    z[k] = z[k] * ray.sz;
+  }
+  Float t_scaled = e0 * z[0] + e1 * z[1] + e2 * z[2];
+  Float t_limit = Float(t_max) * det;
+  auto outside =
+      (det < 0.0f) & ((t_scaled >= 0.0f) | (t_scaled <= t_limit));
+  outside = outside |
+            ((det > 0.0f) & ((t_scaled <= 0.0f) | (t_scaled >= t_limit)));
+  auto hit = active & ~(negative & positive) & ~(det == 0.0f) & ~outside;
+  if (!hit.any()) {
+    return -1;
+  }
+
+  Float inv_det = Float(1.0f) / det;
+  Float t_hit = t_scaled * inv_det;
+  auto max_x = max(max(abs(x[0]), abs(x[1])), abs(x[2]));
+  auto max_y = max(max(abs(y[0]), abs(y[1])), abs(y[2]));
+  auto max_z = max(max(abs(z[0]), abs(z[1])), abs(z[2]));
+  auto max_e = max(max(abs(e0), abs(e1)), abs(e2));
+  Float delta_x = Float(gamma(5)) * (max_x + max_z);
+  Float delta_y = Float(gamma(5)) * (max_y + max_z);
+  Float delta_z = Float(gamma(3)) * max_z;
+  Float delta_e = Float(2.0f) * (Float(gamma(2)) * max_x * max_y +
+                                 delta_y * max_x + delta_x * max_y);
+  Float delta_t = Float(3.0f) *
+                  (Float(gamma(3)) * max_e * max_z + delta_e * max_z +
+                   delta_z * max_e) *
+                  abs(inv_det);
+  hit = hit & (t_hit > delta_t) & (t_hit > Float(t_min));
+
+  int nearest = -1;
+  for (uint32_t bits = hit.bits(); bits != 0; bits &= bits - 1) {
+    int i = std::countr_zero(bits);
+    if (nearest < 0 || t_hit[i] < t_hit[nearest]) {
+      nearest = i;
+    }
+  }
+  if (nearest >= 0) {
+    t = t_hit[nearest];
+    u = e1[nearest] * inv_det[nearest];
+    v = e2[nearest] * inv_det[nearest];
+  }
+  return nearest;
+}
+
+template int intersect_triangles(const TriangleRay &, const TriangleBlock<4> &,
+                                 int, float, float, float &, float &, float &);
+template int intersect_triangles(const TriangleRay &, const TriangleBlock<8> &,
+                                 int, float, float, float &, float &, float &);
+
+Bvh Bvh::build(std::span<const Bounds3f> bounds, size_t threads) {
+  Bvh bvh;
+  if (bounds.empty()) {
+    return bvh;
+  }
+  bvh.primitives.resize(bounds.size());
+  std::iota(bvh.primitives.begin(), bvh.primitives.end(), 0);
+  bvh.nodes.reserve(2 * bounds.size());
+
+  SahBuilder builder{.bounds = bounds, .primitives = bvh.primitives};
+  builder.centroids.resize(bounds.size());
+  for_each_piece(0, bounds.size(), threads,
+                 [&](size_t, uint32_t begin, uint32_t end) {
+                   for (uint32_t i = begin; i < end; i++) {
+                     builder.centroids[i] = bounds[i].centroid();
+                   }
+                 });
+  builder.build(bvh.nodes, 0, bounds.size(), 0, threads);
+  return bvh;
+}
+
+Bvh Bvh::build_lbvh(std::span<const Bounds3f> bounds, size_t threads) {
+  Bvh bvh;
+  if (bounds.empty()) {
+    return bvh;
+  }
+  bvh.primitives.resize(bounds.size());
+  std::iota(bvh.primitives.begin(), bvh.primitives.end(), 0);
+  bvh.nodes.reserve(2 * bounds.size() / LBVH_LEAF_SIZE + 1);
+
+  Bounds3f centroid_bounds;
+  for (auto &b : bounds) {
+    centroid_bounds.extend(b.centroid());
+  }
+  auto extent = centroid_bounds.max - centroid_bounds.min;
+  auto scale = Vec3f(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                     extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                     extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+  LbvhBuilder builder{.bounds = bounds, .primitives = bvh.primitives};
+  builder.codes.resize(bounds.size());
+  for_each_piece(0, bounds.size(), threads,
+                 [&](size_t, uint32_t begin, uint32_t end) {
+                   for (uint32_t i = begin; i < end; i++) {
+                     auto p = bounds[i].centroid() - centroid_bounds.min;
+                     builder.codes[i] = morton_code(
+                         Vec3f(p.x * scale.x, p.y * scale.y, p.z * scale.z));
+                   }
+                 });
+  sort_by_code(builder.codes, bvh.primitives, threads);
+  builder.build(bvh.nodes, 0, bounds.size(), threads);
+  return bvh;
+}
+
+float Bvh::sah_cost() const {
+  if (nodes.empty()) {
+    return 0.0f;
+  }
+  float root_area = nodes[0].bounds.surface_area();
+  if (root_area == 0.0f) {
+    return nodes[0].count;
+  }
+  double cost = 0.0;
+  for (auto &node : nodes) {
+    float weight = node.count > 0 ? node.count : TRAVERSAL_COST;
+    cost += weight * node.bounds.surface_area() / root_area;
+  }
+  return float(cost);
+}
+
+WideRay::WideRay(const Ray &ray) : origin(ray.origin) {
+  inv_direction = Vec3f(1.0f / ray.direction.x, 1.0f / ray.direction.y,
+                        1.0f / ray.direction.z);
+  for (int axis = 0; axis < 3; axis++) {
+    negative[axis] = inv_direction[axis] < 0.0f;
+  }
+}
+
+template <int N> WideBvh<N> WideBvh<N>::collapse(const Bvh &bvh) {
+  WideBvh wide;
+  wide.primitives = bvh.primitives;
+  if (!bvh.nodes.empty()) {
+    wide.nodes.reserve(bvh.nodes.size() / (N - 1) + 1);
+    collapse_node(bvh, 0, wide.nodes);
+  }
+  return wide;
+}
+
+template <int N>
+uint32_t WideBvh<N>::intersect_children(const WideNode<N> &node,
+                                        const WideRay &ray, float t_max,
+                                        float *t_entry) {
+  return child_slabs(node, ray, t_max, t_entry).bits() &
+         used_lanes(node.children);
+}
+
+// Eight lanes are two SSE registers without AVX2, so the AVX2 build of the
+// node test is chosen at run time like the lexer's scans.
+template <>
+uint32_t WideBvh<8>::intersect_children(const WideNode<8> &node,
+                                        const WideRay &ray, float t_max,
+                                        float *t_entry) {
+#if defined(SCAN_AVX2_DISPATCH)
+  if (scan::cpu_has_avx2) {
+    return intersect_children_avx2(node, ray, t_max, t_entry);
+  }
+#endif
+  return child_slabs(node, ray, t_max, t_entry).bits() &
+         used_lanes(node.children);
+}
+
+template struct WideBvh<4>;
+template struct WideBvh<8>;
+
+template <int N>
+BlockBvh<N> BlockBvh<N>::build(const Bvh &bvh,
+                               const TriangleMeshShapeData &mesh) {
+  BlockBvh result{.bvh = WideBvh<N>::collapse(bvh)};
+  auto &wide = result.bvh;
+  result.blocks.reserve(wide.primitives.size() / LANES + wide.nodes.size());
+  for (auto &node : wide.nodes) {
+    for (int i = 0; i < node.children; i++) {
+      uint32_t count = node.count[i];
+      if (count == 0) {
+        continue;
+      }
+      uint32_t first = node.child[i];
+      node.child[i] = result.blocks.size();
+      for (uint32_t k = 0; k < count; k += LANES) {
+        auto &block = result.blocks.emplace_back();
+        std::fill_n(&block.p[0][0][0], 9 * LANES, 0.0f);
+        std::fill_n(block.triangle, LANES, 0);
+        for (uint32_t lane = 0; lane < LANES && k + lane < count; lane++) {
+          uint32_t triangle = wide.primitives[first + k + lane];
+          block.triangle[lane] = triangle;
+          for (int corner = 0; corner < 3; corner++) {
+            auto p =
+                vertex(mesh, mesh.indices[3 * size_t(triangle) + corner]);
+            for (int axis = 0; axis < 3; axis++) {
+              block.p[corner][axis][lane] = p[axis];
+            }
+          }
+        }
+      }
+    }
+  }
+  // the blocks hold the triangles in leaf order from here on
+  wide.primitives = {};
+  return result;
+}
+
+template struct BlockBvh<4>;
+template struct BlockBvh<8>;
+
+BvhWidth native_bvh_width() {
+#if defined(SCAN_AVX2_DISPATCH)
+  if (scan::cpu_has_avx2) {
+    return BvhWidth::Eight;
+  }
+#endif
+  return BvhWidth::Four;
+}
+
+MeshBvh MeshBvh::build(const TriangleMeshShapeData &mesh, size_t threads,
+                       bool preview, BvhWidth width) {
+  std::vector<Bounds3f> bounds(mesh.indices.size() / 3);
+  for_each_piece(0, bounds.size(), threads,
+                 [&](size_t, uint32_t begin, uint32_t end) {
+                   for (uint32_t i = begin; i < end; i++) {
+                     for (int k = 0; k < 3; k++) {
+                       bounds[i].extend(
+                           vertex(mesh, mesh.indices[3 * size_t(i) + k]));
+                     }
+                   }
+                 });
+  MeshBvh result{.mesh = &mesh,
+                 .bvh = preview ? Bvh::build_lbvh(bounds, threads)
+                                : Bvh::build(bounds, threads)};
+  if (width == BvhWidth::Four) {
+    result.wide = BlockBvh<4>::build(result.bvh, mesh);
+  } else if (width == BvhWidth::Eight) {
+    result.wide = BlockBvh<8>::build(result.bvh, mesh);
+  }
+  return result;
+}
+
+bool MeshBvh::intersect(const Ray &ray, float &t_max, Hit &hit) const {
+  TriangleRay triangle_ray(ray);
+  auto test = [&](uint32_t triangle, float &t_max) {
+    auto *index = mesh->indices.data() + 3 * size_t(triangle);
+    float t, u, v;
+    if (!intersect_triangle(triangle_ray, vertex(*mesh, index[0]),
+                            vertex(*mesh, index[1]), vertex(*mesh, index[2]),
+                            t_max, t, u, v)) {
+      return false;
+    }
+    t_max = t;
+    hit.t = t;
+    hit.u = u;
+    hit.v = v;
+    hit.triangle = triangle;
+    return true;
+  };
+  auto blocks = [&](const auto &wide) {
+    return wide.bvh.traverse(
+        ray, t_max, [&](uint32_t first, uint32_t count, float &t_max) {
+          return intersect_leaf(wide, triangle_ray, first, count, t_max, hit);
+        });
+  };
+  if (auto *wide4 = std::get_if<BlockBvh<4>>(&wide)) {
+    return blocks(*wide4);
+  }
+  if (auto *wide8 = std::get_if<BlockBvh<8>>(&wide)) {
+    return blocks(*wide8);
+  }
+  return bvh.traverse(ray, t_max, test);
+}
+
+bool MeshBvh::occluded(const Ray &ray, float t_min, float t_max) const {
+  TriangleRay triangle_ray(ray);
+  auto test = [&](uint32_t triangle, float t_max) {
+    auto *index = mesh->indices.data() + 3 * size_t(triangle);
+    float t, u, v;
+    return intersect_triangle(triangle_ray, vertex(*mesh, index[0]),
+                              vertex(*mesh, index[1]),
+                              vertex(*mesh, index[2]), t_max, t, u, v) &&
+           t > t_min;
+  };
+  auto blocks = [&](const auto &wide) {
+    return wide.bvh.traverse_any(
+        ray, t_max, [&](uint32_t first, uint32_t count, float t_max) {
+          return occludes_leaf(wide, triangle_ray, first, count, t_min,
+                               t_max);
+        });
+  };
+  if (auto *wide4 = std::get_if<BlockBvh<4>>(&wide)) {
+    return blocks(*wide4);
+  }
+  if (auto *wide8 = std::get_if<BlockBvh<8>>(&wide)) {
+    return blocks(*wide8);
+  }
+  return bvh.traverse_any(ray, t_max, test);
+}
+
+SceneBvh SceneBvh::build(const SceneData &scene, size_t threads,
+                         bool preview, BvhWidth width) {
+  SceneBvh result;
+  // built below, once every mesh is known
+  auto add_mesh = [&](const ShapeData &shape) {
+    result.meshes.push_back(MeshBvh{
+        .mesh = &std::get<TriangleMeshShapeData>(shape.data)});
+    return uint32_t(result.meshes.size() - 1);
+  };
+
+  for (auto &shape : scene.shapes) {
+    result.instances.push_back(Instance{.mesh = add_mesh(shape),
+                                        .shape = &shape,
+                                        .object_to_world = IDENTITY_TRANSFORM,
+                                        .world_to_object = Transform3()});
+  }
+
+  // meshes of an object are built once, however often it is instanced
+  std::unordered_map<std::string_view, std::vector<uint32_t>> object_meshes;
+  for (auto &instance : scene.instances) {
+    auto object = scene.objects.find(instance.object);
+    if (object == scene.objects.end()) {
+      std::cerr << "instance of unknown object " << instance.object
+                << std::endl;
+      continue;
+    }
+    auto [meshes, inserted] = object_meshes.try_emplace(instance.object);
+    if (inserted) {
+      for (auto &shape : object->second.shapes) {
+        meshes->second.push_back(add_mesh(shape));
+      }
+    }
+    auto world_to_object = Transform3(instance.transform).inverse();
+    for (size_t i = 0; i < meshes->second.size(); i++) {
+      result.instances.push_back(
+          Instance{.mesh = meshes->second[i],
+                   .shape = &object->second.shapes[i],
+                   .object_to_world = instance.transform,
+                   .world_to_object = world_to_object});
+    }
+  }
+
+  size_t per_mesh_threads = result.meshes.size() < threads ? threads : 1;
+  parallel_for(result.meshes.size(), threads / per_mesh_threads,
+               [&](size_t i) {
+                 auto &mesh = result.meshes[i];
+                 mesh = MeshBvh::build(*mesh.mesh, per_mesh_threads, preview,
+                                       width);
+               });
+
+  std::vector<Bounds3f> bounds;
+  bounds.reserve(result.instances.size());
+  for (auto &instance : result.instances) {
+    bounds.push_back(transform_bounds(
+        instance.object_to_world, result.meshes[instance.mesh].bounds()));
+  }
+  result.top = Bvh::build(bounds);
+  return result;
+}
+
+std::optional<Hit> SceneBvh::intersect(const Ray &ray, float t_max) const {
+  Hit hit;
+  bool found = top.traverse(ray, t_max, [&](uint32_t index, float &t_max) {
+    auto &instance = instances[index];
+    // the direction is not renormalized, so t stays a world space distance
+    Ray local{.origin = instance.world_to_object.point(ray.origin),
+              .direction = instance.world_to_object.vector(ray.direction)};
+    if (!meshes[instance.mesh].intersect(local, t_max, hit)) {
+      return false;
+    }
+    hit.instance = index;
+    return true;
+  });
+  if (!found) {
+    return std::nullopt;
+  }
+  return hit;
+}
+
+bool SceneBvh::occluded(const Ray &ray, float t_min, float t_max) const {
+  return top.traverse_any(ray, t_max, [&](uint32_t index, float t_max) {
+    auto &instance = instances[index];
+    Ray local{.origin = instance.world_to_object.point(ray.origin),
+              .direction = instance.world_to_object.vector(ray.direction)};
+    return meshes[instance.mesh].occluded(local, t_min, t_max);
+  });
+}
+
+} // namespace Flow
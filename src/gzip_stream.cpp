@@ -0,0 +1,81 @@
+#include "gzip_stream.h"
+
+#include <iostream>
+#include <zlib.h>
+
+std::unique_ptr<GzipStream> GzipStream::open(const char *path,
+                                             size_t block_size) {
+  gzFile file = gzopen(path, "rb");
+  if (!file) {
+    std::cerr << "failed to open compressed scene " << path << std::endl;
+    return nullptr;
+  }
+  // fewer, larger reads from slow storage
+  gzbuffer(file, 1 << 18);
+  return std::unique_ptr<GzipStream>(new GzipStream(file, block_size));
+}
+
+GzipStream::GzipStream(gzFile_s *file, size_t block_size)
+    : file(file), block_size(block_size), producer([this] { produce(); }) {}
+
+GzipStream::~GzipStream() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+  changed.notify_all();
+  producer.join();
+  gzclose(file);
+}
+
+void GzipStream::produce() {
+  std::string buffer;
+  while (true) {
+    buffer.resize(block_size);
+    int read = gzread(file, buffer.data(), unsigned(block_size));
+    buffer.resize(read < 0 ? 0 : size_t(read));
+    bool last = read < 0 || size_t(read) < block_size;
+    // a short read is either the end of the file or an error, including a
+    // file cut off in the middle of the stream
+    int code = Z_OK;
+    const char *message = last ? gzerror(file, &code) : nullptr;
+    bool failed = code != Z_OK;
+    if (failed) {
+      std::cerr << "failed to decompress scene: " << message << std::endl;
+    }
+
+    std::unique_lock lock(mutex);
+    changed.wait(lock, [&] { return !has_ready || stopping; });
+    if (stopping) {
+      return;
+    }
+    // the caller's previous block comes back here and is reused
+    std::swap(ready, buffer);
+    has_ready = !ready.empty();
+    finished = last;
+    error = failed;
+    lock.unlock();
+    changed.notify_all();
+    if (last) {
+      return;
+    }
+  }
+}
+
+bool GzipStream::next(std::string &block) {
+  std::unique_lock lock(mutex);
+  changed.wait(lock, [&] { return has_ready || finished; });
+  if (!has_ready) {
+    return false;
+  }
+  std::swap(block, ready);
+  has_ready = false;
+  lock.unlock();
+  changed.notify_all();
+  return true;
+}
+
+bool GzipStream::failed() const {
+  std::lock_guard lock(mutex);
+  return error;
+}
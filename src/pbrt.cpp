@@ -1 +1,469 @@
 #include "pbrt.h"
+#include "gzip_stream.h"
+#include "math.h"
+
+namespace {
+
+struct Chunk {
+  size_t begin;
+  size_t end;
+  // material in effect where the chunk starts
+  std::string_view material;
+};
+
+// Moves the tokenizer past the ']' of a list whose '[' was just returned.
+// Lists without strings are skipped in one search; the rest are tokenized.
+void skip_list(Tokenizer &tokenizer) {
+  auto rest = tokenizer.source.substr(tokenizer.position);
+  size_t end = rest.find(']');
+  if (end != std::string_view::npos &&
+      rest.substr(0, end).find('"') == std::string_view::npos) {
+    tokenizer.position += end + 1;
+    return;
+  }
+  while (auto token = tokenizer.next()) {
+    if (token->type == TokenType::ListEnd) {
+      return;
+    }
+  }
+}
+
+bool is_world_directive(Directive directive) {
+  switch (directive) {
+  case Directive::AttributeBegin:
+  case Directive::MakeNamedMaterial:
+  case Directive::NamedMaterial:
+  case Directive::Shape:
+  case Directive::Import:
+  case Directive::ObjectBegin:
+  case Directive::ObjectInstance:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Cuts `source` in front of top-level world directives into chunks of at
+// least `chunk_bytes`. Everything up to WorldBegin stays in the first chunk.
+// Returns a single chunk when the world block holds a top-level directive
+// whose effect on SceneData would be lost by parsing it out of order.
+std::vector<Chunk> split_chunks(std::string_view source, size_t chunk_bytes) {
+  std::vector<Chunk> chunks{Chunk{.begin = 0, .end = source.size()}};
+  Tokenizer tokenizer(source);
+  bool in_world = false;
+  size_t depth = 0;
+  std::string_view material;
+  while (auto token = tokenizer.next()) {
+    if (token->type == TokenType::ListStart) {
+      skip_list(tokenizer);
+      continue;
+    }
+    if (token->type != TokenType::Identifier) {
+      continue;
+    }
+    auto directive = find_directive(token->value);
+    if (!in_world) {
+      in_world = directive == Directive::WorldBegin;
+      continue;
+    }
+    if (depth > 0) {
+      if (directive == Directive::AttributeBegin ||
+          directive == Directive::ObjectBegin) {
+        depth += 1;
+      } else if (directive == Directive::AttributeEnd ||
+                 directive == Directive::ObjectEnd) {
+        depth -= 1;
+      }
+      continue;
+    }
+    if (!is_world_directive(directive)) {
+      return {Chunk{.begin = 0, .end = source.size()}};
+    }
+
+    size_t offset = token->value.data() - source.data();
+    if (offset - chunks.back().begin >= chunk_bytes) {
+      chunks.back().end = offset;
+      chunks.push_back(Chunk{
+          .begin = offset, .end = source.size(), .material = material});
+    }
+    if (directive == Directive::NamedMaterial) {
+      if (auto argument = tokenizer.next()) {
+        material = argument->value;
+      }
+    } else if (directive == Directive::AttributeBegin ||
+               directive == Directive::ObjectBegin) {
+      depth = 1;
+    }
+  }
+  return chunks;
+}
+
+// Numeric lists that grow longer than this while their statement is still
+// arriving are converted block by block instead of being kept as text.
+constexpr size_t STREAM_LIST_BYTES = 1 << 16;
+
+// Finds the complete top-level statements of text that arrives in blocks.
+// Scanning resumes where the previous block stopped, so every byte is looked
+// at about once however many blocks a statement spans.
+class StatementScanner {
+public:
+  explicit StatementScanner(size_t threads) : threads(threads) {}
+
+  // `text` grew at its end since the last call. Returns the offset of the
+  // last top-level statement, which may be cut off by the end of the text,
+  // or 0 if there is only one. Everything before it is complete statements.
+  // The complete numbers of a long numeric list are converted and cut out of
+  // `text`.
+  size_t scan(std::string &text) {
+    while (position < text.size()) {
+      if (list_start != std::string::npos && !scan_number_list(text)) {
+        break;
+      }
+      if (position == text.size()) {
+        break;
+      }
+      char b = text[position];
+      const char *p = text.data() + position;
+      size_t n = text.size() - position;
+      if (scan::matches<scan::CharClass::Space>(b)) {
+        position += scan::span<scan::CharClass::Space>(p, n);
+      } else if (b == '"') {
+        size_t end = text.find('"', position + 1);
+        if (end == std::string::npos) {
+          break;
+        }
+        integer_list = std::string_view(p + 1, end - position - 1)
+                           .starts_with("integer");
+        position = end + 1;
+      } else if (b == '[') {
+        position += 1;
+        if (in_list) {
+          continue;
+        }
+        in_list = true;
+        list_start = position - 1;
+      } else if (b == ']') {
+        position += 1;
+        in_list = false;
+      } else if (b == '-' || isdigit(b) || isalpha(b)) {
+        // a name or number that reaches the end may go on in the next block
+        size_t count =
+            isalpha(b) ? scan::span<scan::CharClass::Identifier>(p, n)
+                       : scan::span<scan::CharClass::Number>(p + 1, n - 1) + 1;
+        if (count == n) {
+          break;
+        }
+        if (isalpha(b)) {
+          statement(std::string_view(p, count));
+        }
+        position += count;
+      } else {
+        position += 1;
+      }
+    }
+    return statement_start;
+  }
+
+  // The caller parsed the first `end` bytes of the text and erased them.
+  // Returns the lists converted within them, in order, and moves everything
+  // else to the new offsets. After the last block `end` is the whole text
+  // and the scanner is not used again.
+  std::deque<StreamedList> consume(size_t end) {
+    std::deque<StreamedList> parsed;
+    while (!lists.empty() && lists.front().offset < end) {
+      parsed.push_back(std::move(lists.front()));
+      lists.pop_front();
+    }
+    for (auto &list : lists) {
+      list.offset -= end;
+    }
+    position -= end;
+    statement_start -= end;
+    if (list_start != std::string::npos) {
+      list_start -= end;
+    }
+    return parsed;
+  }
+
+private:
+  void statement(std::string_view name) {
+    auto directive = find_directive(name);
+    if (depth == 0) {
+      statement_start = position;
+    }
+    if (directive == Directive::AttributeBegin ||
+        directive == Directive::ObjectBegin) {
+      depth += 1;
+    } else if ((directive == Directive::AttributeEnd ||
+                directive == Directive::ObjectEnd) &&
+               depth > 0) {
+      depth -= 1;
+    }
+  }
+
+  // Looks for the end of the list opened at list_start in the bytes not
+  // scanned yet. A list holding a string is left to the token loop. Returns
+  // false while the list goes on past the end of the text.
+  bool scan_number_list(std::string &text) {
+    size_t end = text.find(']', position);
+    size_t quote = std::string_view(text).substr(0, end).find('"', position);
+    if (quote != std::string::npos && !streaming) {
+      list_start = std::string::npos;
+      position = quote;
+      return true;
+    }
+    if (end == std::string::npos) {
+      position = text.size();
+      if (streaming || position - list_start > STREAM_LIST_BYTES) {
+        stream(text, false);
+      }
+      return false;
+    }
+    position = end;
+    if (streaming) {
+      stream(text, true);
+    }
+    list_start = std::string::npos;
+    streaming = false;
+    return true;
+  }
+
+  // Converts the numbers between list_start and `position` and erases their
+  // text. Unless the list is `closed`, the last number may still be cut off
+  // and waits for the next block.
+  void stream(std::string &text, bool closed) {
+    size_t first = list_start + 1;
+    auto numbers = std::string_view(text).substr(first, position - first);
+    if (!closed) {
+      size_t cut = numbers.find_last_of(" \n");
+      if (cut == std::string_view::npos) {
+        return;
+      }
+      numbers = numbers.substr(0, cut);
+    }
+    if (!streaming) {
+      lists.push_back(StreamedList{.offset = list_start});
+      if (integer_list) {
+        lists.back().values.emplace<std::vector<int>>();
+      }
+      streaming = true;
+    }
+    Tokenizer converter(numbers);
+    converter.threads = threads;
+    std::visit([&](auto &values) {
+      converter.convert_number_list(numbers, values, values.size());
+    }, lists.back().values);
+    text.erase(first, numbers.size());
+    position -= numbers.size();
+  }
+
+  size_t threads;
+  // first byte not scanned yet
+  size_t position = 0;
+  size_t statement_start = 0;
+  size_t depth = 0;
+  // a list is open, and it holds only numbers as far as scanned if list_start
+  // is set too
+  bool in_list = false;
+  size_t list_start = std::string::npos;
+  bool streaming = false;
+  // whether the last parameter declaration was an integer one
+  bool integer_list = false;
+  std::deque<StreamedList> lists;
+};
+
+constexpr size_t TRANSFORM_PIECE = 1 << 14;
+
+// Runs f(first, count) over pieces of an xyz array on up to `threads`
+// threads.
+template <typename F>
+void for_each_vertex_piece(std::pmr::vector<float> &xyz, size_t threads,
+                           F &&f) {
+  size_t vertices = xyz.size() / 3;
+  size_t pieces = (vertices + TRANSFORM_PIECE - 1) / TRANSFORM_PIECE;
+  parallel_for(pieces, threads, [&](size_t i) {
+    size_t first = i * TRANSFORM_PIECE;
+    f(xyz.data() + 3 * first, std::min(TRANSFORM_PIECE, vertices - first));
+  });
+}
+
+void transform_normals(std::pmr::vector<float> &n,
+                       const Flow::Transform3 &transform, size_t threads) {
+  for_each_vertex_piece(n, threads, [&](float *xyz, size_t count) {
+    transform.transform_normals(xyz, count);
+  });
+}
+
+// A deferred array and where its numbers go.
+struct PendingArray {
+  std::optional<DeferredArray> *deferred;
+  std::pmr::vector<float> *values;
+};
+
+template <typename Scene, typename F> void for_each_mesh(Scene &scene, F &&f) {
+  for (auto &shape : scene.shapes) {
+    f(std::get<TriangleMeshShapeData>(shape.data));
+  }
+  for (auto &[name, object] : scene.objects) {
+    for (auto &shape : object.shapes) {
+      f(std::get<TriangleMeshShapeData>(shape.data));
+    }
+  }
+}
+
+} // namespace
+
+void apply_transform(TriangleMeshShapeData &mesh,
+                     const Flow::Transform3 &transform, size_t threads) {
+  for_each_vertex_piece(mesh.positions, threads, [&](float *xyz,
+                                                     size_t count) {
+    transform.transform_points(xyz, count);
+  });
+  transform_normals(mesh.normals, transform, threads);
+}
+
+void SceneData::load_attributes(MeshAttribute attribute, size_t threads) {
+  std::vector<PendingArray> pending;
+  for_each_mesh(*this, [&](TriangleMeshShapeData &mesh) {
+    auto &deferred = attribute == MeshAttribute::Uv ? mesh.deferred_uvs
+                                                    : mesh.deferred_normals;
+    auto &values = attribute == MeshAttribute::Uv ? mesh.uvs : mesh.normals;
+    if (deferred) {
+      pending.push_back(PendingArray{.deferred = &deferred, .values = &values});
+    }
+  });
+
+  // many arrays are spread over the threads, a few large ones are each
+  // converted on all of them
+  size_t per_array_threads = pending.size() < threads ? threads : 1;
+  parallel_for(pending.size(), threads / per_array_threads, [&](size_t i) {
+    auto &[deferred, values] = pending[i];
+    auto &array = **deferred;
+    Tokenizer tokenizer(array.text);
+    tokenizer.threads = per_array_threads;
+    tokenizer.convert_number_list(array.text, *values);
+    if (array.transform != IDENTITY_TRANSFORM) {
+      transform_normals(*values, Flow::Transform3(array.transform),
+                        per_array_threads);
+    }
+    deferred->reset();
+  });
+
+  if (!has_deferred_attributes()) {
+    sources.clear();
+  }
+}
+
+bool SceneData::has_deferred_attributes() const {
+  bool deferred = false;
+  for_each_mesh(*this, [&](const TriangleMeshShapeData &mesh) {
+    deferred |= mesh.deferred_uvs || mesh.deferred_normals;
+  });
+  return deferred;
+}
+
+SceneData parse_parallel(std::string_view source, size_t threads,
+                         size_t chunk_bytes,
+                         const std::filesystem::path &base_directory,
+                         bool defer_attributes) {
+  auto chunks = split_chunks(source, chunk_bytes);
+
+  // every chunk allocates from the same arena, so stitching them together
+  // moves arrays instead of copying them
+  auto arena = std::make_shared<SceneArena>();
+  std::vector<std::optional<SceneData>> parts(chunks.size());
+  // the chunks running at once share the threads, so a large list inside
+  // one does not start more workers on top of theirs
+  size_t running = std::max<size_t>(1, std::min(threads, chunks.size()));
+  size_t per_chunk_threads = std::max<size_t>(1, threads / running);
+  parallel_for(chunks.size(), threads / per_chunk_threads, [&](size_t i) {
+    auto &chunk = chunks[i];
+    Tokenizer tokenizer(source.substr(chunk.begin, chunk.end - chunk.begin));
+    tokenizer.threads = per_chunk_threads;
+    Parser parser(tokenizer);
+    parser.material = chunk.material;
+    parser.in_world = i > 0;
+    parser.base_directory = base_directory;
+    parser.arena = arena;
+    parser.defer_attributes = defer_attributes;
+    parts[i].emplace(parser.parse());
+  });
+
+  SceneData scene_data = std::move(*parts[0]);
+  for (size_t i = 1; i < parts.size(); i++) {
+    scene_data.append(std::move(*parts[i]));
+  }
+  return scene_data;
+}
+
+SceneData parse_blocks(const std::function<bool(std::string &)> &next_block,
+                       size_t threads,
+                       const std::filesystem::path &base_directory) {
+  SceneData scene_data;
+  // holds the graphics state and pending Imports between windows
+  Tokenizer no_tokens("");
+  Parser state(no_tokens);
+  state.base_directory = base_directory;
+  state.arena = scene_data.arena;
+
+  StatementScanner scanner(threads);
+  std::string window;
+  std::string block;
+  bool more = true;
+  while (more) {
+    more = next_block(block);
+    if (more && window.empty()) {
+      window.swap(block);
+    } else if (more) {
+      window += block;
+    }
+    size_t end = more ? scanner.scan(window) : window.size();
+    if (end == 0) {
+      continue;
+    }
+
+    Tokenizer tokenizer(std::string_view(window).substr(0, end));
+    tokenizer.threads = threads;
+    tokenizer.streamed_lists = scanner.consume(end);
+    Parser parser(tokenizer);
+    parser.material = state.material;
+    parser.transform = state.transform;
+    parser.in_world = state.in_world;
+    parser.base_directory = base_directory;
+    parser.arena = scene_data.arena;
+    parser.parse_into(scene_data);
+    state.material = parser.material;
+    state.transform = parser.transform;
+    state.in_world = parser.in_world;
+    for (auto &import : parser.imports) {
+      state.imports.push_back(std::move(import));
+    }
+    window.erase(0, end);
+  }
+  state.merge_imports(scene_data);
+  return scene_data;
+}
+
+SceneData load_scene(const std::filesystem::path &path, size_t threads,
+                     bool defer_attributes) {
+  if (path.extension() == ".gz") {
+    auto stream = GzipStream::open(path.c_str());
+    if (!stream) {
+      parse_error("failed to read scene ", path.string());
+    }
+    auto scene_data = parse_blocks(
+        [&](std::string &block) { return stream->next(block); }, threads,
+        path.parent_path());
+    if (stream->failed()) {
+      parse_error("failed to decompress scene ", path.string());
+    }
+    return scene_data;
+  }
+  auto source = Parser::map_scene(path);
+  auto scene_data = parse_parallel(source.view(), threads, 1 << 16,
+                                   path.parent_path(), defer_attributes);
+  if (defer_attributes) {
+    scene_data.sources.push_back(std::move(source));
+  }
+  return scene_data;
+}
@@ -0,0 +1,405 @@
+#include "ply.h"
+#include "pbrt.h"
+#include "scene_source.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float, Double };
+
+std::optional<PlyType> parse_type(std::string_view name) {
+  if (name == "char" || name == "int8") {
+    return PlyType::Int8;
+  } else if (name == "uchar" || name == "uint8") {
+    return PlyType::UInt8;
+  } else if (name == "short" || name == "int16") {
+    return PlyType::Int16;
+  } else if (name == "ushort" || name == "uint16") {
+    return PlyType::UInt16;
+  } else if (name == "int" || name == "int32") {
+    return PlyType::Int32;
+  } else if (name == "uint" || name == "uint32") {
+    return PlyType::UInt32;
+  } else if (name == "float" || name == "float32") {
+    return PlyType::Float;
+  } else if (name == "double" || name == "float64") {
+    return PlyType::Double;
+  }
+  return std::nullopt;
+}
+
+size_t type_size(PlyType type) {
+  switch (type) {
+  case PlyType::Int8:
+  case PlyType::UInt8:
+    return 1;
+  case PlyType::Int16:
+  case PlyType::UInt16:
+    return 2;
+  case PlyType::Int32:
+  case PlyType::UInt32:
+  case PlyType::Float:
+    return 4;
+  case PlyType::Double:
+    return 8;
+  }
+  return 0;
+}
+
+template <typename T> T load(const char *p) {
+  T value;
+  std::memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+template <typename T> T read_as(const char *p, PlyType type) {
+  switch (type) {
+  case PlyType::Int8:
+    return static_cast<T>(load<int8_t>(p));
+  case PlyType::UInt8:
+    return static_cast<T>(load<uint8_t>(p));
+  case PlyType::Int16:
+    return static_cast<T>(load<int16_t>(p));
+  case PlyType::UInt16:
+    return static_cast<T>(load<uint16_t>(p));
+  case PlyType::Int32:
+    return static_cast<T>(load<int32_t>(p));
+  case PlyType::UInt32:
+    return static_cast<T>(load<uint32_t>(p));
+  case PlyType::Float:
+    return static_cast<T>(load<float>(p));
+  case PlyType::Double:
+    return static_cast<T>(load<double>(p));
+  }
+  return T{};
+}
+
+struct PlyProperty {
+  std::string_view name;
+  PlyType type;
+  bool is_list;
+  PlyType count_type;
+  // byte offset inside the record, valid for fixed size records only
+  size_t offset;
+};
+
+struct PlyElement {
+  std::string_view name;
+  size_t count;
+  std::vector<PlyProperty> properties;
+  // record size, or 0 when the element has list properties
+  size_t stride;
+
+  const PlyProperty *find(std::initializer_list<std::string_view> names) const {
+    for (auto &property : properties) {
+      for (auto name : names) {
+        if (property.name == name) {
+          return &property;
+        }
+      }
+    }
+    return nullptr;
+  }
+};
+
+std::vector<std::string_view> split_words(std::string_view line) {
+  std::vector<std::string_view> words;
+  while (!line.empty()) {
+    size_t start = line.find_first_not_of(' ');
+    if (start == std::string_view::npos) {
+      break;
+    }
+    line = line.substr(start);
+    size_t end = std::min(line.find(' '), line.size());
+    words.push_back(line.substr(0, end));
+    line = line.substr(end);
+  }
+  return words;
+}
+
+// Parses the ASCII header and leaves `data` at the first byte after
+// end_header.
+std::optional<std::vector<PlyElement>> parse_header(std::string_view &data) {
+  if (!data.starts_with("ply")) {
+    std::cerr << "not a ply file" << std::endl;
+    return std::nullopt;
+  }
+  std::vector<PlyElement> elements;
+  while (true) {
+    size_t end = data.find('\n');
+    if (end == std::string_view::npos) {
+      std::cerr << "unterminated ply header" << std::endl;
+      return std::nullopt;
+    }
+    auto line = data.substr(0, end);
+    data = data.substr(end + 1);
+    if (line.ends_with('\r')) {
+      line.remove_suffix(1);
+    }
+    auto words = split_words(line);
+    if (words.empty() || words[0] == "ply" || words[0] == "comment" ||
+        words[0] == "obj_info") {
+      continue;
+    }
+    if (words[0] == "end_header") {
+      break;
+    } else if (words[0] == "format") {
+      if (words.size() < 2 || words[1] != "binary_little_endian") {
+        std::cerr << "unsupported ply format " << line << std::endl;
+        return std::nullopt;
+      }
+    } else if (words[0] == "element" && words.size() == 3) {
+      elements.push_back(PlyElement{.name = words[1],
+                                    .count = parse_number<size_t>(words[2]),
+                                    .stride = 0});
+    } else if (words[0] == "property" && !elements.empty()) {
+      // every field starts out set, types included, and `supported` says
+      // whether the line named types we can read
+      PlyProperty property{};
+      bool supported = false;
+      if (words.size() == 5 && words[1] == "list") {
+        auto count_type = parse_type(words[2]);
+        auto type = parse_type(words[3]);
+        if (count_type && type) {
+          property.is_list = true;
+          property.count_type = *count_type;
+          property.type = *type;
+          supported = true;
+        }
+        property.name = words[4];
+      } else if (words.size() == 3) {
+        auto type = parse_type(words[1]);
+        if (type) {
+          property.type = *type;
+          supported = true;
+        }
+        property.name = words[2];
+      }
+      if (!supported) {
+        std::cerr << "unsupported ply property " << line << std::endl;
+        return std::nullopt;
+      }
+      elements.back().properties.push_back(property);
+    } else {
+      std::cerr << "unexpected ply header line " << line << std::endl;
+      return std::nullopt;
+    }
+  }
+
+  for (auto &element : elements) {
+    size_t offset = 0;
+    bool fixed = true;
+    for (auto &property : element.properties) {
+      property.offset = offset;
+      fixed = fixed && !property.is_list;
+      offset += type_size(property.type);
+    }
+    element.stride = fixed ? offset : 0;
+  }
+  return elements;
+}
+
+// Size of the variable length record at `p`, or 0 if it would run past
+// `end`.
+size_t record_size(const PlyElement &element, const char *p, const char *end) {
+  size_t size = 0;
+  for (auto &property : element.properties) {
+    if (property.is_list) {
+      size_t count_size = type_size(property.count_type);
+      if (p + size + count_size > end) {
+        return 0;
+      }
+      auto count = read_as<size_t>(p + size, property.count_type);
+      size += count_size + count * type_size(property.type);
+    } else {
+      size += type_size(property.type);
+    }
+  }
+  return p + size > end ? 0 : size;
+}
+
+const char *read_vertices(const PlyElement &element, const char *data,
+                          const char *end, TriangleMeshShapeData &mesh,
+                          size_t threads) {
+  auto *x = element.find({"x"});
+  auto *y = element.find({"y"});
+  auto *z = element.find({"z"});
+  if (!x || !y || !z || element.stride == 0) {
+    std::cerr << "ply vertices need fixed size x, y and z" << std::endl;
+    return nullptr;
+  }
+  if (static_cast<size_t>(end - data) / element.stride < element.count) {
+    std::cerr << "truncated ply vertex data" << std::endl;
+    return nullptr;
+  }
+  auto *nx = element.find({"nx"});
+  auto *ny = element.find({"ny"});
+  auto *nz = element.find({"nz"});
+  bool has_normals = nx && ny && nz;
+  auto *u = element.find({"u", "s", "texture_u", "texture_s"});
+  auto *v = element.find({"v", "t", "texture_v", "texture_t"});
+  bool has_uvs = u && v;
+
+  size_t count = element.count;
+  mesh.positions.resize(count * 3);
+  mesh.normals.resize(has_normals ? count * 3 : 0);
+  mesh.uvs.resize(has_uvs ? count * 2 : 0);
+
+  const size_t vertices_per_piece = 1 << 16;
+  size_t pieces = (count + vertices_per_piece - 1) / vertices_per_piece;
+  parallel_for(pieces, threads, [&](size_t piece) {
+    size_t begin = piece * vertices_per_piece;
+    size_t end = std::min(count, begin + vertices_per_piece);
+    for (size_t i = begin; i < end; i++) {
+      const char *record = data + i * element.stride;
+      mesh.positions[i * 3 + 0] = read_as<float>(record + x->offset, x->type);
+      mesh.positions[i * 3 + 1] = read_as<float>(record + y->offset, y->type);
+      mesh.positions[i * 3 + 2] = read_as<float>(record + z->offset, z->type);
+      if (has_normals) {
+        mesh.normals[i * 3 + 0] =
+            read_as<float>(record + nx->offset, nx->type);
+        mesh.normals[i * 3 + 1] =
+            read_as<float>(record + ny->offset, ny->type);
+        mesh.normals[i * 3 + 2] =
+            read_as<float>(record + nz->offset, nz->type);
+      }
+      if (has_uvs) {
+        mesh.uvs[i * 2 + 0] = read_as<float>(record + u->offset, u->type);
+        mesh.uvs[i * 2 + 1] = read_as<float>(record + v->offset, v->type);
+      }
+    }
+  });
+  return data + count * element.stride;
+}
+
+// Faces are variable length, so one serial pass over the list counts finds
+// where every piece starts and how many triangles precede it. The pieces are
+// then fan triangulated in parallel straight into mesh.indices.
+const char *read_faces(const PlyElement &element, const char *data,
+                       const char *end, TriangleMeshShapeData &mesh,
+                       size_t threads) {
+  const PlyProperty *indices = element.find({"vertex_indices", "vertex_index"});
+  if (!indices || !indices->is_list) {
+    std::cerr << "ply faces need a vertex_indices list" << std::endl;
+    return nullptr;
+  }
+
+  struct Piece {
+    const char *begin;
+    size_t first_face;
+    size_t first_triangle;
+  };
+  const size_t faces_per_piece = 1 << 16;
+  std::vector<Piece> pieces;
+  size_t triangles = 0;
+  const char *p = data;
+  for (size_t face = 0; face < element.count; face++) {
+    if (face % faces_per_piece == 0) {
+      pieces.push_back(Piece{p, face, triangles});
+    }
+    size_t size = record_size(element, p, end);
+    if (size == 0) {
+      std::cerr << "truncated ply face data" << std::endl;
+      return nullptr;
+    }
+    const char *list = p;
+    for (auto &property : element.properties) {
+      if (&property == indices) {
+        break;
+      }
+      list += property.is_list
+                  ? type_size(property.count_type) +
+                        read_as<size_t>(list, property.count_type) *
+                            type_size(property.type)
+                  : type_size(property.type);
+    }
+    auto corners = read_as<size_t>(list, indices->count_type);
+    triangles += corners >= 3 ? corners - 2 : 0;
+    p += size;
+  }
+
+  mesh.indices.resize(triangles * 3);
+  size_t index_size = type_size(indices->type);
+  parallel_for(pieces.size(), threads, [&](size_t i) {
+    const char *record = pieces[i].begin;
+    int *out = mesh.indices.data() + pieces[i].first_triangle * 3;
+    size_t last_face =
+        std::min(element.count, pieces[i].first_face + faces_per_piece);
+    for (size_t face = pieces[i].first_face; face < last_face; face++) {
+      for (auto &property : element.properties) {
+        size_t count =
+            property.is_list ? read_as<size_t>(record, property.count_type)
+                             : 0;
+        const char *values =
+            record + (property.is_list ? type_size(property.count_type) : 0);
+        if (&property == indices) {
+          auto corner = [&](size_t c) {
+            return read_as<int>(values + c * index_size, indices->type);
+          };
+          for (size_t c = 2; c < count; c++) {
+            out[0] = corner(0);
+            out[1] = corner(c - 1);
+            out[2] = corner(c);
+            out += 3;
+          }
+        }
+        record = property.is_list ? values + count * type_size(property.type)
+                                  : record + type_size(property.type);
+      }
+    }
+  });
+  return p;
+}
+
+} // namespace
+
+bool load_ply_mesh(const char *path, TriangleMeshShapeData &mesh,
+                   size_t threads) {
+  auto source = SceneSource::map_file(path);
+  if (!source) {
+    return false;
+  }
+  auto data = source->view();
+  auto elements = parse_header(data);
+  if (!elements) {
+    std::cerr << "failed to load ply " << path << std::endl;
+    return false;
+  }
+
+  const char *p = data.data();
+  const char *end = data.data() + data.size();
+  for (auto &element : *elements) {
+    if (element.name == "vertex" || element.name == "face") {
+      p = element.name == "vertex"
+              ? read_vertices(element, p, end, mesh, threads)
+              : read_faces(element, p, end, mesh, threads);
+      if (!p) {
+        std::cerr << "failed to load ply " << path << std::endl;
+        return false;
+      }
+    } else if (element.stride != 0) {
+      p += std::min<size_t>(element.count * element.stride, end - p);
+    } else {
+      for (size_t i = 0; i < element.count; i++) {
+        size_t size = record_size(element, p, end);
+        if (size == 0) {
+          std::cerr << "truncated ply data in " << path << std::endl;
+          return false;
+        }
+        p += size;
+      }
+    }
+  }
+
+  // checked once every element is read, as faces may come before vertices
+  int vertex_count = static_cast<int>(mesh.positions.size() / 3);
+  if (std::any_of(mesh.indices.begin(), mesh.indices.end(), [&](int index) {
+        return index < 0 || index >= vertex_count;
+      })) {
+    std::cerr << "ply face index out of range in " << path << std::endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,55 @@
+#include "scene_arena.h"
+
+#include <algorithm>
+
+SceneArena::SceneArena(size_t initial_size)
+    : arena(initial_size, &upstream) {}
+
+size_t SceneArena::used_bytes() const {
+  std::lock_guard lock(mutex);
+  return used;
+}
+
+size_t SceneArena::peak_bytes() const {
+  std::lock_guard lock(mutex);
+  return peak;
+}
+
+size_t SceneArena::reserved_bytes() const {
+  std::lock_guard lock(mutex);
+  return upstream.reserved;
+}
+
+void *SceneArena::do_allocate(size_t bytes, size_t alignment) {
+  std::lock_guard lock(mutex);
+  void *p = arena.allocate(bytes, alignment);
+  used += bytes;
+  peak = std::max(peak, used);
+  return p;
+}
+
+void SceneArena::do_deallocate(void *, size_t bytes, size_t) {
+  // the memory itself only comes back when the arena is destroyed
+  std::lock_guard lock(mutex);
+  used -= bytes;
+}
+
+bool SceneArena::do_is_equal(const memory_resource &other) const noexcept {
+  return this == &other;
+}
+
+void *SceneArena::Upstream::do_allocate(size_t bytes, size_t alignment) {
+  reserved += bytes;
+  return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void SceneArena::Upstream::do_deallocate(void *p, size_t bytes,
+                                         size_t alignment) {
+  reserved -= bytes;
+  std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+}
+
+bool SceneArena::Upstream::do_is_equal(
+    const memory_resource &other) const noexcept {
+  return this == &other;
+}
@@ -0,0 +1,342 @@
+#include "scene_cache.h"
+
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+uint64_t align(uint64_t offset) { return (offset + 15) & ~uint64_t(15); }
+
+// Assigns every block of the file its offset up front, then streams the
+// blocks out in that order.
+struct CacheWriter {
+  uint64_t cursor = 0;
+  std::vector<std::pair<uint64_t, std::string_view>> blocks;
+
+  uint64_t place(std::string_view bytes) {
+    cursor = align(cursor);
+    uint64_t offset = cursor;
+    blocks.push_back({offset, bytes});
+    cursor += bytes.size();
+    return offset;
+  }
+
+  template <typename T> uint64_t place_object(const T &object) {
+    return place(std::string_view(reinterpret_cast<const char *>(&object),
+                                  sizeof(T)));
+  }
+
+  CachedString add_string(std::string_view s) {
+    return CachedString{.offset = place(s), .size = s.size()};
+  }
+
+  template <typename T, typename Allocator>
+  CachedArray add_array(const std::vector<T, Allocator> &values) {
+    auto bytes = std::string_view(reinterpret_cast<const char *>(values.data()),
+                                  values.size() * sizeof(T));
+    return CachedArray{.offset = place(bytes), .count = values.size()};
+  }
+
+  bool write(std::ostream &out) const {
+    const char padding[16] = {};
+    uint64_t written = 0;
+    for (auto &[offset, bytes] : blocks) {
+      out.write(padding, offset - written);
+      out.write(bytes.data(), bytes.size());
+      written = offset + bytes.size();
+    }
+    return out.good();
+  }
+};
+
+} // namespace
+
+uint64_t hash_scene_source(std::string_view source) {
+  // four independent lanes keep the multiplies from serializing
+  const uint64_t prime = 0x9e3779b97f4a7c15ull;
+  uint64_t lanes[4] = {prime, prime * 3, prime * 5, prime * 7};
+  const char *p = source.data();
+  size_t n = source.size();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (int l = 0; l < 4; l++) {
+      uint64_t word;
+      std::memcpy(&word, p + i + l * 8, 8);
+      lanes[l] = std::rotl(lanes[l] ^ word, 29) * prime;
+    }
+  }
+  uint64_t h = n;
+  for (int l = 0; l < 4; l++) {
+    h = std::rotl(h ^ lanes[l], 31) * prime;
+  }
+  for (; i < n; i++) {
+    h = (h ^ static_cast<unsigned char>(p[i])) * prime;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+bool SceneCache::write(const char *path, const SceneData &scene,
+                       uint64_t source_hash) {
+  if (scene.has_deferred_attributes()) {
+    std::cerr << "load deferred mesh attributes before writing a scene cache"
+              << std::endl;
+    return false;
+  }
+  CacheHeader header{};
+  std::vector<CachedMaterial> materials(scene.materials.size());
+  std::vector<CachedShape> shapes(scene.shapes.size());
+  std::vector<CachedObject> objects(scene.objects.size());
+  std::vector<std::vector<CachedShape>> object_shapes(scene.objects.size());
+  std::vector<CachedInstance> instances(scene.instances.size());
+
+  // the tables are placed while still empty and filled in below; the writer
+  // only keeps pointers to them
+  CacheWriter writer;
+  writer.place_object(header);
+  header.materials = writer.add_array(materials);
+  header.shapes = writer.add_array(shapes);
+  header.objects = writer.add_array(objects);
+  header.instances = writer.add_array(instances);
+
+  header.magic = CacheHeader::MAGIC;
+  header.version = CacheHeader::VERSION;
+  header.source_hash = source_hash;
+  header.integrator_kind = writer.add_string(scene.integrator.kind);
+  header.max_depth = scene.integrator.max_depth;
+  header.camera_kind = writer.add_string(scene.camera.kind);
+  header.fov = scene.camera.fov;
+  header.sampler_kind = writer.add_string(scene.sampler.kind);
+  header.samples = scene.sampler.samples;
+  header.film_kind = writer.add_string(scene.film.kind);
+  header.x_resolution = scene.film.x_resolution;
+  header.y_resolution = scene.film.y_resolution;
+  header.film_filename = writer.add_string(scene.film.filename);
+  header.pixel_filter_kind = writer.add_string(scene.pixel_filter.kind);
+  header.x_radius = scene.pixel_filter.x_radius;
+  header.y_radius = scene.pixel_filter.y_radius;
+  header.transform = scene.transform;
+
+  for (size_t m = 0; m < scene.materials.size(); m++) {
+    auto &material = scene.materials[m];
+    materials[m] =
+        CachedMaterial{.name = writer.add_string(scene.material_names[m]),
+                       .defined = material.has_value()};
+    if (material) {
+      materials[m].reflectance =
+          std::get<DiffuseMaterialData>(material->data).reflectance;
+    }
+  }
+
+  auto add_shape = [&](const ShapeData &shape, CachedShape &cached) {
+    auto &mesh = std::get<TriangleMeshShapeData>(shape.data);
+    cached.material = shape.material;
+    cached.has_light = shape.light.has_value();
+    if (shape.light) {
+      cached.light_l = shape.light->l;
+      cached.light_kind = writer.add_string(shape.light->kind);
+    }
+    cached.uvs = writer.add_array(mesh.uvs);
+    cached.normals = writer.add_array(mesh.normals);
+    cached.positions = writer.add_array(mesh.positions);
+    cached.indices = writer.add_array(mesh.indices);
+  };
+  for (size_t s = 0; s < scene.shapes.size(); s++) {
+    add_shape(scene.shapes[s], shapes[s]);
+  }
+
+  size_t o = 0;
+  for (auto &[name, object] : scene.objects) {
+    auto &cached = object_shapes[o];
+    cached.resize(object.shapes.size());
+    objects[o] = CachedObject{.name = writer.add_string(name),
+                              .shapes = writer.add_array(cached)};
+    for (size_t s = 0; s < object.shapes.size(); s++) {
+      add_shape(object.shapes[s], cached[s]);
+    }
+    o++;
+  }
+
+  for (size_t i = 0; i < scene.instances.size(); i++) {
+    instances[i] =
+        CachedInstance{.object = writer.add_string(scene.instances[i].object),
+                       .transform = scene.instances[i].transform};
+  }
+
+  auto temporary = std::string(path) + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out || !writer.write(out)) {
+      std::cerr << "failed to write scene cache " << temporary << std::endl;
+      return false;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(temporary, path, error);
+  if (error) {
+    std::cerr << "failed to move scene cache to " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+std::optional<SceneCache> SceneCache::open(const char *path,
+                                           uint64_t source_hash) {
+  std::error_code error;
+  if (!std::filesystem::exists(path, error)) {
+    return std::nullopt;
+  }
+  auto mapping = SceneSource::map_file(path);
+  if (!mapping) {
+    return std::nullopt;
+  }
+  SceneCache cache(std::move(*mapping));
+  if (!cache.validate() || cache.header().source_hash != source_hash) {
+    return std::nullopt;
+  }
+  return cache;
+}
+
+bool SceneCache::array_fits(const CachedArray &a, size_t element_size,
+                            size_t alignment) const {
+  auto size = bytes().size();
+  return a.offset % alignment == 0 && a.offset <= size &&
+         a.count <= (size - a.offset) / element_size;
+}
+
+bool SceneCache::string_fits(const CachedString &s) const {
+  return array_fits(CachedArray{.offset = s.offset, .count = s.size}, 1, 1);
+}
+
+bool SceneCache::validate_shapes(std::span<const CachedShape> shapes) const {
+  size_t material_count = header().materials.count;
+  for (auto &shape : shapes) {
+    if ((shape.material != NO_MATERIAL && shape.material >= material_count) ||
+        (shape.has_light && !string_fits(shape.light_kind)) ||
+        !array_fits(shape.uvs, sizeof(float), alignof(float)) ||
+        !array_fits(shape.normals, sizeof(float), alignof(float)) ||
+        !array_fits(shape.positions, sizeof(float), alignof(float)) ||
+        !array_fits(shape.indices, sizeof(int), alignof(int))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SceneCache::validate() const {
+  if (bytes().size() < sizeof(CacheHeader)) {
+    return false;
+  }
+  auto &h = header();
+  if (h.magic != CacheHeader::MAGIC || h.version != CacheHeader::VERSION) {
+    return false;
+  }
+
+  if (!array_fits(h.materials, sizeof(CachedMaterial),
+                  alignof(CachedMaterial)) ||
+      !array_fits(h.shapes, sizeof(CachedShape), alignof(CachedShape)) ||
+      !array_fits(h.objects, sizeof(CachedObject), alignof(CachedObject)) ||
+      !array_fits(h.instances, sizeof(CachedInstance),
+                  alignof(CachedInstance))) {
+    return false;
+  }
+  for (auto s : {h.integrator_kind, h.camera_kind, h.sampler_kind,
+                 h.film_kind, h.film_filename, h.pixel_filter_kind}) {
+    if (!string_fits(s)) {
+      return false;
+    }
+  }
+  for (auto &material : materials()) {
+    if (!string_fits(material.name)) {
+      return false;
+    }
+  }
+  if (!validate_shapes(shapes())) {
+    return false;
+  }
+  for (auto &object : objects()) {
+    if (!string_fits(object.name) ||
+        !array_fits(object.shapes, sizeof(CachedShape),
+                    alignof(CachedShape)) ||
+        !validate_shapes(array<CachedShape>(object.shapes))) {
+      return false;
+    }
+  }
+  for (auto &instance : instances()) {
+    if (!string_fits(instance.object)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+SceneData SceneCache::to_scene_data() const {
+  auto &h = header();
+  SceneData scene;
+  auto intern = [&](const CachedString &s) {
+    return scene.intern(string(s));
+  };
+  scene.integrator.kind = intern(h.integrator_kind);
+  scene.integrator.max_depth = h.max_depth;
+  scene.camera.kind = intern(h.camera_kind);
+  scene.camera.fov = h.fov;
+  scene.sampler.kind = intern(h.sampler_kind);
+  scene.sampler.samples = h.samples;
+  scene.film.kind = intern(h.film_kind);
+  scene.film.x_resolution = h.x_resolution;
+  scene.film.y_resolution = h.y_resolution;
+  scene.film.filename = intern(h.film_filename);
+  scene.pixel_filter.kind = intern(h.pixel_filter_kind);
+  scene.pixel_filter.x_radius = h.x_radius;
+  scene.pixel_filter.y_radius = h.y_radius;
+  scene.transform = h.transform;
+
+  // names are unique in the table, so ids come out as they were written
+  for (auto &material : materials()) {
+    auto id = scene.material_id(string(material.name));
+    if (material.defined) {
+      scene.materials[id] = MaterialData::make_diffuse(material.reflectance);
+    }
+  }
+
+  auto to_vector = [&]<typename T>(const CachedArray &a,
+                                   std::pmr::vector<T> &out) {
+    auto values = array<T>(a);
+    out.assign(values.begin(), values.end());
+  };
+  auto to_shape = [&](const CachedShape &cached) {
+    ShapeData shape = ShapeData::make_triangle_mesh(scene.arena.get());
+    shape.material = cached.material;
+    if (cached.has_light) {
+      shape.light = LightData{.l = cached.light_l,
+                              .kind = intern(cached.light_kind)};
+    }
+    auto &mesh = std::get<TriangleMeshShapeData>(shape.data);
+    to_vector(cached.uvs, mesh.uvs);
+    to_vector(cached.normals, mesh.normals);
+    to_vector(cached.positions, mesh.positions);
+    to_vector(cached.indices, mesh.indices);
+    return shape;
+  };
+  for (auto &cached : shapes()) {
+    scene.shapes.push_back(to_shape(cached));
+  }
+  for (auto &cached : objects()) {
+    ObjectData object{
+        .shapes = std::pmr::vector<ShapeData>(scene.arena.get())};
+    for (auto &shape : array<CachedShape>(cached.shapes)) {
+      object.shapes.push_back(to_shape(shape));
+    }
+    scene.objects.insert({intern(cached.name), std::move(object)});
+  }
+  for (auto &cached : instances()) {
+    scene.instances.push_back(InstanceData{.object = intern(cached.object),
+                                           .transform = cached.transform});
+  }
+  return scene;
+}
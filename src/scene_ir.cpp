@@ -0,0 +1,176 @@
+#include "scene_ir.h"
+
+namespace Flow {
+
+namespace {
+
+constexpr size_t PIECE_SIZE = 1 << 16;
+
+// A range of one source's vertices or indices, copied by a single task.
+struct Piece {
+  uint32_t source;
+  bool vertices;
+  size_t begin;
+  size_t end;
+};
+
+} // namespace
+
+void lower_meshes(SceneIR &scene, std::span<const MeshSource> sources,
+                  size_t threads) {
+  size_t vertex_count = scene.positions.size();
+  size_t index_count = scene.indices.size();
+  std::vector<size_t> first_mesh_vertex(sources.size());
+  std::vector<size_t> first_mesh_index(sources.size());
+  std::vector<Transform3> transforms(sources.size());
+  std::vector<Piece> pieces;
+
+  for (uint32_t s = 0; s < sources.size(); s++) {
+    auto &source = sources[s];
+    first_mesh_vertex[s] = vertex_count;
+    first_mesh_index[s] = index_count;
+    transforms[s] = Transform3(source.transform);
+
+    int32_t emitter = -1;
+    if (source.emission) {
+      emitter = scene.emitters.size();
+      scene.emitters.push_back(SceneIR::Emitter{
+          .mesh = uint32_t(scene.meshes.size()), .radiance = *source.emission});
+    }
+    scene.meshes.push_back(
+        SceneIR::Mesh{.first_vertex = uint32_t(vertex_count),
+                      .vertex_count = uint32_t(source.vertex_count),
+                      .first_index = uint32_t(index_count),
+                      .index_count = uint32_t(source.index_count),
+                      .material = source.material,
+                      .emitter = emitter});
+
+    for (size_t i = 0; i < source.vertex_count; i += PIECE_SIZE) {
+      pieces.push_back(Piece{
+          .source = s,
+          .vertices = true,
+          .begin = i,
+          .end = std::min(i + PIECE_SIZE, source.vertex_count)});
+    }
+    for (size_t i = 0; i < source.index_count; i += PIECE_SIZE) {
+      pieces.push_back(
+          Piece{.source = s,
+                .vertices = false,
+                .begin = i,
+                .end = std::min(i + PIECE_SIZE, source.index_count)});
+    }
+    vertex_count += source.vertex_count;
+    index_count += source.index_count;
+  }
+
+  scene.positions.resize(vertex_count);
+  scene.normals.resize(vertex_count);
+  scene.uvs.resize(vertex_count);
+  scene.indices.resize(index_count);
+
+  parallel_for(pieces.size(), threads, [&](size_t p) {
+    auto &piece = pieces[p];
+    auto &source = sources[piece.source];
+    auto &transform = transforms[piece.source];
+    size_t first_vertex = first_mesh_vertex[piece.source];
+    if (!piece.vertices) {
+      auto *out = scene.indices.data() + first_mesh_index[piece.source];
+      for (size_t i = piece.begin; i < piece.end; i++) {
+        out[i] = uint32_t(first_vertex + source.indices[i]);
+      }
+      return;
+    }
+    for (size_t i = piece.begin; i < piece.end; i++) {
+      auto *position = source.positions + 3 * i;
+      scene.positions[first_vertex + i] =
+          transform.point(Vec3f(position[0], position[1], position[2]));
+      if (source.normals) {
+        auto *n = source.normals + 3 * i;
+        auto normal = transform.normal(Vec3f(n[0], n[1], n[2]));
+        // degenerate normals stay zero
+        float length = normal.length();
+        scene.normals[first_vertex + i] =
+            length > 0.0f ? normal / length : normal;
+      }
+      if (source.uvs) {
+        scene.uvs[first_vertex + i] =
+            Vec2f(source.uvs[2 * i], source.uvs[2 * i + 1]);
+      }
+    }
+  });
+}
+
+SceneIR lower_scene(const SceneData &scene, size_t threads) {
+  SceneIR ir;
+  auto camera_to_world = Transform3(scene.transform).inverse();
+  ir.camera = SceneIR::Camera{.camera_to_world = camera_to_world.to_matrix(),
+                              .fov = scene.camera.fov};
+  ir.width = scene.film.x_resolution;
+  ir.height = scene.film.y_resolution;
+  ir.samples = scene.sampler.samples;
+  ir.max_depth = scene.integrator.max_depth;
+
+  // scene material ids carry over. Names that were never defined are grey,
+  // and shapes without a material share a grey one appended after the rest.
+  const std::array<float, 3> grey = {0.5f, 0.5f, 0.5f};
+  for (auto &material : scene.materials) {
+    ir.materials.push_back(SceneIR::Material{
+        .reflectance =
+            material ? std::get<DiffuseMaterialData>(material->data).reflectance
+                     : grey});
+  }
+  std::optional<uint32_t> default_material;
+  auto material_id = [&](uint32_t id) {
+    if (id != NO_MATERIAL) {
+      return id;
+    }
+    if (!default_material) {
+      default_material = ir.materials.size();
+      ir.materials.push_back(SceneIR::Material{.reflectance = grey});
+    }
+    return *default_material;
+  };
+
+  std::vector<MeshSource> sources;
+  auto add = [&](const ShapeData &shape,
+                 const std::array<float, 16> &transform) {
+    auto &mesh = std::get<TriangleMeshShapeData>(shape.data);
+    size_t vertex_count = mesh.positions.size() / 3;
+    std::optional<std::array<float, 3>> emission;
+    if (shape.light) {
+      emission = shape.light->l;
+    }
+    sources.push_back(MeshSource{
+        .positions = mesh.positions.data(),
+        .normals =
+            mesh.normals.size() == 3 * vertex_count ? mesh.normals.data()
+                                                    : nullptr,
+        .uvs = mesh.uvs.size() == 2 * vertex_count ? mesh.uvs.data() : nullptr,
+        .vertex_count = vertex_count,
+        .indices = mesh.indices.data(),
+        .index_count = mesh.indices.size(),
+        .transform = transform,
+        .material = material_id(shape.material),
+        .emission = emission});
+  };
+
+  for (auto &shape : scene.shapes) {
+    add(shape, IDENTITY_TRANSFORM);
+  }
+  for (auto &instance : scene.instances) {
+    auto object = scene.objects.find(instance.object);
+    if (object == scene.objects.end()) {
+      std::cerr << "instance of unknown object " << instance.object
+                << std::endl;
+      continue;
+    }
+    for (auto &shape : object->second.shapes) {
+      add(shape, instance.transform);
+    }
+  }
+
+  lower_meshes(ir, sources, threads);
+  return ir;
+}
+
+} // namespace Flow
@@ -0,0 +1,59 @@
+#include "scene_source.h"
+
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+std::optional<SceneSource> SceneSource::map_file(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "failed to open scene " << path << std::endl;
+    return std::nullopt;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    std::cerr << "failed to stat scene " << path << std::endl;
+    close(fd);
+    return std::nullopt;
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return SceneSource(nullptr, 0);
+  }
+
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps its own reference to the file
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "failed to map scene " << path << std::endl;
+    return std::nullopt;
+  }
+  // the tokenizer reads front to back exactly once
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  return SceneSource(static_cast<const char *>(mapping), size);
+}
+
+SceneSource::SceneSource(SceneSource &&other) noexcept
+    : data(std::exchange(other.data, nullptr)),
+      size(std::exchange(other.size, 0)) {}
+
+SceneSource &SceneSource::operator=(SceneSource &&other) noexcept {
+  if (this != &other) {
+    if (data != nullptr) {
+      munmap(const_cast<char *>(data), size);
+    }
+    data = std::exchange(other.data, nullptr);
+    size = std::exchange(other.size, 0);
+  }
+  return *this;
+}
+
+SceneSource::~SceneSource() {
+  if (data != nullptr) {
+    munmap(const_cast<char *>(data), size);
+  }
+}
@@ -0,0 +1,229 @@
+// Ray casting benchmark. Builds triangle soups of growing size and casts the
+// same random rays through a MeshBvh and through a linear scan over every
+// triangle, the way the renderer's Scene::hit used to. Each stage of each
+// size prints one JSON object per line. The linear scan casts fewer rays on
+// large meshes, so it finishes in reasonable time; rays_per_s accounts for
+// that.
+//
+// The SAH build runs on one thread and on --threads, the LBVH preview build
+// on --threads; build stages report their seconds and the SAH cost of the
+// tree they built. The bvh4 and bvh8 stages cast through the SAH tree
+// collapsed to four and eight children per node, and the occludedN stages
+// ask the any-hit query of each width the same rays.
+//
+//   BvhBench --min-triangles 1000 --max-triangles 1000000 --rays 100000
+//   BvhBench --min-triangles 10000000 --max-triangles 10000000 --rays 0
+#include <bvh.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+
+using namespace Flow;
+
+namespace {
+
+struct Options {
+  size_t min_triangles = 1000;
+  size_t max_triangles = 1000000;
+  size_t rays = 100000;
+  // triangle tests the linear scan may spend per size
+  size_t linear_budget = 500000000;
+  size_t threads = default_thread_count();
+};
+
+// Small triangles scattered through a cube, in clusters the way objects
+// group in a scene.
+TriangleMeshShapeData generate_mesh(size_t triangles, std::mt19937 &rng) {
+  std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+  std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+  TriangleMeshShapeData mesh;
+  Vec3f center;
+  for (size_t t = 0; t < triangles; t++) {
+    if (t % 64 == 0) {
+      center = Vec3f(position(rng), position(rng), position(rng));
+    }
+    for (int k = 0; k < 3; k++) {
+      mesh.indices.push_back(int(mesh.positions.size() / 3));
+      mesh.positions.push_back(center.x + offset(rng) * 4.0f);
+      mesh.positions.push_back(center.y + offset(rng) * 4.0f);
+      mesh.positions.push_back(center.z + offset(rng) * 4.0f);
+    }
+  }
+  return mesh;
+}
+
+Vec3f vertex(const TriangleMeshShapeData &mesh, int index) {
+  auto *p = mesh.positions.data() + 3 * size_t(index);
+  return Vec3f(p[0], p[1], p[2]);
+}
+
+float intersect_linear(const TriangleMeshShapeData &mesh, const Ray &ray) {
+  TriangleRay triangle_ray(ray);
+  float closest = INFINITY;
+  for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+    float t, u, v;
+    if (intersect_triangle(triangle_ray, vertex(mesh, mesh.indices[i]),
+                           vertex(mesh, mesh.indices[i + 1]),
+                           vertex(mesh, mesh.indices[i + 2]), closest, t, u,
+                           v)) {
+      closest = t;
+    }
+  }
+  return closest;
+}
+
+template <typename F>
+void measure(std::string_view stage, size_t triangles, size_t rays,
+             F &&body) {
+  auto start = std::chrono::steady_clock::now();
+  size_t hits = body();
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << "{\"stage\": \"" << stage << "\", \"triangles\": " << triangles
+            << ", \"rays\": " << rays << ", \"hits\": " << hits
+            << ", \"seconds\": " << seconds
+            << ", \"rays_per_s\": " << rays / seconds << "}" << std::endl;
+}
+
+void report_build(std::string_view stage, size_t triangles, size_t threads,
+                  double seconds, const Bvh &bvh) {
+  std::cout << "{\"stage\": \"" << stage << "\", \"triangles\": " << triangles
+            << ", \"threads\": " << threads << ", \"seconds\": " << seconds
+            << ", \"nodes\": " << bvh.nodes.size()
+            << ", \"sah_cost\": " << bvh.sah_cost() << "}" << std::endl;
+}
+
+template <typename F> double time(F &&body) {
+  auto start = std::chrono::steady_clock::now();
+  body();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    auto value = [&]() -> std::string_view {
+      if (i + 1 >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        exit(1);
+      }
+      return argv[++i];
+    };
+    if (arg == "--min-triangles") {
+      options.min_triangles = parse_number<size_t>(value());
+    } else if (arg == "--max-triangles") {
+      options.max_triangles = parse_number<size_t>(value());
+    } else if (arg == "--rays") {
+      options.rays = parse_number<size_t>(value());
+    } else if (arg == "--linear-budget") {
+      options.linear_budget = parse_number<size_t>(value());
+    } else if (arg == "--threads") {
+      options.threads = parse_number<size_t>(value());
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      exit(1);
+    }
+  }
+  return options;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  auto options = parse_options(argc, argv);
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+
+  for (size_t triangles = options.min_triangles;
+       triangles <= options.max_triangles; triangles *= 4) {
+    auto mesh = generate_mesh(triangles, rng);
+    std::vector<Ray> rays;
+    for (size_t r = 0; r < options.rays; r++) {
+      auto origin = Vec3f(position(rng), position(rng), position(rng));
+      auto target = Vec3f(position(rng), position(rng), position(rng));
+      rays.push_back(Ray{.origin = origin, .direction = target - origin});
+    }
+
+    MeshBvh bvh;
+    double seconds = time([&] { bvh = MeshBvh::build(mesh); });
+    report_build("bvh_build", triangles, 1, seconds, bvh.bvh);
+    seconds = time([&] { bvh = MeshBvh::build(mesh, options.threads); });
+    report_build("bvh_build", triangles, options.threads, seconds, bvh.bvh);
+    MeshBvh preview;
+    seconds = time([&] {
+      preview = MeshBvh::build(mesh, options.threads, true);
+    });
+    report_build("lbvh_build", triangles, options.threads, seconds,
+                 preview.bvh);
+
+    auto cast = [&](const MeshBvh &bvh, std::vector<float> &closest) {
+      size_t hits = 0;
+      for (size_t r = 0; r < rays.size(); r++) {
+        float t_max = INFINITY;
+        Hit hit;
+        hits += bvh.intersect(rays[r], t_max, hit);
+        closest[r] = t_max;
+      }
+      return hits;
+    };
+    std::vector<float> closest(rays.size());
+    measure("bvh", triangles, rays.size(), [&] { return cast(bvh, closest); });
+    std::vector<float> preview_closest(rays.size());
+    measure("lbvh", triangles, rays.size(),
+            [&] { return cast(preview, preview_closest); });
+    if (preview_closest != closest) {
+      std::cerr << "bvh and lbvh disagree" << std::endl;
+      return 1;
+    }
+    for (auto width : {BvhWidth::Four, BvhWidth::Eight}) {
+      auto wide = bvh;
+      wide.wide = MeshBvh::build(mesh, options.threads, false, width).wide;
+      std::vector<float> wide_closest(rays.size());
+      measure(width == BvhWidth::Four ? "bvh4" : "bvh8", triangles,
+              rays.size(), [&] { return cast(wide, wide_closest); });
+      if (wide_closest != closest) {
+        std::cerr << "binary and wide bvh disagree" << std::endl;
+        return 1;
+      }
+    }
+    for (auto width : {BvhWidth::Two, BvhWidth::Four, BvhWidth::Eight}) {
+      auto occluding = bvh;
+      occluding.wide = MeshBvh::build(mesh, options.threads, false, width).wide;
+      std::string stage = "occluded" + std::to_string(int(width));
+      measure(stage, triangles, rays.size(), [&] {
+        size_t hits = 0;
+        for (size_t r = 0; r < rays.size(); r++) {
+          bool occluded = occluding.occluded(rays[r], 0.0f, INFINITY);
+          if (occluded != (closest[r] != INFINITY)) {
+            std::cerr << "occluded and closest hit disagree on ray " << r
+                      << std::endl;
+            exit(1);
+          }
+          hits += occluded;
+        }
+        return hits;
+      });
+    }
+
+    size_t linear_rays = std::min(
+        rays.size(), std::max<size_t>(1, options.linear_budget / triangles));
+    measure("linear", triangles, linear_rays, [&] {
+      size_t hits = 0;
+      for (size_t r = 0; r < linear_rays; r++) {
+        float t = intersect_linear(mesh, rays[r]);
+        if (t != closest[r]) {
+          std::cerr << "bvh and linear scan disagree on ray " << r
+                    << std::endl;
+          exit(1);
+        }
+        hits += t != INFINITY;
+      }
+      return hits;
+    });
+  }
+  return 0;
+}
@@ -0,0 +1,277 @@
+// Load path benchmark. Generates a synthetic scene (or maps one given with
+// --scene) and times the Tokenizer, Parser and parse_parallel, the latter
+// also with uv and N deferred, over repeated runs. Each stage of each run
+// prints one JSON object per line. tokens_per_s counts the tokens the
+// Tokenizer sees in the file for every stage.
+//
+// The dispatch stages resolve every directive and parameter declaration of
+// the file, collected up front so only the lookups are timed. dispatch uses
+// the perfect hash tables the Parser uses, dispatch_linear compares against
+// the same names one by one for reference. Many tiny meshes make a parameter
+// heavy scene:
+//
+//   PBRTBench --meshes 1000 --triangles 1000 --normals --uvs --runs 5
+//   PBRTBench --meshes 200000 --triangles 1 --normals --uvs
+#include <pbrt.h>
+#include <scene_source.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <sys/resource.h>
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+struct Options {
+  size_t meshes = 100;
+  size_t triangles = 10000;
+  bool normals = false;
+  bool uvs = false;
+  size_t runs = 5;
+  size_t threads = default_thread_count();
+  std::string_view scene;
+};
+
+// Each mesh is a strip of `triangles` triangles over a jittered grid, written
+// the way exporters write trianglemesh shapes.
+std::string generate_scene(const Options &options) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> jitter(-0.5f, 0.5f);
+  std::string out = "Integrator \"volpath\" \"integer maxdepth\" [ 65 ]\n"
+                    "Transform [ 1 0 0 0 0 1 0 0 0 0 -1 0 0 -1 6.8 1 ]\n"
+                    "Sampler \"sobol\" \"integer pixelsamples\" [ 64 ]\n"
+                    "Film \"rgb\" \"integer xresolution\" [ 1024 ]\n"
+                    "    \"integer yresolution\" [ 1024 ]\n"
+                    "    \"string filename\" [ \"bench.exr\" ]\n"
+                    "Camera \"perspective\" \"float fov\" [ 19.5 ]\n"
+                    "WorldBegin\n"
+                    "MakeNamedMaterial \"grey\"\n"
+                    "    \"string type\" [ \"diffuse\" ]\n"
+                    "    \"rgb reflectance\" [ 0.5 0.5 0.5 ]\n"
+                    "NamedMaterial \"grey\"\n";
+  size_t vertices = options.triangles + 2;
+  for (size_t m = 0; m < options.meshes; m++) {
+    out += "Shape \"trianglemesh\"\n";
+    if (options.uvs) {
+      out += "    \"point2 uv\" [";
+      for (size_t v = 0; v < vertices; v++) {
+        out += ' ' + std::to_string(float(v / 2) / vertices) + ' ' +
+               std::to_string(v % 2);
+      }
+      out += " ]\n";
+    }
+    if (options.normals) {
+      out += "    \"normal N\" [";
+      for (size_t v = 0; v < vertices; v++) {
+        out += " 0 0 1";
+      }
+      out += " ]\n";
+    }
+    out += "    \"point3 P\" [";
+    for (size_t v = 0; v < vertices; v++) {
+      out += ' ' + std::to_string(float(v / 2) + jitter(rng)) + ' ' +
+             std::to_string(float(v % 2) + jitter(rng)) + ' ' +
+             std::to_string(float(m) + jitter(rng));
+    }
+    out += " ]\n    \"integer indices\" [";
+    for (size_t t = 0; t < options.triangles; t++) {
+      out += ' ' + std::to_string(t) + ' ' + std::to_string(t + 1) + ' ' +
+             std::to_string(t + 2);
+    }
+    out += " ]\n";
+  }
+  return out;
+}
+
+size_t peak_rss_bytes() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return size_t(usage.ru_maxrss) * 1024;
+}
+
+// What the Parser's if chains used to do.
+template <typename Table>
+auto find_linear(const Table &table, std::string_view name) {
+  for (auto &[entry, id] : table.names()) {
+    if (entry == name) {
+      return id;
+    }
+  }
+  return decltype(table.names()[0].second){};
+}
+
+// Sum of the ids found, so the lookups cannot be optimized away.
+template <typename Directives, typename Parameters>
+size_t dispatch(const std::vector<std::pair<TokenType, std::string>> &names,
+                Directives &&directive, Parameters &&parameter) {
+  size_t sum = 0;
+  for (auto &[type, name] : names) {
+    if (type == TokenType::Identifier) {
+      sum += size_t(directive(name));
+    } else {
+      sum += size_t(parameter(name));
+    }
+  }
+  return sum;
+}
+
+template <typename F> void measure(std::string_view stage, size_t run,
+                                   size_t bytes, size_t tokens, F &&body) {
+  size_t allocations_before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  body();
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << "{\"stage\": \"" << stage << "\", \"run\": " << run
+            << ", \"bytes\": " << bytes << ", \"seconds\": " << seconds
+            << ", \"mb_per_s\": " << bytes / seconds / 1e6
+            << ", \"tokens_per_s\": " << tokens / seconds
+            << ", \"allocations\": " << allocations.load() - allocations_before
+            << ", \"peak_rss_bytes\": " << peak_rss_bytes() << "}"
+            << std::endl;
+}
+
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    auto value = [&]() -> std::string_view {
+      if (i + 1 >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        exit(1);
+      }
+      return argv[++i];
+    };
+    if (arg == "--meshes") {
+      options.meshes = parse_number<size_t>(value());
+    } else if (arg == "--triangles") {
+      options.triangles = parse_number<size_t>(value());
+    } else if (arg == "--normals") {
+      options.normals = true;
+    } else if (arg == "--uvs") {
+      options.uvs = true;
+    } else if (arg == "--runs") {
+      options.runs = parse_number<size_t>(value());
+    } else if (arg == "--threads") {
+      options.threads = parse_number<size_t>(value());
+    } else if (arg == "--scene") {
+      options.scene = value();
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      exit(1);
+    }
+  }
+  return options;
+}
+
+} // namespace
+
+// Counts every allocation made through new, including the ones inside the
+// standard containers. Every replacement goes through these two, which
+// stay out of line so the compiler never pairs a new with std::free.
+static __attribute__((noinline)) void *
+counted_allocate(size_t size, size_t align) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  size = (std::max(size, size_t(1)) + align - 1) / align * align;
+  if (void *p = std::aligned_alloc(align, size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+static __attribute__((noinline)) void counted_free(void *p) noexcept {
+  std::free(p);
+}
+
+void *operator new(size_t size) {
+  return counted_allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  return counted_allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept { counted_free(p); }
+
+void operator delete(void *p, size_t) noexcept { counted_free(p); }
+
+void operator delete(void *p, std::align_val_t) noexcept { counted_free(p); }
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  counted_free(p);
+}
+
+int main(int argc, char **argv) {
+  auto options = parse_options(argc, argv);
+
+  std::optional<SceneSource> mapped;
+  std::string generated;
+  std::string_view source;
+  if (!options.scene.empty()) {
+    mapped = SceneSource::map_file(std::string(options.scene).c_str());
+    if (!mapped) {
+      return 1;
+    }
+    source = mapped->view();
+  } else {
+    generated = generate_scene(options);
+    source = generated;
+  }
+
+  size_t tokens = 0;
+  // copied out of the source, so the lookups see names that are in cache the
+  // way they are right after the Tokenizer returns them
+  std::vector<std::pair<TokenType, std::string>> names;
+  {
+    Tokenizer tokenizer(source);
+    while (auto token = tokenizer.next()) {
+      tokens++;
+      if (token->type == TokenType::Identifier ||
+          token->type == TokenType::StringLiteral) {
+        names.push_back({token->type, std::string(token->value)});
+      }
+    }
+  }
+
+  for (size_t run = 0; run < options.runs; run++) {
+    measure("tokenizer", run, source.size(), tokens, [&] {
+      Tokenizer tokenizer(source);
+      size_t count = 0;
+      while (tokenizer.next()) {
+        count++;
+      }
+      if (count != tokens) {
+        exit(1);
+      }
+    });
+    size_t linear = 0;
+    measure("dispatch_linear", run, source.size(), tokens, [&] {
+      linear = dispatch(
+          names,
+          [](std::string_view name) { return find_linear(DIRECTIVES, name); },
+          [](std::string_view name) { return find_linear(PARAMETERS, name); });
+    });
+    measure("dispatch", run, source.size(), tokens, [&] {
+      if (dispatch(names, find_directive, find_parameter) != linear) {
+        exit(1);
+      }
+    });
+    measure("parser", run, source.size(), tokens, [&] {
+      Tokenizer tokenizer(source);
+      Parser parser(tokenizer);
+      auto scene = parser.parse();
+    });
+    measure("parse_parallel", run, source.size(), tokens, [&] {
+      auto scene = parse_parallel(source, options.threads);
+    });
+    measure("parse_parallel_deferred", run, source.size(), tokens, [&] {
+      auto scene = parse_parallel(source, options.threads, 1 << 16, {}, true);
+    });
+  }
+  return 0;
+}
@@ -1,29 +1,1171 @@
+#include <bvh.h>
 #include <catch2/catch_test_macros.hpp>
+#include <filesystem>
 #include <fstream>
+#include <gzip_stream.h>
 #include <pbrt.h>
+#include <ply.h>
+#include <random>
+#include <scene_ir.h>
+#include <scene_cache.h>
+#include <scene_source.h>
+#include <zlib.h>
 TEST_CASE("test tokenizer") {
-  std::ifstream infile("../../../assets/cornell-box/scene-v4.pbrt");
-  std::stringstream buffer;
-  buffer << infile.rdbuf();
-  auto content = buffer.str();
+  auto source =
+      SceneSource::map_file("../../../assets/cornell-box/scene-v4.pbrt");
+  REQUIRE(source.has_value());
 
-  Tokenizer tokenizer(content.c_str());
-  auto tokens = tokenizer.tokenize();
-  for (auto &token : tokens) {
-    std::cout << token << std::endl;
+  Tokenizer tokenizer(source->view());
+  while (auto token = tokenizer.next()) {
+    std::cout << *token << std::endl;
   }
 }
 
 TEST_CASE("test parser") {
-  std::ifstream infile("../../../assets/cornell-box/scene-v4.pbrt");
-  std::stringstream buffer;
-  buffer << infile.rdbuf();
-  auto content = buffer.str();
+  auto source =
+      SceneSource::map_file("../../../assets/cornell-box/scene-v4.pbrt");
+  REQUIRE(source.has_value());
 
-  Tokenizer tokenizer(content.c_str());
-  auto tokens = tokenizer.tokenize();
-
-  Parser parser(tokens);
+  Tokenizer tokenizer(source->view());
+  Parser parser(tokenizer);
   parser.parse();
   std::cout << "success" << std::endl;
 }
+
+TEST_CASE("test streaming tokenizer matches tokenize") {
+  std::string_view content = "Shape \"trianglemesh\"\n"
+                             "  \"point3 P\" [ -1 0.5 2e-3 ]\n";
+  auto tokens = Tokenizer(content).tokenize();
+
+  Tokenizer tokenizer(content);
+  size_t count = 0;
+  while (auto token = tokenizer.next()) {
+    REQUIRE(count < tokens.size());
+    REQUIRE(token->type == tokens[count].type);
+    REQUIRE(token->value == tokens[count].value);
+    count += 1;
+  }
+  REQUIRE(count == tokens.size());
+  REQUIRE(count == 8);
+}
+
+TEST_CASE("test parser reads mesh attributes") {
+  auto source =
+      SceneSource::map_file("../../../assets/cornell-box/scene-v4.pbrt");
+  REQUIRE(source.has_value());
+
+  Tokenizer tokenizer(source->view());
+  Parser parser(tokenizer);
+  auto scene = parser.parse();
+
+  REQUIRE(scene.shapes.size() == 8);
+  REQUIRE(scene.material_name(scene.shapes[0].material) == "Floor");
+  auto &floor = std::get<TriangleMeshShapeData>(scene.shapes[0].data);
+  REQUIRE(floor.uvs.size() == 8);
+  REQUIRE(floor.normals.size() == 12);
+  REQUIRE(floor.positions.size() == 12);
+  REQUIRE(
+      std::ranges::equal(floor.indices, std::vector<int>{0, 1, 2, 0, 2, 3}));
+  REQUIRE(floor.normals[0] == 4.37114e-8f);
+  REQUIRE(floor.positions[1] == 1.74846e-7f);
+
+  auto &light = scene.shapes.back();
+  REQUIRE(light.light.has_value());
+  REQUIRE(light.light->l == std::array<float, 3>{17, 12, 4});
+  REQUIRE(scene.material_name(light.material) == "Light");
+}
+
+TEST_CASE("test simd scans match scalar classification") {
+  // biased towards the bytes the lexer cares about, with some high bytes
+  const char alphabet[] = " \n\"[]-.e0123456789AZaz_#\t\x80\xff";
+  std::string text;
+  uint32_t state = 12345;
+  for (int i = 0; i < 4096; i++) {
+    state = state * 1664525u + 1013904223u;
+    size_t run = (state >> 28) + 1;
+    char ch = alphabet[(state >> 8) % (sizeof(alphabet) - 1)];
+    text.append(run, ch);
+  }
+
+  for (size_t start = 0; start < 1024; start++) {
+    const char *p = text.data() + start;
+    size_t n = text.size() - start;
+    REQUIRE(scan::span<scan::CharClass::Space>(p, n) ==
+            scan::span_scalar<scan::CharClass::Space>(p, n));
+    REQUIRE(scan::span<scan::CharClass::Identifier>(p, n) ==
+            scan::span_scalar<scan::CharClass::Identifier>(p, n));
+    REQUIRE(scan::span<scan::CharClass::Number>(p, n) ==
+            scan::span_scalar<scan::CharClass::Number>(p, n));
+    REQUIRE(scan::span<scan::CharClass::StringBody>(p, n) ==
+            scan::span_scalar<scan::CharClass::StringBody>(p, n));
+#if defined(SCAN_AVX2_DISPATCH)
+    if (scan::cpu_has_avx2) {
+      REQUIRE(scan::span_avx2<scan::CharClass::Number>(p, n) ==
+              scan::span_scalar<scan::CharClass::Number>(p, n));
+      REQUIRE(scan::span_avx2<scan::CharClass::Identifier>(p, n) ==
+              scan::span_scalar<scan::CharClass::Identifier>(p, n));
+    }
+#endif
+  }
+
+  size_t words = 0;
+  for (size_t i = 0; i < text.size(); i++) {
+    bool space = text[i] == ' ' || text[i] == '\n';
+    bool previous_space = i == 0 || text[i - 1] == ' ' || text[i - 1] == '\n';
+    words += !space && previous_space;
+  }
+  REQUIRE(scan::count_words(text.data(), text.size()) == words);
+
+  std::string_view list = "  12 -3.5e-2\n  7  8 9 10 11 12 13 14 15 16  17 ";
+  REQUIRE(scan::count_words(list.data(), list.size()) == 13);
+}
+
+static void require_same_scene(const SceneData &a, const SceneData &b) {
+  REQUIRE(a.integrator.kind == b.integrator.kind);
+  REQUIRE(a.camera.fov == b.camera.fov);
+  REQUIRE(a.film.filename == b.film.filename);
+  REQUIRE(a.materials.size() == b.materials.size());
+  for (size_t m = 0; m < a.materials.size(); m++) {
+    REQUIRE(a.material_names[m] == b.material_names[m]);
+    REQUIRE(a.materials[m].has_value() == b.materials[m].has_value());
+    if (a.materials[m]) {
+      REQUIRE(std::get<DiffuseMaterialData>(a.materials[m]->data).reflectance ==
+              std::get<DiffuseMaterialData>(b.materials[m]->data).reflectance);
+    }
+  }
+  REQUIRE(a.shapes.size() == b.shapes.size());
+  for (size_t i = 0; i < a.shapes.size(); i++) {
+    REQUIRE(a.shapes[i].material == b.shapes[i].material);
+    REQUIRE(a.shapes[i].light.has_value() == b.shapes[i].light.has_value());
+    auto &mesh_a = std::get<TriangleMeshShapeData>(a.shapes[i].data);
+    auto &mesh_b = std::get<TriangleMeshShapeData>(b.shapes[i].data);
+    REQUIRE(mesh_a.positions == mesh_b.positions);
+    REQUIRE(mesh_a.normals == mesh_b.normals);
+    REQUIRE(mesh_a.uvs == mesh_b.uvs);
+    REQUIRE(mesh_a.indices == mesh_b.indices);
+  }
+}
+
+TEST_CASE("test parallel parser matches serial parser") {
+  std::string content = "Camera \"perspective\"\n"
+                        "    \"float fov\" [ 30 ]\n"
+                        "WorldBegin\n";
+  for (int m = 0; m < 3; m++) {
+    content += "MakeNamedMaterial \"m" + std::to_string(m) + "\"\n" +
+               "    \"string type\" [ \"diffuse\" ]\n" +
+               "    \"rgb reflectance\" [ 0." + std::to_string(m) +
+               " 0.5 0.5 ]\n";
+  }
+  for (int i = 0; i < 300; i++) {
+    std::string shape = "Shape \"trianglemesh\"\n"
+                        "    \"point3 P\" [ 0 0 " +
+                        std::to_string(i) +
+                        " 1 0 0 0 1 -2.5e-3 ]\n"
+                        "    \"integer indices\" [ 0 1 2 ]\n";
+    if (i % 3 == 0) {
+      content += "NamedMaterial \"m" + std::to_string(i % 2) + "\"\n" + shape;
+    } else if (i % 3 == 1) {
+      content += shape;
+    } else {
+      content += "AttributeBegin\n"
+                 "    AreaLightSource \"diffuse\"\n"
+                 "        \"rgb L\" [ 1 2 3 ]\n"
+                 "    NamedMaterial \"m2\"\n    " +
+                 shape + "AttributeEnd\n";
+    }
+  }
+  // one list big enough to be split across threads
+  content += "Shape \"trianglemesh\"\n    \"point3 P\" [ ";
+  for (int i = 0; i < 300000; i++) {
+    content += std::to_string(i * 0.25f) + (i % 10 == 9 ? "\n" : " ");
+  }
+  content += "]\n";
+
+  Tokenizer tokenizer(content);
+  auto serial = Parser(tokenizer).parse();
+  auto parallel = parse_parallel(content, 4, 512);
+
+  REQUIRE(serial.shapes.size() == 301);
+  REQUIRE(std::get<TriangleMeshShapeData>(serial.shapes.back().data)
+              .positions.size() == 300000);
+  require_same_scene(serial, parallel);
+}
+
+namespace {
+
+// A path under the temp directory that no other test or run shares, removed
+// with everything below it once it goes out of scope, also when a REQUIRE
+// fails. The random part goes first so extensions in `name` stay last.
+struct TempPath {
+  std::filesystem::path path;
+
+  explicit TempPath(const std::string &name) {
+    std::random_device device;
+    path = std::filesystem::temp_directory_path() /
+           ("flow_" + std::to_string(device()) + std::to_string(device()) +
+            "_" + name);
+  }
+  TempPath(const TempPath &) = delete;
+  TempPath &operator=(const TempPath &) = delete;
+  ~TempPath() {
+    std::error_code error;
+    std::filesystem::remove_all(path, error);
+  }
+};
+
+} // namespace
+
+TEST_CASE("test scene cache round trip") {
+  auto source =
+      SceneSource::map_file("../../../assets/cornell-box/scene-v4.pbrt");
+  REQUIRE(source.has_value());
+  Tokenizer tokenizer(source->view());
+  auto scene = Parser(tokenizer).parse();
+
+  TempPath temp("test.scene");
+  auto &path = temp.path;
+  auto hash = hash_scene_source(source->view());
+  REQUIRE(SceneCache::write(path.c_str(), scene, hash));
+
+  REQUIRE_FALSE(SceneCache::open(path.c_str(), hash + 1).has_value());
+  auto cache = SceneCache::open(path.c_str(), hash);
+  REQUIRE(cache.has_value());
+  REQUIRE(cache->shapes().size() == scene.shapes.size());
+  auto floor = cache->array<float>(cache->shapes()[0].positions);
+  REQUIRE(floor.size() == 12);
+  REQUIRE(floor[1] == 1.74846e-7f);
+
+  auto cached = cache->to_scene_data();
+  require_same_scene(scene, cached);
+  REQUIRE(cached.sampler.samples == 64);
+  REQUIRE(cached.transform == scene.transform);
+}
+
+TEST_CASE("test plymesh loads binary ply") {
+  TempPath temp("ply");
+  auto &directory = temp.path;
+  std::filesystem::create_directories(directory);
+  {
+    std::ofstream out(directory / "flow_test.ply", std::ios::binary);
+    out << "ply\n"
+           "format binary_little_endian 1.0\n"
+           "comment two faces, a quad and a triangle\n"
+           "element vertex 5\n"
+           "property float x\nproperty float y\nproperty float z\n"
+           "property float nx\nproperty float ny\nproperty float nz\n"
+           "property float u\nproperty float v\n"
+           "element face 2\n"
+           "property list uchar ushort vertex_indices\n"
+           "end_header\n";
+    for (int i = 0; i < 5; i++) {
+      float vertex[8] = {float(i), 1, 2, 0, 0, 1, 0.5f, float(i) / 4};
+      out.write(reinterpret_cast<const char *>(vertex), sizeof(vertex));
+    }
+    uint8_t quad = 4;
+    uint16_t quad_indices[4] = {0, 1, 2, 3};
+    out.write(reinterpret_cast<const char *>(&quad), 1);
+    out.write(reinterpret_cast<const char *>(quad_indices), 8);
+    uint8_t triangle = 3;
+    uint16_t triangle_indices[3] = {4, 3, 2};
+    out.write(reinterpret_cast<const char *>(&triangle), 1);
+    out.write(reinterpret_cast<const char *>(triangle_indices), 6);
+  }
+
+  std::string_view content = "WorldBegin\n"
+                             "Shape \"plymesh\"\n"
+                             "    \"string filename\" [ \"flow_test.ply\" ]\n";
+  Tokenizer tokenizer(content);
+  Parser parser(tokenizer);
+  parser.base_directory = directory;
+  auto scene = parser.parse();
+
+  REQUIRE(scene.shapes.size() == 1);
+  auto &mesh = std::get<TriangleMeshShapeData>(scene.shapes[0].data);
+  REQUIRE(mesh.positions.size() == 15);
+  REQUIRE(mesh.positions[12] == 4.0f);
+  REQUIRE(mesh.normals.size() == 15);
+  REQUIRE(mesh.uvs.size() == 10);
+  REQUIRE(mesh.uvs[9] == 1.0f);
+  REQUIRE(std::ranges::equal(mesh.indices,
+                             std::vector<int>{0, 1, 2, 0, 2, 3, 4, 3, 2}));
+
+  // faces may come before the vertices they index
+  {
+    std::ofstream out(directory / "flow_test.ply", std::ios::binary);
+    out << "ply\n"
+           "format binary_little_endian 1.0\n"
+           "element face 1\n"
+           "property list uchar int vertex_indices\n"
+           "element vertex 3\n"
+           "property float x\nproperty float y\nproperty float z\n"
+           "end_header\n";
+    uint8_t corners = 3;
+    int32_t indices[3] = {2, 1, 0};
+    out.write(reinterpret_cast<const char *>(&corners), 1);
+    out.write(reinterpret_cast<const char *>(indices), sizeof(indices));
+    float positions[9] = {0, 0, 0, 1, 0, 0, 0, 1, 0};
+    out.write(reinterpret_cast<const char *>(positions), sizeof(positions));
+  }
+  TriangleMeshShapeData faces_first;
+  REQUIRE(load_ply_mesh((directory / "flow_test.ply").c_str(), faces_first));
+  REQUIRE(std::ranges::equal(faces_first.indices, std::vector<int>{2, 1, 0}));
+  REQUIRE(faces_first.positions.size() == 9);
+}
+
+TEST_CASE("test include and import") {
+  TempPath temp("include");
+  auto &directory = temp.path;
+  std::filesystem::create_directories(directory);
+  auto write = [&](const char *name, std::string_view content) {
+    std::ofstream(directory / name) << content;
+  };
+  auto shape = [](int z) {
+    return "Shape \"trianglemesh\"\n"
+           "    \"point3 P\" [ 0 0 " +
+           std::to_string(z) + " 1 0 0 0 1 0 ]\n" +
+           "    \"integer indices\" [ 0 1 2 ]\n";
+  };
+  auto material = [](const char *name) {
+    return std::string("MakeNamedMaterial \"") + name +
+           "\"\n    \"string type\" [ \"diffuse\" ]\n"
+           "    \"rgb reflectance\" [ 0.5 0.5 0.5 ]\n";
+  };
+  write("imported.pbrt", material("c") + "NamedMaterial \"c\"\n" + shape(1));
+  write("included.pbrt", material("b") + "NamedMaterial \"b\"\n" + shape(3));
+  write("main.pbrt", "WorldBegin\n" + material("a") + "NamedMaterial \"a\"\n" +
+                         shape(0) + "Import \"imported.pbrt\"\n" + shape(2) +
+                         "Include \"included.pbrt\"\n" + shape(4));
+
+  auto scene = load_scene(directory / "main.pbrt", 4);
+
+  REQUIRE(scene.materials.size() == 3);
+  REQUIRE(scene.shapes.size() == 5);
+  // the imported NamedMaterial stays inside the import, the included one
+  // carries over
+  std::vector<std::string_view> materials = {"a", "c", "a", "b", "b"};
+  for (size_t i = 0; i < scene.shapes.size(); i++) {
+    auto &mesh = std::get<TriangleMeshShapeData>(scene.shapes[i].data);
+    REQUIRE(mesh.positions[2] == float(i));
+    REQUIRE(scene.material_name(scene.shapes[i].material) == materials[i]);
+  }
+
+  // more imports than pool threads, each importing another file, still
+  // merge in directive order
+  std::string many = "WorldBegin\n";
+  for (int i = 0; i < 32; i++) {
+    auto name = "nested" + std::to_string(i) + ".pbrt";
+    write(name.c_str(), shape(2 * i) + "Import \"imported.pbrt\"\n");
+    many += "Import \"" + name + "\"\n";
+  }
+  write("many.pbrt", many);
+  auto nested = load_scene(directory / "many.pbrt", 2);
+  REQUIRE(nested.shapes.size() == 64);
+  for (size_t i = 0; i < nested.shapes.size(); i++) {
+    auto &mesh = std::get<TriangleMeshShapeData>(nested.shapes[i].data);
+    REQUIRE(mesh.positions[2] == float(i % 2 ? 1 : i));
+  }
+
+  // a failed import reaches the caller instead of ending the process
+  write("broken.pbrt", shape(0) + "Unknown \"x\"\n");
+  write("imports_broken.pbrt", "WorldBegin\nImport \"broken.pbrt\"\n");
+  REQUIRE_THROWS_AS(load_scene(directory / "imports_broken.pbrt", 2),
+                    ParseError);
+}
+
+TEST_CASE("test object instancing") {
+  auto translate = [](int x) {
+    return "    Transform [ 1 0 0 0 0 1 0 0 0 0 1 0 " + std::to_string(x) +
+           " 0 0 1 ]\n";
+  };
+  std::string content =
+      "WorldBegin\n"
+      "ObjectBegin \"quad\"\n"
+      "  Shape \"trianglemesh\"\n"
+      "    \"point3 P\" [ -1 -1 0 1 -1 0 1 1 0 -1 1 0 ]\n"
+      "    \"integer indices\" [ 0 1 2 0 2 3 ]\n"
+      "ObjectEnd\n"
+      "AttributeBegin\n" +
+      translate(10) +
+      "  ObjectInstance \"quad\"\n"
+      "AttributeEnd\n"
+      "AttributeBegin\n" +
+      translate(-10) +
+      "  ObjectInstance \"quad\"\n"
+      "  Shape \"trianglemesh\"\n"
+      "    \"point3 P\" [ 0 -1 -5 2 -1 -5 0 1 -5 ]\n"
+      "    \"integer indices\" [ 0 1 2 ]\n"
+      "AttributeEnd\n";
+  Tokenizer tokenizer(content);
+  Parser parser(tokenizer);
+  auto scene = parser.parse();
+
+  REQUIRE(scene.objects.size() == 1);
+  REQUIRE(scene.instances.size() == 2);
+  REQUIRE(scene.instances[0].transform[12] == 10.0f);
+  REQUIRE(scene.instances[1].transform[12] == -10.0f);
+  // plain shapes are moved to world space while parsing
+  auto &mesh = std::get<TriangleMeshShapeData>(scene.shapes[0].data);
+  REQUIRE(mesh.positions[0] == -10.0f);
+
+  auto bvh = Flow::SceneBvh::build(scene);
+  // the quad is stored once for both instances
+  REQUIRE(bvh.meshes.size() == 2);
+  REQUIRE(bvh.instances.size() == 3);
+
+  auto cast = [&](float x, float y = 0.5f) {
+    return bvh.intersect(Flow::Ray{.origin = Flow::Vec3f(x, y, 10.0f),
+                                   .direction = Flow::Vec3f(0, 0, -1)});
+  };
+  auto right = cast(10.5f);
+  REQUIRE(right.has_value());
+  REQUIRE(right->t == 10.0f);
+  REQUIRE(bvh.instances[right->instance].object_to_world[12] == 10.0f);
+  auto left = cast(-10.5f);
+  REQUIRE(left.has_value());
+  REQUIRE(bvh.instances[left->instance].object_to_world[12] == -10.0f);
+  auto shape = cast(-9.5f);
+  REQUIRE(shape.has_value());
+  REQUIRE(shape->t == 10.0f);
+  auto behind = cast(-8.5f, -0.8f);
+  REQUIRE(behind.has_value());
+  REQUIRE(std::abs(behind->t - 15.0f) < 1e-5f);
+  REQUIRE(bvh.instances[behind->instance].mesh == 0);
+  REQUIRE(!cast(0.0f).has_value());
+  auto shadow = [&](float x, float t_max) {
+    return bvh.occluded(Flow::Ray{.origin = Flow::Vec3f(x, 0.5f, 10.0f),
+                                  .direction = Flow::Vec3f(0, 0, -1)},
+                        0.0f, t_max);
+  };
+  REQUIRE(shadow(10.5f, 10.5f));
+  REQUIRE(!shadow(10.5f, 9.5f));
+  REQUIRE(!shadow(0.0f, 100.0f));
+
+  TempPath temp("instances.scene");
+  auto &cache_path = temp.path;
+  REQUIRE(SceneCache::write(cache_path.c_str(), scene, 1));
+  auto cache = SceneCache::open(cache_path.c_str(), 1);
+  REQUIRE(cache.has_value());
+  auto cached = cache->to_scene_data();
+  REQUIRE(cached.objects.at("quad").shapes.size() == 1);
+  REQUIRE(cached.instances.size() == 2);
+  REQUIRE(cached.instances[1].transform == scene.instances[1].transform);
+}
+
+TEST_CASE("test scene lowering") {
+  std::string content =
+      "WorldBegin\n"
+      "MakeNamedMaterial \"red\"\n"
+      "    \"string type\" [ \"diffuse\" ]\n"
+      "    \"rgb reflectance\" [ 1 0 0 ]\n"
+      "ObjectBegin \"triangle\"\n"
+      "  Shape \"trianglemesh\"\n"
+      "    \"point3 P\" [ 0 0 0 1 0 0 0 1 0 ]\n"
+      "    \"normal N\" [ 0 0 1 0 0 1 0 0 1 ]\n"
+      "    \"integer indices\" [ 0 1 2 ]\n"
+      "ObjectEnd\n"
+      "AttributeBegin\n"
+      "  AreaLightSource \"diffuse\" \"rgb L\" [ 4 4 4 ]\n"
+      "  Shape \"trianglemesh\"\n"
+      "    \"point3 P\" [ 0 0 0 1 0 0 0 1 0 ]\n"
+      "    \"integer indices\" [ 0 1 2 ]\n"
+      "AttributeEnd\n"
+      "NamedMaterial \"red\"\n"
+      "Shape \"trianglemesh\"\n"
+      "    \"point3 P\" [";
+  // large enough to be copied in several pieces
+  const int strip = 100000;
+  for (int v = 0; v < strip + 2; v++) {
+    content += " " + std::to_string(v / 2) + " " + std::to_string(v % 2) +
+               " 0";
+  }
+  content += " ]\n    \"integer indices\" [";
+  for (int t = 0; t < strip; t++) {
+    content += " " + std::to_string(t) + " " + std::to_string(t + 1) + " " +
+               std::to_string(t + 2);
+  }
+  content += " ]\n"
+             "AttributeBegin\n"
+             "  Transform [ 0 1 0 0 -1 0 0 0 0 0 1 0 5 0 0 1 ]\n"
+             "  ObjectInstance \"triangle\"\n"
+             "AttributeEnd\n";
+  Tokenizer tokenizer(content);
+  Parser parser(tokenizer);
+  auto scene = parser.parse();
+
+  auto ir = Flow::lower_scene(scene, 4);
+  REQUIRE(ir.meshes.size() == 3);
+  REQUIRE(ir.positions.size() == 3 + strip + 2 + 3);
+  REQUIRE(ir.normals.size() == ir.positions.size());
+  REQUIRE(ir.indices.size() == 3 * (strip + 2));
+
+  // the strip and instance use "red", the light the default appended after it
+  REQUIRE(ir.materials.size() == 2);
+  REQUIRE(ir.meshes[0].material == 1);
+  REQUIRE(ir.meshes[1].material == 0);
+  REQUIRE(ir.materials[0].reflectance == std::array<float, 3>{1, 0, 0});
+  REQUIRE(ir.emitters.size() == 1);
+  REQUIRE(ir.emitters[0].mesh == 0);
+  REQUIRE(ir.meshes[0].emitter == 0);
+  REQUIRE(ir.meshes[1].emitter == -1);
+
+  auto &strip_mesh = ir.meshes[1];
+  REQUIRE(strip_mesh.first_vertex == 3);
+  REQUIRE(ir.indices[strip_mesh.first_index + 3 * (strip - 1)] ==
+          3 + strip - 1);
+  REQUIRE(ir.positions[3 + strip + 1].x == float((strip + 1) / 2));
+
+  // the instance is rotated a quarter turn about z and moved to x = 5
+  auto &instance = ir.meshes[2];
+  auto moved = ir.positions[instance.first_vertex + 1];
+  REQUIRE(moved.x == 5.0f);
+  REQUIRE(moved.y == 1.0f);
+  REQUIRE(ir.normals[instance.first_vertex].z == 1.0f);
+  REQUIRE(ir.indices[instance.first_index] == instance.first_vertex);
+
+  auto serial = Flow::lower_scene(scene, 1);
+  REQUIRE(std::equal(ir.positions.begin(), ir.positions.end(),
+                     serial.positions.begin(), [](auto &a, auto &b) {
+                       return a.x == b.x && a.y == b.y && a.z == b.z;
+                     }));
+  REQUIRE(serial.indices == ir.indices);
+}
+
+TEST_CASE("test scene data is allocated from one arena") {
+  std::string content = "WorldBegin\n";
+  for (int i = 0; i < 50; i++) {
+    content += "Shape \"trianglemesh\"\n"
+               "    \"point3 P\" [ 0 0 0 1 0 0 0 1 0 ]\n"
+               "    \"integer indices\" [ 0 1 2 ]\n";
+  }
+  auto scene = parse_parallel(content, 4, 256);
+
+  // the chunks shared the arena, so nothing had to be kept alive separately
+  REQUIRE(scene.shapes.size() == 50);
+  REQUIRE(scene.retained_arenas.empty());
+  for (auto &shape : scene.shapes) {
+    auto &mesh = std::get<TriangleMeshShapeData>(shape.data);
+    REQUIRE(mesh.positions.get_allocator().resource() == scene.arena.get());
+  }
+  size_t array_bytes = 50 * (9 * sizeof(float) + 3 * sizeof(int));
+  REQUIRE(scene.arena->used_bytes() >= array_bytes);
+  REQUIRE(scene.arena->peak_bytes() >= scene.arena->used_bytes());
+  REQUIRE(scene.arena->reserved_bytes() >= scene.arena->peak_bytes());
+
+  // appending a scene from another arena keeps that arena alive
+  Tokenizer tokenizer(content);
+  scene.append(Parser(tokenizer).parse());
+  REQUIRE(scene.retained_arenas.size() == 1);
+  auto &mesh = std::get<TriangleMeshShapeData>(scene.shapes.back().data);
+  REQUIRE(mesh.positions.get_allocator().resource() ==
+          scene.retained_arenas[0].get());
+  REQUIRE(mesh.positions[3] == 1.0f);
+}
+
+TEST_CASE("test scene names outlive the source") {
+  std::string content = "Integrator \"volpath\" \"integer maxdepth\" [ 4 ]\n"
+                        "Film \"rgb\" \"string filename\" [ \"out.exr\" ]\n"
+                        "WorldBegin\n"
+                        "NamedMaterial \"late\"\n"
+                        "Shape \"trianglemesh\"\n"
+                        "    \"point3 P\" [ 0 0 0 1 0 0 0 1 0 ]\n"
+                        "    \"integer indices\" [ 0 1 2 ]\n"
+                        "MakeNamedMaterial \"grey\"\n"
+                        "    \"string type\" [ \"diffuse\" ]\n"
+                        "    \"rgb reflectance\" [ 0.5 0.5 0.5 ]\n"
+                        "MakeNamedMaterial \"late\"\n"
+                        "    \"string type\" [ \"diffuse\" ]\n"
+                        "    \"rgb reflectance\" [ 1 0 0 ]\n"
+                        "NamedMaterial \"grey\"\n"
+                        "Shape \"trianglemesh\"\n"
+                        "    \"point3 P\" [ 0 0 0 1 0 0 0 1 0 ]\n"
+                        "    \"integer indices\" [ 0 1 2 ]\n";
+  auto serial = [&] {
+    Tokenizer tokenizer(content);
+    return Parser(tokenizer).parse();
+  }();
+  auto parallel = parse_parallel(content, 4, 64);
+  std::fill(content.begin(), content.end(), '#');
+
+  for (auto *scene : {&serial, &parallel}) {
+    REQUIRE(scene->integrator.kind == "volpath");
+    REQUIRE(scene->film.filename == "out.exr");
+    // ids follow first mention; a material may be used before it is made
+    REQUIRE(scene->material_names.size() == 2);
+    REQUIRE(scene->material_names[0] == "late");
+    REQUIRE(scene->shapes[0].material == 0);
+    REQUIRE(scene->shapes[1].material == 1);
+    auto &late = std::get<DiffuseMaterialData>(scene->materials[0]->data);
+    REQUIRE(late.reflectance == std::array<float, 3>{1, 0, 0});
+  }
+  REQUIRE(serial.intern("grey").data() == serial.material_names[1].data());
+}
+
+TEST_CASE("test directive and parameter tables") {
+  static_assert(DIRECTIVES.find("WorldBegin") == Directive::WorldBegin);
+  static_assert(!DIRECTIVES.find("WorldBegi"));
+  for (auto &[name, directive] : DIRECTIVES.names()) {
+    REQUIRE(find_directive(name) == directive);
+    REQUIRE(find_directive(std::string(name) + "s") == Directive::Unknown);
+  }
+  for (auto &[declaration, parameter] : PARAMETERS.names()) {
+    REQUIRE(find_parameter(declaration) == parameter);
+  }
+  // the type is part of the declaration
+  REQUIRE(find_parameter("float maxdepth") == Parameter::Unknown);
+  REQUIRE(find_parameter("") == Parameter::Unknown);
+
+  // unknown parameters are skipped along with their values
+  std::string_view content = "Camera \"perspective\" \"float lensradius\" "
+                             "[ 0.5 ] \"float fov\" [ 30 ]\n"
+                             "WorldBegin\n";
+  Tokenizer tokenizer(content);
+  auto scene = Parser(tokenizer).parse();
+  REQUIRE(scene.camera.fov == 30.0f);
+}
+
+TEST_CASE("test deferred mesh attributes") {
+  TempPath temp("deferred");
+  auto &directory = temp.path;
+  std::filesystem::create_directories(directory);
+  std::ofstream(directory / "scene.pbrt")
+      << "WorldBegin\n"
+         "AttributeBegin\n"
+         "  Transform [ 0 1 0 0 -1 0 0 0 0 0 1 0 5 0 0 1 ]\n"
+         "  Shape \"trianglemesh\"\n"
+         "    \"point2 uv\" [ 0 0 1 0 0 1 ]\n"
+         "    \"normal N\" [ 1 0 0 1 0 0 0 0 1 ]\n"
+         "    \"point3 P\" [ 0 0 0 1 0 0 0 1 0 ]\n"
+         "    \"integer indices\" [ 0 1 2 ]\n"
+         "AttributeEnd\n";
+  auto eager = load_scene(directory / "scene.pbrt", 2);
+  auto scene = load_scene(directory / "scene.pbrt", 2, true);
+
+  // positions are converted right away, uv and N only recorded
+  auto &mesh = std::get<TriangleMeshShapeData>(scene.shapes[0].data);
+  REQUIRE(mesh.positions[0] == 5.0f);
+  REQUIRE(mesh.uvs.empty());
+  REQUIRE(mesh.normals.empty());
+  REQUIRE(mesh.deferred_uvs->count == 6);
+  REQUIRE(mesh.deferred_normals->count == 9);
+  REQUIRE(scene.sources.size() == 1);
+
+  // the transform of the shape still reaches its normals
+  scene.load_attributes(MeshAttribute::Normal);
+  auto &expected = std::get<TriangleMeshShapeData>(eager.shapes[0].data);
+  REQUIRE(mesh.normals == expected.normals);
+  REQUIRE(mesh.normals[1] == 1.0f);
+  REQUIRE(!mesh.deferred_normals);
+  REQUIRE(scene.has_deferred_attributes());
+  REQUIRE(scene.sources.size() == 1);
+
+  scene.load_attributes(MeshAttribute::Uv);
+  REQUIRE(mesh.uvs == expected.uvs);
+  REQUIRE(!scene.has_deferred_attributes());
+  REQUIRE(scene.sources.empty());
+}
+
+TEST_CASE("test streamed and compressed scenes") {
+  auto source =
+      SceneSource::map_file("../../../assets/cornell-box/scene-v4.pbrt");
+  REQUIRE(source.has_value());
+  auto text = source->view();
+  Tokenizer tokenizer(text);
+  auto expected = Parser(tokenizer).parse();
+
+  // blocks far smaller than a statement cut lists, strings and names apart
+  for (size_t block_size : {7, 100, 4096}) {
+    size_t offset = 0;
+    auto scene = parse_blocks(
+        [&](std::string &block) {
+          block = text.substr(offset, block_size);
+          offset += block.size();
+          return !block.empty();
+        },
+        2);
+    require_same_scene(expected, scene);
+  }
+
+  // lists spanning many blocks are converted while they arrive
+  std::string mesh = "WorldBegin\n"
+                     "AttributeBegin\n"
+                     "  Transform [ 1 0 0 0 0 1 0 0 0 0 1 0 2 0 0 1 ]\n"
+                     "  Shape \"trianglemesh\"\n"
+                     "    \"point3 P\" [ ";
+  for (int i = 0; i < 60000; i++) {
+    mesh += std::to_string(i * 0.125f) + (i % 10 == 9 ? "\n" : " ");
+  }
+  mesh += "]\n    \"integer indices\" [ ";
+  for (int i = 0; i < 60000; i++) {
+    mesh += std::to_string(i % 20000) + " ";
+  }
+  mesh += "]\nAttributeEnd\n"
+          "Shape \"trianglemesh\"\n"
+          "    \"point3 P\" [ 0 0 0 1 0 0 0 1 0 ]\n"
+          "    \"integer indices\" [ 0 1 2 ]\n";
+  Tokenizer mesh_tokenizer(mesh);
+  auto expected_mesh = Parser(mesh_tokenizer).parse();
+  REQUIRE(std::get<TriangleMeshShapeData>(expected_mesh.shapes[0].data)
+              .indices.size() == 60000);
+  for (size_t block_size : {1000, 4096, 1 << 20}) {
+    size_t offset = 0;
+    auto scene = parse_blocks(
+        [&](std::string &block) {
+          block = std::string_view(mesh).substr(offset, block_size);
+          offset += block.size();
+          return !block.empty();
+        },
+        2);
+    require_same_scene(expected_mesh, scene);
+  }
+
+  TempPath temp("test.pbrt.gz");
+  auto &path = temp.path;
+  gzFile file = gzopen(path.c_str(), "wb");
+  REQUIRE(file);
+  REQUIRE(gzwrite(file, text.data(), unsigned(text.size())) ==
+          int(text.size()));
+  gzclose(file);
+  require_same_scene(expected, load_scene(path, 2));
+
+  auto stream = GzipStream::open(path.c_str(), 1000);
+  std::string block;
+  std::string decompressed;
+  while (stream->next(block)) {
+    REQUIRE(block.size() <= 1000);
+    decompressed += block;
+  }
+  REQUIRE(!stream->failed());
+  REQUIRE(decompressed == text);
+
+  // a file cut off in the middle of the stream is an error
+  auto compressed = std::filesystem::file_size(path);
+  std::filesystem::resize_file(path, compressed / 2);
+  stream = GzipStream::open(path.c_str(), 1000);
+  while (stream->next(block)) {
+  }
+  REQUIRE(stream->failed());
+}
+
+template <int N> void require_wide_matches_scalar() {
+  using namespace Flow;
+  auto same = [](const Vec3f &a, const Vec3f &b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+  };
+  Vec3fN<N> a;
+  Vec3fN<N> b;
+  for (int i = 0; i < N; i++) {
+    a.set(i, Vec3f(float(i), 1.0f - i, 0.5f * i));
+    b.set(i, Vec3f(2.0f, float(i % 3), -1.0f));
+  }
+  auto dot = a.dot(b);
+  auto cross = a.cross(b);
+  auto sum = a + b;
+  auto lower = a.min(b);
+  auto closer = a.x < b.x;
+  auto picked = select(closer, a, b);
+  for (int i = 0; i < N; i++) {
+    REQUIRE(dot[i] == a[i].dot(b[i]));
+    REQUIRE(same(cross[i], a[i].cross(b[i])));
+    REQUIRE(same(sum[i], a[i] + b[i]));
+    REQUIRE(same(lower[i], a[i].min(b[i])));
+    REQUIRE(closer[i] == (a[i].x < b[i].x));
+    REQUIRE(same(picked[i], closer[i] ? a[i] : b[i]));
+  }
+  // lanes 0 and 1 have x below 2
+  REQUIRE(closer.bits() == 3);
+  REQUIRE(closer.any());
+  REQUIRE(!closer.all());
+  REQUIRE(MaskN<N>(true).all());
+}
+
+TEST_CASE("test wide vectors match scalar math") {
+  require_wide_matches_scalar<4>();
+  require_wide_matches_scalar<8>();
+  require_wide_matches_scalar<16>();
+
+  Flow::Vec4f a(1, 2, 3, 4);
+  Flow::Vec4f b(Flow::Vec3f(-1, 0.5, 2), 1);
+  REQUIRE(a.dot(b) == 10.0f);
+  auto c = a.min(b) + a * 2.0f;
+  REQUIRE(c.x == 1.0f);
+  REQUIRE(c.y == 4.5f);
+  REQUIRE(c.w == 9.0f);
+}
+
+TEST_CASE("test affine transforms") {
+  using namespace Flow;
+  auto near = [](const Vec3f &a, const Vec3f &b) {
+    return (a - b).length() < 1e-4f;
+  };
+  // rotation about z, non-uniform scale and a translation
+  Transform3 transform(Vec3f(0, 2, 0), Vec3f(-3, 0, 0), Vec3f(0, 0, 0.5),
+                       Vec3f(1, 2, 3));
+  auto inverse = transform.inverse();
+  Vec3f p(0.25f, -4, 7);
+  REQUIRE(near(inverse.point(transform.point(p)), p));
+  REQUIRE(near(Transform3(transform.to_matrix()).point(p),
+               transform.point(p)));
+
+  // normals stay perpendicular to transformed tangents
+  Vec3f tangent(1, 1, 0);
+  Vec3f normal(1, -1, 2);
+  REQUIRE(std::abs(transform.vector(tangent).dot(transform.normal(normal))) <
+          1e-5f);
+
+  // the bulk routines agree with the per point ones, tail included
+  std::pmr::vector<float> positions;
+  for (int i = 0; i < 3 * 21; i++) {
+    positions.push_back(float(i % 7) - 3.0f);
+  }
+  auto mesh = ShapeData::make_triangle_mesh();
+  auto &data = std::get<TriangleMeshShapeData>(mesh.data);
+  data.positions = positions;
+  data.normals = positions;
+  apply_transform(data, transform, 2);
+  for (size_t i = 0; i < positions.size(); i += 3) {
+    Vec3f v(positions[i], positions[i + 1], positions[i + 2]);
+    Vec3f p(data.positions[i], data.positions[i + 1], data.positions[i + 2]);
+    Vec3f n(data.normals[i], data.normals[i + 1], data.normals[i + 2]);
+    REQUIRE(near(p, transform.point(v)));
+    REQUIRE(near(n, transform.normal(v)));
+  }
+
+  // a singular transform has no inverse
+  Transform3 flat(Vec3f(1, 0, 0), Vec3f(0, 1, 0), Vec3f(0, 0, 0), Vec3f());
+  REQUIRE(near(flat.inverse().point(p), Vec3f()));
+}
+
+TEST_CASE("test watertight triangle intersection") {
+  using namespace Flow;
+  // a skewed quad split along its diagonal from p0 to p2
+  Vec3f p0(-1.3f, -0.7f, 0.1f);
+  Vec3f p1(1.1f, -0.9f, -0.2f);
+  Vec3f p2(0.9f, 1.7f, 0.3f);
+  Vec3f p3(-1.1f, 0.8f, 0.05f);
+  float t, u, v;
+  int misses = 0;
+  for (int i = 1; i < 1000; i++) {
+    // points along the shared edge, hit from a spread of directions
+    auto target = p0 + (p2 - p0) * (i / 1000.0f);
+    auto origin = Vec3f(0.37f * (i % 7) - 1, 0.21f * (i % 5) - 0.4f, 3.0f);
+    Ray ray{.origin = origin, .direction = target - origin};
+    TriangleRay triangle_ray(ray);
+    bool first = intersect_triangle(triangle_ray, p0, p1, p2, 2.0f, t, u, v);
+    bool second = intersect_triangle(triangle_ray, p0, p2, p3, 2.0f, t, u, v);
+    misses += !first && !second;
+  }
+  REQUIRE(misses == 0);
+
+  Ray ray{.origin = Vec3f(0, 0, 2), .direction = Vec3f(0, 0, -1)};
+  TriangleRay down(ray);
+  REQUIRE(intersect_triangle(down, p0, p1, p2, 10.0f, t, u, v));
+  auto p = p0 * (1 - u - v) + p1 * u + p2 * v;
+  REQUIRE(std::abs(p.x) < 1e-5f);
+  REQUIRE(std::abs(p.y) < 1e-5f);
+  // hits at or beyond t_max do not count
+  REQUIRE(!intersect_triangle(down, p0, p1, p2, t, t, u, v));
+
+  // a ray leaving the surface it starts on does not hit it again
+  Ray away{.origin = p, .direction = Vec3f(0.3f, 0.1f, 1)};
+  REQUIRE(!intersect_triangle(TriangleRay(away), p0, p1, p2, 10.0f, t, u, v));
+
+  // degenerate triangles are never hit
+  REQUIRE(!intersect_triangle(down, p0, p1, p1, 10.0f, t, u, v));
+}
+
+namespace {
+
+// Clusters of small random triangles, which a median split handles badly.
+TriangleMeshShapeData make_clustered_mesh(int clusters, int per_cluster) {
+  using namespace Flow;
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+  std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+  TriangleMeshShapeData mesh;
+  for (int cluster = 0; cluster < clusters; cluster++) {
+    Vec3f center(position(rng), position(rng), position(rng));
+    for (int i = 0; i < per_cluster; i++) {
+      for (int k = 0; k < 3; k++) {
+        mesh.indices.push_back(mesh.positions.size() / 3);
+        mesh.positions.push_back(center.x + offset(rng));
+        mesh.positions.push_back(center.y + offset(rng));
+        mesh.positions.push_back(center.z + offset(rng));
+      }
+    }
+  }
+  return mesh;
+}
+
+// Casts `rays` through `bvh` and compares with testing every triangle.
+void require_matches_linear_scan(const Flow::MeshBvh &bvh,
+                                 const std::vector<Flow::Ray> &rays) {
+  using namespace Flow;
+  auto &mesh = *bvh.mesh;
+  auto vertex = [&](int index) {
+    auto *p = mesh.positions.data() + 3 * index;
+    return Vec3f(p[0], p[1], p[2]);
+  };
+  for (auto &ray : rays) {
+    float expected = INFINITY;
+    TriangleRay triangle_ray(ray);
+    for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+      float t, u, v;
+      if (intersect_triangle(triangle_ray, vertex(mesh.indices[i]),
+                             vertex(mesh.indices[i + 1]),
+                             vertex(mesh.indices[i + 2]), expected, t, u, v)) {
+        expected = t;
+      }
+    }
+    float t_max = INFINITY;
+    Hit hit;
+    bool found = bvh.intersect(ray, t_max, hit);
+    REQUIRE(found == (expected != INFINITY));
+    if (found) {
+      REQUIRE(hit.t == expected);
+    }
+  }
+}
+
+// Casts random rays through `bvh` and compares with testing every triangle.
+void require_matches_linear_scan(const Flow::MeshBvh &bvh, int count) {
+  using namespace Flow;
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+  std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+  std::vector<Ray> rays;
+  for (int r = 0; r < count; r++) {
+    rays.push_back(
+        Ray{.origin = Vec3f(position(rng), position(rng), position(rng)),
+            .direction = Vec3f(offset(rng), offset(rng), offset(rng))});
+  }
+  require_matches_linear_scan(bvh, rays);
+}
+
+} // namespace
+
+TEST_CASE("test bvh matches a linear scan") {
+  auto mesh = make_clustered_mesh(20, 100);
+  auto bvh = Flow::MeshBvh::build(mesh);
+  for (auto &node : bvh.bvh.nodes) {
+    REQUIRE(node.count <= 8);
+  }
+  require_matches_linear_scan(bvh, 500);
+}
+
+TEST_CASE("test parallel and preview bvh builds") {
+  // large enough for the top nodes to be built on several threads
+  auto mesh = make_clustered_mesh(64, 1000);
+  auto serial = Flow::MeshBvh::build(mesh);
+  auto parallel = Flow::MeshBvh::build(mesh, 4);
+  REQUIRE(parallel.bvh.nodes.size() == serial.bvh.nodes.size());
+  REQUIRE(parallel.bvh.sah_cost() == serial.bvh.sah_cost());
+  require_matches_linear_scan(parallel, 50);
+
+  auto preview = Flow::MeshBvh::build(mesh, 4, true);
+  auto serial_preview = Flow::MeshBvh::build(mesh, 1, true);
+  REQUIRE(preview.bvh.primitives == serial_preview.bvh.primitives);
+  REQUIRE(preview.bvh.nodes.size() == serial_preview.bvh.nodes.size());
+  // the preview trades tracing cost for build time
+  REQUIRE(preview.bvh.sah_cost() > serial.bvh.sah_cost());
+  require_matches_linear_scan(preview, 50);
+}
+
+TEST_CASE("test wide bvh matches a linear scan") {
+  using namespace Flow;
+  auto mesh = make_clustered_mesh(20, 100);
+  // coincident triangles, which still have to end up in small leaves
+  for (int i = 0; i < 40; i++) {
+    int first = mesh.positions.size() / 3;
+    mesh.positions.insert(mesh.positions.end(),
+                          {20, 20, 20, 21, 20, 20, 20, 21, 20});
+    mesh.indices.insert(mesh.indices.end(), {first, first + 1, first + 2});
+  }
+  auto four = MeshBvh::build(mesh, 1, false, BvhWidth::Four);
+  auto eight = MeshBvh::build(mesh, 1, false, BvhWidth::Eight);
+  auto &wide = std::get<BlockBvh<8>>(eight.wide);
+  REQUIRE(std::get<BlockBvh<4>>(four.wide).bvh.nodes.size() >
+          wide.bvh.nodes.size());
+
+  // every triangle is in one block, inside the decoded box of its leaf
+  constexpr int lanes = BlockBvh<8>::LANES;
+  std::vector<int> seen(mesh.indices.size() / 3);
+  for (auto &node : wide.bvh.nodes) {
+    for (int i = 0; i < node.children; i++) {
+      REQUIRE(node.count[i] <= 8);
+      for (uint32_t k = 0; k < node.count[i]; k++) {
+        auto &block = wide.blocks[node.child[i] + k / lanes];
+        uint32_t triangle = block.triangle[k % lanes];
+        seen[triangle]++;
+        auto *index = mesh.indices.data() + 3 * triangle;
+        for (int corner = 0; corner < 3; corner++) {
+          for (int axis = 0; axis < 3; axis++) {
+            float scale = std::ldexp(1.0f, node.exponent[axis]);
+            float p = mesh.positions[3 * index[corner] + axis];
+            REQUIRE(block.p[corner][axis][k % lanes] == p);
+            REQUIRE(node.lo[axis][i] * scale + node.origin[axis] <= p);
+            REQUIRE(node.hi[axis][i] * scale + node.origin[axis] >= p);
+          }
+        }
+      }
+    }
+  }
+  REQUIRE(std::count(seen.begin(), seen.end(), 1) == int(seen.size()));
+  require_matches_linear_scan(four, 300);
+  require_matches_linear_scan(eight, 300);
+}
+
+TEST_CASE("test rays along shared node faces") {
+  using namespace Flow;
+  // a grid of quads, each flat along z and at its own height, whose boxes
+  // meet on the planes x = edge(i) and y = edge(j)
+  auto edge = [](int i) { return i * 0.3f - 1.1f; };
+  auto height = [](int i, int j) { return ((i + j) % 3) * 0.7f + 0.05f; };
+  TriangleMeshShapeData mesh;
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 8; j++) {
+      int first = mesh.positions.size() / 3;
+      float z = height(i, j);
+      mesh.positions.insert(mesh.positions.end(),
+                            {edge(i), edge(j), z, edge(i + 1), edge(j), z,
+                             edge(i + 1), edge(j + 1), z, edge(i), edge(j + 1),
+                             z});
+      mesh.indices.insert(mesh.indices.end(), {first, first + 1, first + 2,
+                                               first + 2, first + 3, first});
+    }
+  }
+
+  std::mt19937 rng(17);
+  std::uniform_real_distribution<float> along(edge(0), edge(8));
+  std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+  std::vector<Ray> rays;
+  for (int i = 0; i <= 8; i++) {
+    // rays lying in a shared face, which hit the quads along their edges
+    rays.push_back(Ray{.origin = Vec3f(edge(i), along(rng), 5.0f),
+                       .direction = Vec3f(0.0f, offset(rng), -1.0f)});
+    rays.push_back(Ray{.origin = Vec3f(along(rng), edge(i), 5.0f),
+                       .direction = Vec3f(offset(rng), 0.0f, -1.0f)});
+    // and rays from anywhere aimed at those edges, which leave one box
+    // where they enter the next
+    for (int j = 0; j < 8; j++) {
+      Vec3f origin(offset(rng) * 5.0f, offset(rng) * 5.0f, 5.0f);
+      float z = height(std::min(i, 7), j);
+      rays.push_back(
+          Ray{.origin = origin,
+              .direction = Vec3f(edge(i), along(rng), z) - origin});
+      rays.push_back(
+          Ray{.origin = origin,
+              .direction = Vec3f(along(rng), edge(i), z) - origin});
+    }
+  }
+  for (auto width : {BvhWidth::Two, BvhWidth::Four, BvhWidth::Eight}) {
+    require_matches_linear_scan(MeshBvh::build(mesh, 1, false, width), rays);
+  }
+}
+
+TEST_CASE("test triangle blocks match the scalar kernel") {
+  using namespace Flow;
+  std::mt19937 rng(13);
+  std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+  // a flat fan around the origin: rays through its shared edges and vertex
+  // exercise the double fallback, and the first of two equal hits wins
+  TriangleBlock<8> block;
+  for (int lane = 0; lane < 8; lane++) {
+    float a0 = lane * float(M_PI) / 4;
+    float a1 = (lane + 1) * float(M_PI) / 4;
+    Vec3f p[3] = {Vec3f(), Vec3f(std::cos(a0), std::sin(a0), 0.0f),
+                  Vec3f(std::cos(a1), std::sin(a1), 0.0f)};
+    for (int corner = 0; corner < 3; corner++) {
+      for (int axis = 0; axis < 3; axis++) {
+        block.p[corner][axis][lane] = p[corner][axis];
+      }
+    }
+    block.triangle[lane] = lane;
+  }
+  auto vertex = [&](int corner, int lane) {
+    return Vec3f(block.p[corner][0][lane], block.p[corner][1][lane],
+                 block.p[corner][2][lane]);
+  };
+  for (int r = 0; r < 2000; r++) {
+    auto target = r % 4 == 0 ? Vec3f()
+                             : Vec3f(position(rng), position(rng), 0.0f);
+    auto origin = Vec3f(position(rng), position(rng), 2.0f + position(rng));
+    TriangleRay ray(Ray{.origin = origin, .direction = target - origin});
+    for (int lanes : {3, 8}) {
+      float t_max = r % 3 == 0 ? 1.0f : INFINITY;
+      // hits lie around t = 1, so a t_min of 1 splits them
+      float t_min = r % 5 == 0 ? 1.0f : 0.0f;
+      int expected = -1;
+      float expected_t = t_max;
+      float expected_u, expected_v;
+      for (int lane = 0; lane < lanes; lane++) {
+        float t, u, v;
+        if (intersect_triangle(ray, vertex(0, lane), vertex(1, lane),
+                               vertex(2, lane), expected_t, t, u, v) &&
+            t > t_min) {
+          expected = lane;
+          expected_t = t;
+          expected_u = u;
+          expected_v = v;
+        }
+      }
+      float t, u, v;
+      int lane =
+          intersect_triangles(ray, block, lanes, t_min, t_max, t, u, v);
+      REQUIRE(lane == expected);
+      if (lane >= 0) {
+        REQUIRE(t == expected_t);
+        REQUIRE(u == expected_u);
+        REQUIRE(v == expected_v);
+      }
+    }
+  }
+}
+
+TEST_CASE("test occlusion matches closest hit") {
+  using namespace Flow;
+  auto mesh = make_clustered_mesh(20, 100);
+  std::mt19937 rng(9);
+  std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+  std::uniform_int_distribution<size_t> vertex(0, mesh.indices.size() - 1);
+  std::uniform_real_distribution<float> length(0.0f, 2.0f);
+  for (auto width : {BvhWidth::Two, BvhWidth::Four, BvhWidth::Eight}) {
+    auto bvh = MeshBvh::build(mesh, 1, false, width);
+    int occluded = 0;
+    int behind = 0;
+    for (int r = 0; r < 500; r++) {
+      // aimed at a vertex reached at t = 1
+      auto origin = Vec3f(position(rng), position(rng), position(rng));
+      auto *target = mesh.positions.data() + 3 * mesh.indices[vertex(rng)];
+      Ray ray{.origin = origin,
+              .direction = Vec3f(target[0], target[1], target[2]) - origin};
+      float t_max = length(rng);
+      float t_hit = t_max;
+      Hit hit;
+      bool expected = bvh.intersect(ray, t_hit, hit);
+      REQUIRE(bvh.occluded(ray, 0.0f, t_max) == expected);
+      occluded += expected;
+
+      // hits up to t_min do not count, even when they are the closest
+      float t_min = t_hit * 1.001f;
+      bool beyond = false;
+      TriangleRay triangle_ray(ray);
+      for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+        auto p = [&](size_t k) {
+          auto *xyz = mesh.positions.data() + 3 * mesh.indices[i + k];
+          return Vec3f(xyz[0], xyz[1], xyz[2]);
+        };
+        float t, u, v;
+        beyond |= intersect_triangle(triangle_ray, p(0), p(1), p(2), t_max, t,
+                                     u, v) &&
+                  t > t_min;
+      }
+      REQUIRE(bvh.occluded(ray, t_min, t_max) == beyond);
+      behind += beyond;
+    }
+    // both outcomes are covered
+    REQUIRE(occluded > 50);
+    REQUIRE(occluded < 450);
+    REQUIRE(behind > 10);
+    REQUIRE(behind < occluded);
+  }
+}